@@ -0,0 +1,511 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <math.h>
+
+// benchmark regression gate - compares repeated runs of a candidate against a stored baseline
+// input files hold JSON run objects as written by bench/workload -j: one object, an array of them
+// or several one after another; numeric leaves are metrics, named by their path (e.g. ops.read.p99_ns)
+
+#define MAX_RUNS 256
+#define MAX_KEYS 256
+#define MAX_KEY 128
+#define MAX_TEXT 64
+
+// metric directions
+#define HIGHER_BETTER 1
+#define LOWER_BETTER -1
+
+// define leaf of a run - numbers are metrics, strings only take part in the config check
+struct leaf {
+        char key[MAX_KEY];
+        char text[MAX_TEXT]; // value as written, for config comparison
+        double value;
+        int numeric;
+};
+
+// define run - flattened top level object
+struct run {
+        struct leaf leaves[MAX_KEYS];
+        unsigned int leaf_num;
+        const char* file;
+};
+
+// define side of a comparison
+struct side {
+        struct run runs[MAX_RUNS];
+        unsigned int run_num;
+};
+
+// define gated metric - matched against the last component of a key
+struct rule {
+        const char* suffix;
+        int direction;
+        const char* kind;
+};
+
+const struct rule rules[] = {
+        { "ops_per_sec", HIGHER_BETTER, "throughput" },
+        { "p99_ns", LOWER_BETTER, "tail latency" },
+        { "mprotects_per_op", LOWER_BETTER, "syscalls" },
+        { "cow_copies_per_op", LOWER_BETTER, "copies" },
+};
+
+// define parser state over one file
+struct parser {
+        const char* text;
+        size_t pos;
+        size_t len;
+        const char* file;
+        int line;
+};
+
+struct side baseline, candidate;
+double threshold = 5.0; // percent change a regression has to exceed, beyond noise
+int confidence = 95;
+unsigned long min_count = 100; // operations a latency or per-operation metric needs to be judged
+
+// report a parse error and give up - inputs are generated, a broken one is not worth recovering from
+void parse_error(struct parser* p, const char* what) {
+        fprintf(stderr, "benchcmp: %s:%d: %s\n", p->file, p->line, what);
+        exit(2);
+}
+
+// skip white space, counting lines
+void skip_space(struct parser* p) {
+        while (p->pos < p->len && strchr(" \t\r\n", p->text[p->pos])) {
+                p->line += p->text[p->pos] == '\n';
+                p->pos++;
+        }
+}
+
+// read a string into 'out' - escapes are kept as the character after the backslash
+void parse_string(struct parser* p, char* out, size_t size) {
+        size_t n = 0;
+        p->pos++; // opening quote
+        while (p->pos < p->len && p->text[p->pos] != '"') {
+                char c = p->text[p->pos++];
+                if (c == '\\' && p->pos < p->len) {
+                        c = p->text[p->pos++];
+                        if (c == 'u') {
+                                p->pos += 4; // not used by our outputs
+                                c = '?';
+                        }
+                }
+                if (n + 1 < size) {
+                        out[n++] = c;
+                }
+        }
+        if (p->pos >= p->len) {
+                parse_error(p, "unterminated string");
+        }
+        p->pos++;
+        out[n] = 0;
+}
+
+// add a leaf to a run
+void add_leaf(struct parser* p, struct run* r, const char* key, const char* text, double value, int numeric) {
+        if (r->leaf_num == MAX_KEYS) {
+                parse_error(p, "too many values in one run");
+        }
+        struct leaf* l = &r->leaves[r->leaf_num++];
+        snprintf(l->key, sizeof(l->key), "%s", key);
+        snprintf(l->text, sizeof(l->text), "%s", text);
+        l->value = value;
+        l->numeric = numeric;
+}
+
+// parse a value below 'key' into run 'r' - objects extend the key, arrays use the element index
+void parse_value(struct parser* p, struct run* r, const char* key) {
+        char sub[2 * MAX_KEY + 2], text[MAX_TEXT]; // keys longer than MAX_KEY are cut when stored
+        skip_space(p);
+        if (p->pos >= p->len) {
+                parse_error(p, "unexpected end of input");
+        }
+        char c = p->text[p->pos];
+        if (c == '{' || c == '[') {
+                char close = c == '{' ? '}' : ']';
+                unsigned int index = 0;
+                p->pos++;
+                skip_space(p);
+                if (p->pos < p->len && p->text[p->pos] == close) {
+                        p->pos++;
+                        return;
+                }
+                while (1) {
+                        char name[MAX_KEY];
+                        skip_space(p);
+                        if (close == '}') {
+                                if (p->pos >= p->len || p->text[p->pos] != '"') {
+                                        parse_error(p, "expected a member name");
+                                }
+                                parse_string(p, name, sizeof(name));
+                                skip_space(p);
+                                if (p->pos >= p->len || p->text[p->pos] != ':') {
+                                        parse_error(p, "expected ':'");
+                                }
+                                p->pos++;
+                        } else {
+                                snprintf(name, sizeof(name), "%u", index++);
+                        }
+                        snprintf(sub, sizeof(sub), "%s%s%s", key, key[0] ? "." : "", name);
+                        parse_value(p, r, sub);
+                        skip_space(p);
+                        if (p->pos < p->len && p->text[p->pos] == ',') {
+                                p->pos++;
+                                continue;
+                        }
+                        if (p->pos < p->len && p->text[p->pos] == close) {
+                                p->pos++;
+                                return;
+                        }
+                        parse_error(p, "expected ',' or closing bracket");
+                }
+        }
+        if (c == '"') {
+                parse_string(p, text, sizeof(text));
+                add_leaf(p, r, key, text, 0, 0);
+                return;
+        }
+        size_t start = p->pos;
+        while (p->pos < p->len && !strchr(" \t\r\n,}]", p->text[p->pos])) {
+                p->pos++;
+        }
+        size_t n = p->pos - start < sizeof(text) - 1 ? p->pos - start : sizeof(text) - 1;
+        memcpy(text, p->text + start, n);
+        text[n] = 0;
+        char* end;
+        double value = strtod(text, &end);
+        if (n == 0) {
+                parse_error(p, "expected a value");
+        }
+        add_leaf(p, r, key, text, value, *end == 0);
+}
+
+// read a whole file into memory
+char* read_file(const char* path, size_t* len) {
+        FILE* f = fopen(path, "r");
+        if (f == NULL) {
+                perror("ERROR: Could not open benchmark results.");
+                exit(2);
+        }
+        size_t cap = 65536, n = 0;
+        char* buf = (char*)malloc(cap);
+        size_t got;
+        while (buf != NULL && (got = fread(buf + n, 1, cap - n, f)) > 0) {
+                n += got;
+                if (n == cap) {
+                        cap *= 2;
+                        buf = (char*)realloc(buf, cap);
+                }
+        }
+        fclose(f);
+        if (buf == NULL) {
+                perror("ERROR: Could not read benchmark results.");
+                exit(2);
+        }
+        *len = n;
+        return buf;
+}
+
+// load all runs of a file - top level arrays are lists of runs; with 'merge', print the text of each run as an array element
+void load(const char* path, struct side* s, int merge, int* merged) {
+        struct parser p;
+        p.text = read_file(path, &p.len);
+        p.pos = 0;
+        p.file = path;
+        p.line = 1;
+
+        int in_array = 0;
+        while (1) {
+                skip_space(&p);
+                if (p.pos >= p.len) {
+                        break;
+                }
+                char c = p.text[p.pos];
+                if (!in_array && c == '[') {
+                        in_array = 1;
+                        p.pos++;
+                        continue;
+                }
+                if (in_array && (c == ',' || c == ']')) {
+                        in_array = c == ',';
+                        p.pos++;
+                        continue;
+                }
+                if (c != '{') {
+                        parse_error(&p, "expected a run object");
+                }
+                if (s->run_num == MAX_RUNS) {
+                        parse_error(&p, "too many runs");
+                }
+                struct run* r = &s->runs[s->run_num++];
+                r->leaf_num = 0;
+                r->file = path;
+                size_t start = p.pos;
+                parse_value(&p, r, "");
+                if (merge) {
+                        printf("%s  %.*s", (*merged)++ ? ",\n" : "[\n", (int)(p.pos - start), p.text + start);
+                }
+        }
+        free((char*)p.text);
+}
+
+// find a leaf of a run by key - NULL if missing
+const struct leaf* find_leaf(const struct run* r, const char* key) {
+        unsigned int i;
+        for (i=0; i<r->leaf_num; i++) {
+                if (strcmp(r->leaves[i].key, key) == 0) {
+                        return &r->leaves[i];
+                }
+        }
+        return NULL;
+}
+
+// configuration keys that describe the host rather than the run - reported, never compared
+const char* host_keys[] = { "config.cpus" };
+
+// helper function to check if a key describes the host
+int host_key(const char* key) {
+        unsigned int i;
+        for (i=0; i<sizeof(host_keys) / sizeof(host_keys[0]); i++) {
+                if (strcmp(key, host_keys[i]) == 0) {
+                        return 1;
+                }
+        }
+        return 0;
+}
+
+// print host keys where runs of a side differ from the reference, once per key - numbers from another machine are less comparable
+void host_report(const struct run* ref, const struct side* s, const char* name) {
+        unsigned int i, k;
+        for (k=0; k<sizeof(host_keys) / sizeof(host_keys[0]); k++) {
+                const struct leaf* a = find_leaf(ref, host_keys[k]);
+                for (i=0; a != NULL && i<s->run_num; i++) {
+                        const struct leaf* b = find_leaf(&s->runs[i], host_keys[k]);
+                        if (b != NULL && strcmp(a->text, b->text) != 0) {
+                                printf("# note: %s runs have %s %s, baseline has %s\n", name, host_keys[k], b->text, a->text);
+                                break;
+                        }
+                }
+        }
+}
+
+// check that all runs were made with the same configuration - returns the number of mismatches
+int config_check(const struct run* ref, const struct side* s) {
+        int mismatches = 0;
+        unsigned int i, k;
+        for (i=0; i<s->run_num; i++) {
+                const struct run* r = &s->runs[i];
+                for (k=0; k<ref->leaf_num; k++) {
+                        const struct leaf* a = &ref->leaves[k];
+                        if (strncmp(a->key, "config.", 7) != 0 && strcmp(a->key, "bench") != 0 && strcmp(a->key, "version") != 0) {
+                                continue;
+                        }
+                        if (host_key(a->key)) {
+                                continue;
+                        }
+                        const struct leaf* b = find_leaf(r, a->key);
+                        if (b == NULL || strcmp(a->text, b->text) != 0) {
+                                fprintf(stderr, "benchcmp: %s: %s is %s, baseline has %s\n", r->file, a->key, b ? b->text : "missing", a->text);
+                                mismatches++;
+                        }
+                }
+        }
+        return mismatches;
+}
+
+// two sided quantile of Student's t distribution - table up to 30 degrees of freedom, close fit beyond
+double t_quantile(int conf, double df) {
+        static const double t95[30] = {
+                12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+                2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+                2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042 };
+        static const double t99[30] = {
+                63.657, 9.925, 5.841, 4.604, 4.032, 3.707, 3.499, 3.355, 3.250, 3.169,
+                3.106, 3.055, 3.012, 2.977, 2.947, 2.921, 2.898, 2.878, 2.861, 2.845,
+                2.831, 2.819, 2.807, 2.797, 2.787, 2.779, 2.771, 2.763, 2.756, 2.750 };
+        int d = (int)df; // rounding down is conservative
+        if (d < 1) {
+                d = 1;
+        }
+        if (d <= 30) {
+                return conf == 99 ? t99[d - 1] : t95[d - 1];
+        }
+        return conf == 99 ? 2.576 + 5.3 / d : 1.960 + 2.4 / d;
+}
+
+// sample mean and variance of a metric over the runs of a side - returns the number of runs having it
+unsigned int sample(const struct side* s, const char* key, double* mean, double* var) {
+        double sum = 0, sq = 0;
+        unsigned int n = 0, i;
+        for (i=0; i<s->run_num; i++) {
+                const struct leaf* l = find_leaf(&s->runs[i], key);
+                if (l != NULL && l->numeric) {
+                        sum += l->value;
+                        n++;
+                }
+        }
+        *mean = n ? sum / n : 0;
+        for (i=0; i<s->run_num; i++) {
+                const struct leaf* l = find_leaf(&s->runs[i], key);
+                if (l != NULL && l->numeric) {
+                        sq += (l->value - *mean) * (l->value - *mean);
+                }
+        }
+        *var = n > 1 ? sq / (n - 1) : 0;
+        return n;
+}
+
+// smallest operation count over the runs of the operation a metric belongs to (ops.read.p99_ns -> ops.read.count)
+double group_count(const struct side* s, const char* key) {
+        char count_key[MAX_KEY];
+        const char* dot = strrchr(key, '.');
+        snprintf(count_key, sizeof(count_key), "%.*s.count", (int)(dot - key), key);
+        double min = -1;
+        unsigned int i;
+        for (i=0; i<s->run_num; i++) {
+                const struct leaf* l = find_leaf(&s->runs[i], count_key);
+                double v = l != NULL ? l->value : 0;
+                min = min < 0 || v < min ? v : min;
+        }
+        return min;
+}
+
+// compare one metric - prints a line and returns 1 on a significant regression
+int compare(const char* key, const struct rule* rule) {
+        double mb, vb, mc, vc;
+        unsigned int nb = sample(&baseline, key, &mb, &vb);
+        unsigned int nc = sample(&candidate, key, &mc, &vc);
+        if (nb == 0 || nc == 0 || mb == 0) {
+                return 0; // operation not in the mix
+        }
+        if (strncmp(key, "ops.", 4) == 0 && (group_count(&baseline, key) < min_count || group_count(&candidate, key) < min_count)) {
+                return 0; // too few operations for a stable percentile
+        }
+
+        // Welch - confidence interval of the difference of means, relative to the baseline
+        double se2 = vb / nb + vc / nc;
+        double half = 0;
+        if (se2 > 0) {
+                double df = se2 * se2 / ((nb > 1 ? vb * vb / ((double)nb * nb * (nb - 1)) : 0) + (nc > 1 ? vc * vc / ((double)nc * nc * (nc - 1)) : 0));
+                half = t_quantile(confidence, df) * sqrt(se2);
+        }
+        double change = 100 * (mc - mb) / fabs(mb);
+        double lo = 100 * (mc - mb - half) / fabs(mb);
+        double hi = 100 * (mc - mb + half) / fabs(mb);
+
+        // worse in the rule's direction - the whole interval has to be beyond the threshold
+        double worse = rule->direction == HIGHER_BETTER ? -hi : lo;
+        double better = rule->direction == HIGHER_BETTER ? lo : -hi;
+        const char* verdict = "ok";
+        int regressed = 0;
+        if (nb < 2 || nc < 2) {
+                verdict = "n/a"; // no spread, no verdict
+        } else if (worse > threshold) {
+                verdict = "REGRESSED";
+                regressed = 1;
+        } else if (better > threshold) {
+                verdict = "improved";
+        } else if (worse > 0 || better > 0) {
+                verdict = "changed"; // significant, but within the threshold
+        }
+        printf("%-28s %-12s %14.4g %14.4g %+8.1f%% [%+7.1f%%, %+7.1f%%]  %s\n",
+               key, rule->kind, mb, mc, change, lo, hi, verdict);
+        return regressed;
+}
+
+// print usage
+void usage(const char* prog) {
+        fprintf(stderr,
+                "usage: %s [options] baseline.json candidate.json...\n"
+                "       %s -m run.json... > baseline.json\n"
+                "  -t percent        change beyond noise that counts as a regression (%.1f)\n"
+                "  -c 95|99          confidence level of the intervals (%d)\n"
+                "  -n count          operations a latency metric needs to be judged (%lu)\n"
+                "  -m                merge runs of all files into one JSON array on stdout\n"
+                "files hold run objects of bench/workload -j, on their own, in an array or one after another;\n"
+                "each side needs two runs or more for a verdict; exits 1 on a regression, 2 if the runs are not comparable\n",
+                prog, prog, threshold, confidence, min_count);
+        exit(2);
+}
+
+int main(int argc, char** argv) {
+        int c, merge = 0;
+        while ((c = getopt(argc, argv, "t:c:n:m")) != -1) {
+                switch (c) {
+                case 't':
+                        threshold = atof(optarg);
+                        break;
+                case 'c':
+                        confidence = atoi(optarg);
+                        break;
+                case 'n':
+                        min_count = strtoul(optarg, NULL, 0);
+                        break;
+                case 'm':
+                        merge = 1;
+                        break;
+                default:
+                        usage(argv[0]);
+                }
+        }
+        if (confidence != 95 && confidence != 99) {
+                usage(argv[0]);
+        }
+
+        int i;
+        if (merge) {
+                int merged = 0;
+                if (optind >= argc) {
+                        usage(argv[0]);
+                }
+                for (i=optind; i<argc; i++) {
+                        load(argv[i], &candidate, 1, &merged);
+                }
+                printf(merged ? "\n]\n" : "[]\n");
+                return 0;
+        }
+
+        if (argc - optind < 2) {
+                usage(argv[0]);
+        }
+        load(argv[optind], &baseline, 0, NULL);
+        for (i=optind+1; i<argc; i++) {
+                load(argv[i], &candidate, 0, NULL);
+        }
+        if (baseline.run_num == 0 || candidate.run_num == 0) {
+                fprintf(stderr, "benchcmp: no runs to compare\n");
+                return 2;
+        }
+        if (config_check(&baseline.runs[0], &baseline) + config_check(&baseline.runs[0], &candidate) > 0) {
+                fprintf(stderr, "benchcmp: runs differ in their configuration, not comparing\n");
+                return 2;
+        }
+        if (baseline.run_num < 2 || candidate.run_num < 2) {
+                fprintf(stderr, "benchcmp: warning: %u baseline and %u candidate runs - two or more per side are needed for a verdict\n",
+                        baseline.run_num, candidate.run_num);
+        }
+
+        printf("# %u baseline runs, %u candidate runs, %d%% confidence, threshold %.1f%%\n",
+               baseline.run_num, candidate.run_num, confidence, threshold);
+        host_report(&baseline.runs[0], &baseline, "baseline");
+        host_report(&baseline.runs[0], &candidate, "candidate");
+        printf("# %-26s %-12s %14s %14s %9s %20s  %s\n", "metric", "kind", "baseline", "candidate", "change", "interval", "verdict");
+        int regressions = 0;
+        const struct run* ref = &baseline.runs[0];
+        unsigned int k, j;
+        for (k=0; k<ref->leaf_num; k++) {
+                const char* key = ref->leaves[k].key;
+                const char* last = strrchr(key, '.');
+                last = last ? last + 1 : key;
+                for (j=0; j<sizeof(rules) / sizeof(rules[0]); j++) {
+                        if (strcmp(last, rules[j].suffix) == 0) {
+                                regressions += compare(key, &rules[j]);
+                        }
+                }
+        }
+        printf("# %d regression%s\n", regressions, regressions == 1 ? "" : "s");
+        return regressions > 0;
+}
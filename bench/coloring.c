@@ -0,0 +1,224 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <linux/perf_event.h>
+#include "../tls.h"
+
+// cache coloring benchmark - threads hammer hot fields at the same offsets of their own areas
+// fields sit one page apart, so without coloring every field of every thread falls into the same L1 set
+
+#define MAX_THREADS 64
+#define MAX_CPUS 64
+
+// define benchmark configuration
+struct coloring {
+        unsigned int threads;
+        unsigned int fields; // hot fields per thread, one page apart
+        unsigned int seconds; // per run
+        unsigned int stride; // color stride of the colored run
+        unsigned int page_size;
+        int cpus[MAX_CPUS]; // threads are pinned round robin - empty for no pinning
+        unsigned int cpu_num;
+};
+
+// define per thread state
+struct worker {
+        unsigned int id;
+        pthread_t thread;
+        unsigned long ops; // field updates
+        unsigned long misses; // L1D read misses - 0 if the counter is not available
+        int counted;
+        int errors;
+};
+
+struct coloring cfg = {
+        .threads = 2,
+        .fields = 6,
+        .seconds = 2,
+        .stride = 64,
+        .page_size = 0,
+};
+
+tls_domain_t* dom;
+pthread_barrier_t barrier;
+int stop;
+struct worker workers[MAX_THREADS];
+
+// open an L1D read miss counter for the calling thread - returns -1 where perf events are not allowed
+int miss_counter_open() {
+        struct perf_event_attr pe;
+        memset(&pe, 0, sizeof(pe));
+        pe.type = PERF_TYPE_HW_CACHE;
+        pe.size = sizeof(pe);
+        pe.config = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        pe.disabled = 1;
+        pe.exclude_kernel = 1;
+        pe.exclude_hv = 1;
+        return syscall(SYS_perf_event_open, &pe, 0, -1, -1, 0);
+}
+
+// worker thread - read, bump and write back every field in turn
+void* worker_run(void* arg) {
+        struct worker* w = (struct worker*)arg;
+        unsigned int ps = cfg.page_size;
+
+        if (cfg.cpu_num > 0) {
+                cpu_set_t set;
+                CPU_ZERO(&set);
+                CPU_SET(cfg.cpus[w->id % cfg.cpu_num], &set);
+                pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        }
+        if (tls_create_in(dom, cfg.fields * ps)) {
+                w->errors++;
+        }
+        int fd = miss_counter_open();
+
+        pthread_barrier_wait(&barrier);
+        if (fd >= 0) {
+                ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+                ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+        unsigned long ops = 0;
+        while (!__atomic_load_n(&stop, __ATOMIC_RELAXED) && !w->errors) {
+                unsigned int f;
+                for (f=0; f<cfg.fields; f++) {
+                        unsigned long v;
+                        if (tls_read_fast_in(dom, f * ps, sizeof(v), (char*)&v)) {
+                                w->errors++;
+                        }
+                        v++;
+                        if (tls_write_fast_in(dom, f * ps, sizeof(v), (const char*)&v)) {
+                                w->errors++;
+                        }
+                }
+                ops += cfg.fields;
+        }
+        if (fd >= 0) {
+                ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+                long long misses = 0;
+                w->counted = read(fd, &misses, sizeof(misses)) == sizeof(misses);
+                w->misses = misses;
+                close(fd);
+        }
+        w->ops = ops;
+
+        tls_destroy_in(dom);
+        return NULL;
+}
+
+// one run with the given color stride - prints a result line
+int run(unsigned int stride) {
+        struct tls_domain_config dc = { cfg.page_size, TLS_PROTECT_NONE, 0, 0, 0, stride };
+        dom = tls_domain_create(&dc);
+        if (dom == NULL) {
+                return -1;
+        }
+        pthread_barrier_init(&barrier, NULL, cfg.threads + 1);
+        __atomic_store_n(&stop, 0, __ATOMIC_RELAXED);
+
+        unsigned int i;
+        for (i=0; i<cfg.threads; i++) {
+                memset(&workers[i], 0, sizeof(workers[i]));
+                workers[i].id = i;
+                if (pthread_create(&workers[i].thread, NULL, worker_run, &workers[i])) {
+                        perror("ERROR: Could not start worker.");
+                        return -1;
+                }
+        }
+        pthread_barrier_wait(&barrier);
+        struct timespec t0, t1;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        sleep(cfg.seconds);
+        __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+
+        unsigned long ops = 0, misses = 0;
+        int counted = 1, errors = 0;
+        for (i=0; i<cfg.threads; i++) {
+                pthread_join(workers[i].thread, NULL);
+                ops += workers[i].ops;
+                misses += workers[i].misses;
+                counted &= workers[i].counted;
+                errors += workers[i].errors;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+        pthread_barrier_destroy(&barrier);
+        tls_domain_destroy(dom);
+
+        char stride_name[16];
+        snprintf(stride_name, sizeof(stride_name), stride ? "%u" : "off", stride);
+        if (counted && ops > 0) {
+                printf("%8s %14.1f %16.3f\n", stride_name, ops / secs / 1e6, (double)misses / ops);
+        } else {
+                printf("%8s %14.1f %16s\n", stride_name, ops / secs / 1e6, "n/a");
+        }
+        return errors ? -1 : 0;
+}
+
+// print usage
+void usage(const char* prog) {
+        fprintf(stderr,
+                "usage: %s [options]\n"
+                "  -t threads        threads hammering their areas (%u)\n"
+                "  -f fields         hot fields per thread, one page apart (%u)\n"
+                "  -d seconds        duration of each run (%u)\n"
+                "  -k stride         color stride of the colored run (%u)\n"
+                "  -g bytes          domain page size (system page)\n"
+                "  -c cpu,cpu,...    pin threads round robin, e.g. two hyperthread siblings\n"
+                "runs once without and once with coloring, misses are L1D read misses per field update\n",
+                prog, cfg.threads, cfg.fields, cfg.seconds, cfg.stride);
+        exit(2);
+}
+
+int main(int argc, char** argv) {
+        int c;
+        char* cpu;
+        while ((c = getopt(argc, argv, "t:f:d:k:g:c:")) != -1) {
+                switch (c) {
+                case 't':
+                        cfg.threads = atoi(optarg);
+                        break;
+                case 'f':
+                        cfg.fields = atoi(optarg);
+                        break;
+                case 'd':
+                        cfg.seconds = atoi(optarg);
+                        break;
+                case 'k':
+                        cfg.stride = atoi(optarg);
+                        break;
+                case 'g':
+                        cfg.page_size = strtoul(optarg, NULL, 0);
+                        break;
+                case 'c':
+                        for (cpu = strtok(optarg, ","); cpu != NULL && cfg.cpu_num < MAX_CPUS; cpu = strtok(NULL, ",")) {
+                                cfg.cpus[cfg.cpu_num++] = atoi(cpu);
+                        }
+                        break;
+                default:
+                        usage(argv[0]);
+                }
+        }
+        if (cfg.threads == 0 || cfg.threads > MAX_THREADS || cfg.fields == 0 || cfg.seconds == 0 || cfg.stride == 0) {
+                usage(argv[0]);
+        }
+        if (cfg.page_size == 0) {
+                cfg.page_size = getpagesize();
+        }
+        cfg.page_size = (cfg.page_size + getpagesize() - 1) / getpagesize() * getpagesize();
+
+        printf("# %u threads, %u fields each, %u byte pages\n", cfg.threads, cfg.fields, cfg.page_size);
+        printf("# %6s %14s %16s\n", "color", "Mupdates/s", "L1D_miss/update");
+        if (run(0) || run(cfg.stride)) {
+                return 1;
+        }
+        return 0;
+}
@@ -0,0 +1,650 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include "../tls.h"
+
+// differential harness - random operations from many threads against tls.c and the reference model in tls_ref.c
+// every read, and the whole area after clones, compaction, spill passes and freezing, must match the model
+
+#define MAX_THREADS 64
+#define MAX_CHILDREN 3 // clones per clone operation
+#define CHILD_OPS 16 // operations of a clone before it is checked and destroyed
+#define PERCPU_OPS 100000 // per-CPU updates per thread
+
+// reference model
+int ref_create(unsigned int size);
+int ref_destroy();
+int ref_read(unsigned int offset, unsigned int length, char* buffer);
+int ref_write(unsigned int offset, unsigned int length, const char* buffer);
+int ref_clone(pthread_t tid);
+int ref_clone_range(pthread_t tid, const struct tls_range* ranges, unsigned int range_num);
+unsigned int ref_match(unsigned int offset, unsigned int length, const char* seen);
+
+// define harness configuration
+struct harness {
+        unsigned int threads;
+        unsigned int ops; // operations per thread
+        unsigned int max_size; // largest area in bytes
+        unsigned int page_size; // domain page size (0 = system page)
+        int protection;
+        unsigned int pool_pages;
+        unsigned int compact_threshold;
+        unsigned int color_stride;
+        const char* spill_path; // spill file - NULL to leave spilling out
+        int fast; // go through the inline fast path of tls.h
+        unsigned long seed;
+};
+
+// define per thread state
+struct worker {
+        unsigned int id;
+        pthread_t thread;
+        pthread_t tid; // set by the thread itself - clones target it
+        unsigned int size; // size of the current area
+        uint64_t rng;
+        unsigned long ops;
+        char* lib_buf; // two buffers of max_size
+        char* ref_buf;
+        int finished; // stays 0 if the fault handler ended the thread
+};
+
+// define clone fan-out - the parent writes only once every child has cloned
+struct fanout {
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+        unsigned int cloned;
+};
+
+// define clone child
+struct child {
+        struct worker* parent;
+        struct fanout* fan;
+        uint64_t rng;
+        int cloned; // counted in the fan-out
+        int finished;
+};
+
+struct harness cfg = {
+        .threads = 8,
+        .ops = 20000,
+        .max_size = 65536,
+        .page_size = 0,
+        .protection = 0,
+        .pool_pages = 0,
+        .compact_threshold = 0,
+        .spill_path = NULL,
+        .seed = 1,
+};
+
+tls_domain_t* dom;
+unsigned int dom_page_size;
+int failed;
+unsigned long total_ops;
+struct worker workers[MAX_THREADS];
+
+// xorshift64*
+uint64_t rng_next(uint64_t* s) {
+        *s ^= *s >> 12;
+        *s ^= *s << 25;
+        *s ^= *s >> 27;
+        return *s * 0x2545F4914F6CDD1DULL;
+}
+
+// read from the library - inline fast path if asked for
+int lib_read(unsigned int offset, unsigned int length, char* buffer) {
+        return cfg.fast ? tls_read_fast_in(dom, offset, length, buffer) : tls_read_in(dom, offset, length, buffer);
+}
+
+// write to the library - inline fast path if asked for
+int lib_write(unsigned int offset, unsigned int length, char* buffer) {
+        return cfg.fast ? tls_write_fast_in(dom, offset, length, buffer) : tls_write_in(dom, offset, length, buffer);
+}
+
+// report a mismatch and make all threads stop
+void fail(struct worker* w, const char* what, unsigned int offset, int lib, int ref) {
+        if (__atomic_exchange_n(&failed, 1, __ATOMIC_RELAXED)) {
+                return;
+        }
+        fprintf(stderr, "difftest: MISMATCH thread %u op %lu: %s at offset %u (tls %d, ref %d) - seed %lu\n",
+                w->id, w->ops, what, offset, lib, ref, cfg.seed);
+}
+
+// compare a range of both models
+int check_range(struct worker* w, unsigned int offset, unsigned int length, const char* what) {
+        int lib = lib_read(offset, length, w->lib_buf);
+        int ref = ref_read(offset, length, w->ref_buf);
+        if (lib != ref) {
+                fail(w, what, offset, lib, ref);
+                return -1;
+        }
+        unsigned int i;
+        if (lib == 0 && (i = ref_match(offset, length, w->lib_buf)) < length) {
+                fail(w, what, offset + i, (unsigned char)w->lib_buf[i], (unsigned char)w->ref_buf[i]);
+                return -1;
+        }
+        return 0;
+}
+
+// compare whole area
+int check_all(struct worker* w, const char* what) {
+        return check_range(w, 0, w->size, what);
+}
+
+// random access within the current area - spans a few pages at most
+void pick_range(struct worker* w, unsigned int* offset, unsigned int* length) {
+        unsigned int max = dom_page_size * 3 < w->size ? dom_page_size * 3 : w->size;
+        *length = 1 + rng_next(&w->rng) % max;
+        *offset = rng_next(&w->rng) % (w->size - *length + 1);
+}
+
+// random write to both models
+int do_write(struct worker* w) {
+        unsigned int offset, length, i;
+        pick_range(w, &offset, &length);
+        for (i=0; i<length; i++) {
+                w->lib_buf[i] = (char)rng_next(&w->rng);
+        }
+        int lib = lib_write(offset, length, w->lib_buf);
+        int ref = ref_write(offset, length, w->lib_buf);
+        if (lib != ref) {
+                fail(w, "write result", offset, lib, ref);
+                return -1;
+        }
+        return 0;
+}
+
+// random read from both models
+int do_read(struct worker* w) {
+        unsigned int offset, length;
+        pick_range(w, &offset, &length);
+        return check_range(w, offset, length, "read");
+}
+
+// count a child as cloned - also run if the fault handler ends it, so the parent never waits for it forever
+void child_cloned(void* arg) {
+        struct child* c = (struct child*)arg;
+        if (c->cloned) {
+                return;
+        }
+        c->cloned = 1;
+        pthread_mutex_lock(&c->fan->lock);
+        c->fan->cloned++;
+        pthread_cond_signal(&c->fan->cond);
+        pthread_mutex_unlock(&c->fan->lock);
+}
+
+// clone child - works on its own copy, then goes away
+void* child_run(void* arg) {
+        struct child* c = (struct child*)arg;
+        struct worker* parent = c->parent;
+        struct worker w;
+        memset(&w, 0, sizeof(w));
+        w.id = parent->id;
+        w.ops = parent->ops;
+        w.tid = pthread_self();
+        w.size = parent->size;
+        w.rng = c->rng;
+        w.lib_buf = (char*)malloc(cfg.max_size);
+        w.ref_buf = (char*)malloc(cfg.max_size);
+        if (w.lib_buf == NULL || w.ref_buf == NULL) {
+                fail(&w, "child allocation", 0, 0, 0);
+                free(w.lib_buf);
+                free(w.ref_buf);
+                child_cloned(c);
+                return NULL;
+        }
+        pthread_cleanup_push(child_cloned, c);
+
+        // full clone or a few ranges - the model cannot tell where colored pages start, so coloring sticks to full clones
+        int lib, ref;
+        if (rng_next(&w.rng) % 2 || cfg.color_stride > 0) {
+                lib = tls_clone_in(dom, parent->tid);
+                ref = ref_clone(parent->tid);
+        } else {
+                struct tls_range ranges[3];
+                unsigned int n = 1 + rng_next(&w.rng) % 3, i;
+                for (i=0; i<n; i++) {
+                        pick_range(&w, &ranges[i].offset, &ranges[i].length);
+                }
+                lib = tls_clone_range_in(dom, parent->tid, ranges, n);
+                ref = ref_clone_range(parent->tid, ranges, n);
+        }
+        child_cloned(c);
+        if (lib != ref) {
+                fail(&w, "clone result", 0, lib, ref);
+        }
+        if (lib == 0 && ref == 0 && !failed) {
+                if (check_all(&w, "clone contents") == 0) {
+                        int i;
+                        for (i=0; i<CHILD_OPS && !failed; i++) {
+                                if (rng_next(&w.rng) % 2) {
+                                        do_write(&w);
+                                } else {
+                                        do_read(&w);
+                                }
+                        }
+                        check_all(&w, "clone after writes");
+                }
+        }
+        if (lib == 0) {
+                tls_destroy_in(dom);
+        }
+        if (ref == 0) {
+                ref_destroy();
+        }
+        free(w.lib_buf);
+        free(w.ref_buf);
+        pthread_cleanup_pop(0);
+        c->finished = 1;
+        return NULL;
+}
+
+// clone fan-out - parent and clones write at the same time, neither may see the other's writes
+int do_clone(struct worker* w) {
+        pthread_t children[MAX_CHILDREN];
+        struct child c[MAX_CHILDREN];
+        struct fanout fan = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0 };
+        unsigned int n = 1 + rng_next(&w->rng) % MAX_CHILDREN, i, started = 0;
+        for (i=0; i<n; i++) {
+                c[i].parent = w;
+                c[i].fan = &fan;
+                c[i].rng = rng_next(&w->rng) | 1;
+                c[i].cloned = 0;
+                c[i].finished = 0;
+                if (pthread_create(&children[i], NULL, child_run, &c[i])) {
+                        break;
+                }
+                started++;
+        }
+
+        // the clones must have taken their contents before the parent changes them
+        pthread_mutex_lock(&fan.lock);
+        while (fan.cloned < started) {
+                pthread_cond_wait(&fan.cond, &fan.lock);
+        }
+        pthread_mutex_unlock(&fan.lock);
+        for (i=0; i<CHILD_OPS && !failed; i++) {
+                if (rng_next(&w->rng) % 2) {
+                        do_write(w);
+                } else {
+                        do_read(w);
+                }
+        }
+
+        for (i=0; i<started; i++) {
+                pthread_join(children[i], NULL);
+                if (!c[i].finished) {
+                        fail(w, "clone thread ended by a fault on its own area", 0, 0, 0);
+                }
+        }
+        return check_all(w, "parent after clones");
+}
+
+// replace the area with a fresh one of random size
+int do_recreate(struct worker* w) {
+        unsigned int size = 1 + rng_next(&w->rng) % cfg.max_size;
+        int lib = tls_destroy_in(dom);
+        int ref = ref_destroy();
+        if (lib != ref) {
+                fail(w, "destroy result", 0, lib, ref);
+                return -1;
+        }
+        lib = tls_create_in(dom, size);
+        ref = ref_create(size);
+        if (lib != ref) {
+                fail(w, "create result", size, lib, ref);
+                return -1;
+        }
+        w->size = size;
+        return check_all(w, "fresh area");
+}
+
+// freeze the area and read it back lock-free, then leave it detached - tls_domain_destroy reclaims it
+int do_freeze(struct worker* w) {
+        if (tls_freeze_in(dom, rng_next(&w->rng) % 2 ? TLS_FREEZE_READABLE : 0)) {
+                fail(w, "freeze result", 0, -1, 0);
+                return -1;
+        }
+        int lib = tls_read_from_in(dom, w->tid, 0, w->size, w->lib_buf);
+        int ref = ref_read(0, w->size, w->ref_buf);
+        if (lib != ref) {
+                fail(w, "frozen read result", 0, lib, ref);
+                return -1;
+        }
+        unsigned int i;
+        if (lib == 0 && (i = ref_match(0, w->size, w->lib_buf)) < w->size) {
+                fail(w, "frozen contents", i, (unsigned char)w->lib_buf[i], (unsigned char)w->ref_buf[i]);
+                return -1;
+        }
+        return do_recreate(w);
+}
+
+// define failure injection state - a clone that shares the area of the main thread while its writes fail
+struct injection {
+        pthread_t target;
+        pthread_barrier_t cloned; // clone is in place
+        pthread_barrier_t done; // main thread is done writing
+        const char* expect; // what the clone must still read
+        unsigned int size;
+        int ok;
+};
+
+// clone of the injection case - must keep the contents it cloned whatever the target does
+void* inject_clone(void* arg) {
+        struct injection* in = (struct injection*)arg;
+        int cloned = tls_clone_in(dom, in->target) == 0;
+        pthread_barrier_wait(&in->cloned);
+        pthread_barrier_wait(&in->done);
+        if (cloned) {
+                char* buf = (char*)malloc(in->size);
+                in->ok = buf != NULL && tls_read_in(dom, 0, in->size, buf) == 0 && memcmp(buf, in->expect, in->size) == 0;
+                free(buf);
+                tls_destroy_in(dom);
+        }
+        return NULL;
+}
+
+// mprotect calls of one read of a whole area - the same before and after a failed write if no page was left open
+unsigned long read_mprotects(unsigned int size, char* buf) {
+        struct tls_counters before, after;
+        tls_counters_in(dom, &before);
+        tls_read_in(dom, 0, size, buf);
+        tls_counters_in(dom, &after);
+        return after.mprotects - before.mprotects;
+}
+
+// write to a shared page while no memory can be mapped - the failed CoW must change nothing and close every page
+// it opened, so the area and its clone stay protected; runs alone after the workers
+int inject_cow_failure() {
+        struct injection in;
+        memset(&in, 0, sizeof(in));
+        in.target = pthread_self();
+        in.size = dom_page_size * 4;
+        char* expect = (char*)malloc(in.size);
+        char* cloned = (char*)malloc(in.size);
+        char* buf = (char*)malloc(in.size);
+        if (expect == NULL || cloned == NULL || buf == NULL || tls_create_in(dom, in.size)) {
+                free(expect);
+                free(cloned);
+                free(buf);
+                return -1;
+        }
+        unsigned int i;
+        for (i=0; i<in.size; i++) {
+                expect[i] = (char)(i * 7 + 1);
+        }
+        tls_write_in(dom, 0, in.size, expect);
+        memcpy(cloned, expect, in.size);
+        in.expect = cloned;
+        pthread_barrier_init(&in.cloned, NULL, 2);
+        pthread_barrier_init(&in.done, NULL, 2);
+        pthread_t clone;
+        int started = pthread_create(&clone, NULL, inject_clone, &in) == 0;
+        if (started) {
+                pthread_barrier_wait(&in.cloned);
+        }
+        unsigned long mprotects = read_mprotects(in.size, buf);
+
+        // no room for another mapping - a pooled page may still let the write through
+        struct rlimit old, low;
+        getrlimit(RLIMIT_AS, &old);
+        unsigned long vm_pages = 0;
+        FILE* statm = fopen("/proc/self/statm", "r");
+        if (statm != NULL) {
+                if (fscanf(statm, "%lu", &vm_pages) != 1) {
+                        vm_pages = 0;
+                }
+                fclose(statm);
+        }
+        low = old;
+        low.rlim_cur = vm_pages * getpagesize();
+        int limited = vm_pages > 0 && setrlimit(RLIMIT_AS, &low) == 0;
+        char data[16];
+        memset(data, 0x5a, sizeof(data));
+        int lib = tls_write_in(dom, dom_page_size + 8, sizeof(data), data);
+        if (limited) {
+                setrlimit(RLIMIT_AS, &old);
+        }
+
+        int bad = 0;
+        if (lib == 0) {
+                memcpy(expect + dom_page_size + 8, data, sizeof(data)); // the write went through after all - the copy splits the run
+        }
+        if (lib != 0 && read_mprotects(in.size, buf) != mprotects) {
+                fprintf(stderr, "difftest: MISMATCH pages left open by a failed write (limited %d, write %d)\n", limited, lib);
+                bad = 1;
+        }
+        if (tls_read_in(dom, 0, in.size, buf) || memcmp(buf, expect, in.size) != 0) {
+                fprintf(stderr, "difftest: MISMATCH area changed by a failed write\n");
+                bad = 1;
+        }
+
+        // a later write still copies on write - the clone keeps its contents
+        memset(data, 0xa5, sizeof(data));
+        if (tls_write_in(dom, dom_page_size + 8, sizeof(data), data)) {
+                fprintf(stderr, "difftest: MISMATCH write after a failed write\n");
+                bad = 1;
+        }
+        if (started) {
+                pthread_barrier_wait(&in.done);
+                pthread_join(clone, NULL);
+                if (!in.ok) {
+                        fprintf(stderr, "difftest: MISMATCH clone changed by the writes of its target\n");
+                        bad = 1;
+                }
+        }
+        pthread_barrier_destroy(&in.cloned);
+        pthread_barrier_destroy(&in.done);
+        tls_destroy_in(dom);
+        free(expect);
+        free(cloned);
+        free(buf);
+        return -bad;
+}
+
+// per-CPU updates of one thread - every compare-and-store retries with the value it found
+void* percpu_run(void* arg) {
+        unsigned int i;
+        for (i=0; i<PERCPU_OPS; i++) {
+                long seen = 0;
+                int r;
+                while ((r = tls_percpu_cas_in(dom, 0, &seen, seen + 1)) == 1);
+                if (r || tls_percpu_add_in(dom, sizeof(long), 1)) {
+                        *(int*)arg = 1;
+                        return NULL;
+                }
+        }
+        return NULL;
+}
+
+// count with compare-and-store and with adds on the per-CPU areas from every thread at once - a lost or doubled
+// update shows in the sums; runs alone after the workers
+int check_percpu() {
+        if (tls_percpu_create_in(dom, 2 * sizeof(long))) {
+                return -1;
+        }
+        pthread_t threads[MAX_THREADS];
+        int errors[MAX_THREADS];
+        unsigned int i, started = 0;
+        for (i=0; i<cfg.threads; i++) {
+                errors[i] = 0;
+                if (pthread_create(&threads[i], NULL, percpu_run, &errors[i])) {
+                        break;
+                }
+                started++;
+        }
+        int bad = 0;
+        for (i=0; i<started; i++) {
+                pthread_join(threads[i], NULL);
+                bad |= errors[i];
+        }
+        long stored = 0, added = 0;
+        long expect = (long)started * PERCPU_OPS;
+        if (bad || tls_percpu_sum_in(dom, 0, &stored) || tls_percpu_sum_in(dom, sizeof(long), &added)
+            || stored != expect || added != expect) {
+                fprintf(stderr, "difftest: MISMATCH per-CPU sums %ld and %ld, expected %ld\n", stored, added, expect);
+                bad = 1;
+        }
+        tls_percpu_destroy_in(dom);
+        return -bad;
+}
+
+// worker thread
+void* worker_run(void* arg) {
+        struct worker* w = (struct worker*)arg;
+        w->tid = pthread_self();
+        w->size = 1 + rng_next(&w->rng) % cfg.max_size;
+        if (tls_create_in(dom, w->size) || ref_create(w->size)) {
+                fail(w, "create", 0, 0, 0);
+                return NULL;
+        }
+
+        for (w->ops = 0; w->ops < cfg.ops && !__atomic_load_n(&failed, __ATOMIC_RELAXED); w->ops++) {
+                unsigned int r = rng_next(&w->rng) % 100;
+                if (r < 40) {
+                        do_read(w);
+                } else if (r < 80) {
+                        do_write(w);
+                } else if (r < 85) {
+                        do_clone(w);
+                } else if (r < 87) {
+                        do_recreate(w);
+                } else if (r < 88) {
+                        do_freeze(w);
+                } else if (r < 92) {
+                        tls_compact_in(dom, NULL);
+                        check_all(w, "after compaction");
+                } else if (r < 96 && cfg.spill_path != NULL) {
+                        tls_set_spillable_in(dom, 1 + rng_next(&w->rng) % 2);
+                        tls_spill_cold_in(dom);
+                        check_all(w, "after spill pass");
+                } else {
+                        check_all(w, "full check");
+                }
+        }
+        __atomic_add_fetch(&total_ops, w->ops, __ATOMIC_RELAXED);
+
+        tls_destroy_in(dom);
+        ref_destroy();
+        w->finished = 1;
+        return NULL;
+}
+
+// print usage
+void usage(const char* prog) {
+        fprintf(stderr,
+                "usage: %s [options]\n"
+                "  -t threads        worker threads (%u)\n"
+                "  -n ops            operations per thread (%u)\n"
+                "  -s bytes          largest area (%u)\n"
+                "  -g bytes          domain page size (system page)\n"
+                "  -N                no page protection (TLS_PROTECT_NONE)\n"
+                "  -p pages          page supplier stock (0)\n"
+                "  -c splits         CoW splits that trigger compaction (0)\n"
+                "  -k stride         cache coloring stride (0) - clones are full clones then\n"
+                "  -f path           spill file - adds spill passes to the mix\n"
+                "  -F                read and write through the inline fast path of tls.h\n"
+                "  -S seed           random seed (%lu)\n",
+                prog, cfg.threads, cfg.ops, cfg.max_size, cfg.seed);
+        exit(2);
+}
+
+int main(int argc, char** argv) {
+        int c;
+        while ((c = getopt(argc, argv, "t:n:s:g:Np:c:k:f:FS:")) != -1) {
+                switch (c) {
+                case 't':
+                        cfg.threads = atoi(optarg);
+                        break;
+                case 'n':
+                        cfg.ops = atoi(optarg);
+                        break;
+                case 's':
+                        cfg.max_size = strtoul(optarg, NULL, 0);
+                        break;
+                case 'g':
+                        cfg.page_size = strtoul(optarg, NULL, 0);
+                        break;
+                case 'N':
+                        cfg.protection = 1;
+                        break;
+                case 'p':
+                        cfg.pool_pages = atoi(optarg);
+                        break;
+                case 'c':
+                        cfg.compact_threshold = atoi(optarg);
+                        break;
+                case 'k':
+                        cfg.color_stride = atoi(optarg);
+                        break;
+                case 'f':
+                        cfg.spill_path = optarg;
+                        break;
+                case 'F':
+                        cfg.fast = 1;
+                        break;
+                case 'S':
+                        cfg.seed = strtoul(optarg, NULL, 0);
+                        break;
+                default:
+                        usage(argv[0]);
+                }
+        }
+        if (cfg.threads == 0 || cfg.threads > MAX_THREADS || cfg.max_size == 0) {
+                usage(argv[0]);
+        }
+
+        struct tls_domain_config dc = { cfg.page_size, cfg.protection, cfg.pool_pages, 0, cfg.compact_threshold, cfg.color_stride };
+        dom = tls_domain_create(&dc);
+        if (dom == NULL) {
+                return 2;
+        }
+        dom_page_size = cfg.page_size ? (cfg.page_size + getpagesize() - 1) / getpagesize() * getpagesize() : getpagesize();
+        if (cfg.spill_path != NULL && tls_spill_open_in(dom, cfg.spill_path)) {
+                return 2;
+        }
+
+        unsigned int i;
+        for (i=0; i<cfg.threads; i++) {
+                workers[i].id = i;
+                workers[i].rng = (cfg.seed + 1) * 0x9E3779B97F4A7C15ULL + i;
+                workers[i].lib_buf = (char*)malloc(cfg.max_size);
+                workers[i].ref_buf = (char*)malloc(cfg.max_size);
+                if (workers[i].lib_buf == NULL || workers[i].ref_buf == NULL) {
+                        perror("ERROR: Buffer allocation failed.");
+                        return 2;
+                }
+                if (pthread_create(&workers[i].thread, NULL, worker_run, &workers[i])) {
+                        perror("ERROR: Could not start worker.");
+                        return 2;
+                }
+        }
+        for (i=0; i<cfg.threads; i++) {
+                pthread_join(workers[i].thread, NULL);
+                if (!workers[i].finished && !failed) {
+                        fail(&workers[i], "worker ended by a fault on its own area", 0, 0, 0);
+                }
+                free(workers[i].lib_buf);
+                free(workers[i].ref_buf);
+        }
+
+        if (!failed && inject_cow_failure()) {
+                failed = 1;
+        }
+        if (!failed && check_percpu()) {
+                failed = 1;
+        }
+
+        // frozen areas left behind by the workers go with the domain
+        if (tls_domain_destroy(dom)) {
+                fprintf(stderr, "difftest: domain with frozen areas could not be destroyed\n");
+                failed = 1;
+        }
+        printf("difftest: %lu operations on %u threads, seed %lu: %s\n", total_ops, cfg.threads, cfg.seed, failed ? "FAILED" : "OK");
+        return failed;
+}
@@ -0,0 +1,277 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <malloc.h>
+#include "../tls.h"
+
+// memory footprint benchmark - builds chains of areas and clones and reports what they cost in
+// resident memory, mappings and library metadata rather than in time
+
+#define MAX_SIZES 16
+#define MAX_DEPTH 16
+#define MAX_THREADS 4096
+
+// define benchmark configuration
+struct footprint {
+        unsigned int areas; // chains per run - each starts with one created area
+        unsigned int sizes[MAX_SIZES]; // area sizes, one run per size and depth
+        unsigned int size_num;
+        unsigned int depth; // clones per chain, each cloning the previous one
+        double write_fraction; // share of the pages each clone writes
+        unsigned int page_size;
+        int protection;
+        unsigned int pool_pages;
+};
+
+// define memory snapshot of the process
+struct usage {
+        unsigned long rss; // resident bytes
+        unsigned long vmas; // lines of /proc/self/maps
+        unsigned long heap; // bytes handed out by malloc, all arenas
+};
+
+// define per thread state - thread 'chain' * (depth + 1) + 'level' clones the one at 'level' - 1
+struct member {
+        unsigned int chain;
+        unsigned int level;
+        pthread_t thread;
+        int errors;
+};
+
+struct footprint cfg = {
+        .areas = 64,
+        .sizes = { 4096, 65536, 1 << 20 },
+        .size_num = 3,
+        .depth = 2,
+        .write_fraction = 0.25,
+        .page_size = 0,
+        .protection = TLS_PROTECT_PAGES,
+        .pool_pages = 0,
+};
+
+tls_domain_t* dom;
+pthread_barrier_t barrier;
+struct member members[MAX_THREADS];
+unsigned int run_size, run_depth;
+char* source; // contents written by chain roots - allocated before the baseline
+
+// take a memory snapshot
+void usage_read(struct usage* u) {
+        memset(u, 0, sizeof(*u));
+        FILE* f = fopen("/proc/self/statm", "r");
+        if (f != NULL) {
+                unsigned long total, resident;
+                if (fscanf(f, "%lu %lu", &total, &resident) == 2) {
+                        u->rss = resident * getpagesize();
+                }
+                fclose(f);
+        }
+        f = fopen("/proc/self/maps", "r");
+        if (f != NULL) {
+                int c;
+                while ((c = fgetc(f)) != EOF) {
+                        u->vmas += c == '\n';
+                }
+                fclose(f);
+        }
+        struct mallinfo2 mi = mallinfo2();
+        u->heap = mi.uordblks + mi.hblkhd;
+}
+
+// build one member of a chain - the root creates and fills its area, clones write a share of their pages
+int member_build(struct member* m) {
+        if (m->level == 0) {
+                if (tls_create_in(dom, run_size)) {
+                        return -1;
+                }
+                return tls_write_in(dom, 0, run_size, source);
+        }
+        if (tls_clone_in(dom, members[m->chain * (run_depth + 1) + m->level - 1].thread)) {
+                return -1;
+        }
+        unsigned int ps = cfg.page_size;
+        unsigned int pages = (run_size + ps - 1) / ps;
+        unsigned int writes = (unsigned int)(pages * cfg.write_fraction + 0.5);
+        unsigned int i;
+        for (i=0; i<writes; i++) {
+                unsigned int offset = (unsigned int)((unsigned long)i * pages / writes) * ps;
+                unsigned long v = ((unsigned long)m->chain << 32) | m->level;
+                if (tls_write_in(dom, offset, offset + sizeof(v) <= run_size ? sizeof(v) : 1, (char*)&v)) {
+                        return -1;
+                }
+        }
+        return 0;
+}
+
+// member thread - one build step per chain level, then hold the area until the snapshot is taken
+void* member_run(void* arg) {
+        struct member* m = (struct member*)arg;
+        unsigned int level;
+
+        pthread_barrier_wait(&barrier); // baseline
+        for (level=0; level<=run_depth; level++) {
+                if (level == m->level && member_build(m)) {
+                        m->errors++;
+                }
+                pthread_barrier_wait(&barrier);
+        }
+        pthread_barrier_wait(&barrier); // snapshot taken
+        tls_destroy_in(dom);
+        pthread_barrier_wait(&barrier);
+        return NULL;
+}
+
+// one run - prints a result line unless 'quiet'
+int run(unsigned int size, unsigned int depth, int quiet) {
+        struct tls_domain_config dc = { cfg.page_size, cfg.protection, cfg.pool_pages, 0, 0, 0 };
+        dom = tls_domain_create(&dc);
+        if (dom == NULL) {
+                return -1;
+        }
+        run_size = size;
+        run_depth = depth;
+        unsigned int n = cfg.areas * (depth + 1);
+        pthread_barrier_init(&barrier, NULL, n + 1);
+
+        unsigned int i;
+        for (i=0; i<n; i++) {
+                memset(&members[i], 0, sizeof(members[i]));
+                members[i].chain = i / (depth + 1);
+                members[i].level = i % (depth + 1);
+                if (pthread_create(&members[i].thread, NULL, member_run, &members[i])) {
+                        perror("ERROR: Could not start member.");
+                        exit(1);
+                }
+        }
+
+        // threads exist in all snapshots - only the areas make the difference
+        struct usage base, built, after;
+        usage_read(&base);
+        pthread_barrier_wait(&barrier);
+        for (i=0; i<=depth; i++) {
+                pthread_barrier_wait(&barrier);
+        }
+        usage_read(&built);
+        pthread_barrier_wait(&barrier);
+        pthread_barrier_wait(&barrier);
+        usage_read(&after);
+
+        int errors = 0;
+        for (i=0; i<n; i++) {
+                pthread_join(members[i].thread, NULL);
+                errors += members[i].errors;
+        }
+        pthread_barrier_destroy(&barrier);
+        tls_domain_destroy(dom);
+
+        // useful bytes are what the areas can address - clones sharing pages push the ratio below 1
+        long rss = built.rss - base.rss;
+        long vmas = built.vmas - base.vmas;
+        long heap = built.heap - base.heap;
+        double useful = (double)n * size;
+        if (quiet) {
+                return errors ? -1 : 0;
+        }
+        printf("%10u %5u %6u %12ld %8ld %12ld %9.3f %10.1f %12.1f %9ld %9ld\n",
+               size, depth, n, rss, vmas, heap, rss / useful, (double)vmas / n, (double)heap / n,
+               (long)(after.rss - base.rss), (long)(after.vmas - base.vmas));
+        fflush(stdout);
+        return errors ? -1 : 0;
+}
+
+// print usage
+void usage(const char* prog) {
+        fprintf(stderr,
+                "usage: %s [options]\n"
+                "  -a areas          chains per run, each starting with a created area (%u)\n"
+                "  -s bytes,...      area sizes (4096,65536,1048576)\n"
+                "  -c depth          clones per chain, each cloning the previous one - runs 0..depth (%u)\n"
+                "  -w fraction       share of the pages each clone writes (%.2f)\n"
+                "  -g bytes          domain page size (system page)\n"
+                "  -n                no page protection (TLS_PROTECT_NONE)\n"
+                "  -p pages          page pool stock (0)\n"
+                "rss, vmas and heap are the growth over a baseline taken with all threads started;\n"
+                "left_rss and left_vmas remain after all areas are destroyed\n",
+                prog, cfg.areas, cfg.depth, cfg.write_fraction);
+        exit(2);
+}
+
+int main(int argc, char** argv) {
+        int c;
+        char* size;
+        while ((c = getopt(argc, argv, "a:s:c:w:g:np:")) != -1) {
+                switch (c) {
+                case 'a':
+                        cfg.areas = atoi(optarg);
+                        break;
+                case 's':
+                        cfg.size_num = 0;
+                        for (size = strtok(optarg, ","); size != NULL && cfg.size_num < MAX_SIZES; size = strtok(NULL, ",")) {
+                                cfg.sizes[cfg.size_num++] = strtoul(size, NULL, 0);
+                        }
+                        break;
+                case 'c':
+                        cfg.depth = atoi(optarg);
+                        break;
+                case 'w':
+                        cfg.write_fraction = atof(optarg);
+                        break;
+                case 'g':
+                        cfg.page_size = strtoul(optarg, NULL, 0);
+                        break;
+                case 'n':
+                        cfg.protection = TLS_PROTECT_NONE;
+                        break;
+                case 'p':
+                        cfg.pool_pages = atoi(optarg);
+                        break;
+                default:
+                        usage(argv[0]);
+                }
+        }
+        if (cfg.areas == 0 || cfg.depth > MAX_DEPTH || cfg.areas * (cfg.depth + 1) > MAX_THREADS || cfg.size_num == 0) {
+                usage(argv[0]);
+        }
+        if (cfg.write_fraction < 0 || cfg.write_fraction > 1) {
+                usage(argv[0]);
+        }
+        if (cfg.page_size == 0) {
+                cfg.page_size = getpagesize();
+        }
+        cfg.page_size = (cfg.page_size + getpagesize() - 1) / getpagesize() * getpagesize();
+
+        unsigned int i, max_size = 0;
+        for (i=0; i<cfg.size_num; i++) {
+                if (cfg.sizes[i] == 0) {
+                        usage(argv[0]);
+                }
+                max_size = cfg.sizes[i] > max_size ? cfg.sizes[i] : max_size;
+        }
+        source = (char*)malloc(max_size);
+        if (source == NULL) {
+                perror("ERROR: Could not allocate source buffer.");
+                return 1;
+        }
+        for (i=0; i<max_size; i++) {
+                source[i] = (char)(i * 131 + 7);
+        }
+
+        printf("# %u chains, clones write %.2f of their pages, %u byte pages, protection %s, pool %u\n",
+               cfg.areas, cfg.write_fraction, cfg.page_size, cfg.protection == TLS_PROTECT_NONE ? "none" : "pages", cfg.pool_pages);
+        printf("# %8s %5s %6s %12s %8s %12s %9s %10s %12s %9s %9s\n",
+               "size", "depth", "areas", "rss", "vmas", "heap", "rss/byte", "vmas/area", "heap/area", "left_rss", "left_vmas");
+        // first use sets up the library, malloc arenas of the threads and the stack pages - keep it out of the numbers
+        int errors = run(cfg.sizes[0], cfg.depth, 1);
+        unsigned int depth;
+        for (i=0; i<cfg.size_num; i++) {
+                for (depth=0; depth<=cfg.depth; depth++) {
+                        errors |= run(cfg.sizes[i], depth, 0);
+                }
+        }
+        free(source);
+        return errors ? 1 : 0;
+}
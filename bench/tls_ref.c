@@ -0,0 +1,187 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+// reference model of the tls API - one plain byte array per thread, one lock, nothing shared
+// clones copy bytes at clone time, which is what CoW sharing must look like from outside; bytes outside the
+// ranges of a range clone are loose - they may read as the target's bytes or as zero, but stay as first seen
+
+// define range - same layout as struct tls_range
+struct ref_range {
+        unsigned int offset;
+        unsigned int length;
+};
+
+// define reference area
+struct ref_area {
+        pthread_t tid;
+        unsigned int size;
+        char* bytes;
+        char* loose; // per byte, 1 if it may also read as zero - NULL if no byte is loose
+        struct ref_area* next;
+};
+
+struct ref_area* ref_areas = NULL;
+pthread_mutex_t ref_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// helper function to find area of given thread - caller holds ref_lock
+struct ref_area* ref_find(pthread_t tid) {
+        struct ref_area* a;
+        for (a = ref_areas; a != NULL; a = a->next) {
+                if (pthread_equal(a->tid, tid)) {
+                        return a;
+                }
+        }
+        return NULL;
+}
+
+// helper function to add an area for the current thread - caller holds ref_lock
+struct ref_area* ref_add(unsigned int size) {
+        struct ref_area* a = (struct ref_area*)calloc(1, sizeof(struct ref_area));
+        if (a == NULL) {
+                return NULL;
+        }
+        a->bytes = (char*)calloc(size, 1);
+        if (a->bytes == NULL) {
+                free(a);
+                return NULL;
+        }
+        a->tid = pthread_self();
+        a->size = size;
+        a->next = ref_areas;
+        ref_areas = a;
+        return a;
+}
+
+// ref_create
+int ref_create(unsigned int size) {
+        pthread_mutex_lock(&ref_lock);
+        if (size == 0 || ref_find(pthread_self()) != NULL || ref_add(size) == NULL) {
+                pthread_mutex_unlock(&ref_lock);
+                return -1;
+        }
+        pthread_mutex_unlock(&ref_lock);
+        return 0;
+}
+
+// ref_destroy
+int ref_destroy() {
+        pthread_mutex_lock(&ref_lock);
+        struct ref_area** a = &ref_areas;
+        while (*a != NULL && !pthread_equal((*a)->tid, pthread_self())) {
+                a = &((*a)->next);
+        }
+        if (*a == NULL) {
+                pthread_mutex_unlock(&ref_lock);
+                return -1;
+        }
+        struct ref_area* gone = *a;
+        *a = gone->next;
+        pthread_mutex_unlock(&ref_lock);
+
+        free(gone->bytes);
+        free(gone->loose);
+        free(gone);
+        return 0;
+}
+
+// ref_read
+int ref_read(unsigned int offset, unsigned int length, char* buffer) {
+        pthread_mutex_lock(&ref_lock);
+        struct ref_area* a = ref_find(pthread_self());
+        if (a == NULL || offset + length > a->size) {
+                pthread_mutex_unlock(&ref_lock);
+                return -1;
+        }
+        memcpy(buffer, a->bytes + offset, length);
+        pthread_mutex_unlock(&ref_lock);
+        return 0;
+}
+
+// ref_write
+int ref_write(unsigned int offset, unsigned int length, const char* buffer) {
+        pthread_mutex_lock(&ref_lock);
+        struct ref_area* a = ref_find(pthread_self());
+        if (a == NULL || offset + length > a->size) {
+                pthread_mutex_unlock(&ref_lock);
+                return -1;
+        }
+        memcpy(a->bytes + offset, buffer, length);
+        if (a->loose != NULL) {
+                memset(a->loose + offset, 0, length);
+        }
+        pthread_mutex_unlock(&ref_lock);
+        return 0;
+}
+
+// ref_match - compare bytes read from the library with the model, loose bytes may be zero; returns the index
+// of the first mismatch, or 'length' if all match - then loose bytes are pinned to what was read
+unsigned int ref_match(unsigned int offset, unsigned int length, const char* seen) {
+        pthread_mutex_lock(&ref_lock);
+        struct ref_area* a = ref_find(pthread_self());
+        if (a == NULL || offset + length > a->size) {
+                pthread_mutex_unlock(&ref_lock);
+                return 0;
+        }
+        unsigned int i;
+        for (i=0; i<length; i++) {
+                if (a->bytes[offset + i] != seen[i] && (a->loose == NULL || !a->loose[offset + i] || seen[i] != 0)) {
+                        pthread_mutex_unlock(&ref_lock);
+                        return i;
+                }
+        }
+        if (a->loose != NULL) {
+                memcpy(a->bytes + offset, seen, length);
+                memset(a->loose + offset, 0, length);
+        }
+        pthread_mutex_unlock(&ref_lock);
+        return length;
+}
+
+// ref_clone_range - the bytes of 'ranges' are the target's, all others are loose (all bytes exact if NULL)
+int ref_clone_range(pthread_t tid, const struct ref_range* ranges, unsigned int range_num) {
+        pthread_mutex_lock(&ref_lock);
+        struct ref_area* target = ref_find(tid);
+        if (target == NULL || ref_find(pthread_self()) != NULL) {
+                pthread_mutex_unlock(&ref_lock);
+                return -1;
+        }
+
+        // check ranges before anything is created
+        unsigned int r;
+        for (r=0; ranges != NULL && r<range_num; r++) {
+                if (ranges[r].length > 0 && ranges[r].offset + ranges[r].length > target->size) {
+                        pthread_mutex_unlock(&ref_lock);
+                        return -1;
+                }
+        }
+
+        struct ref_area* a = ref_add(target->size);
+        if (a == NULL) {
+                pthread_mutex_unlock(&ref_lock);
+                return -1;
+        }
+        memcpy(a->bytes, target->bytes, target->size);
+        if (ranges != NULL) {
+                a->loose = (char*)malloc(target->size);
+                if (a->loose == NULL) {
+                        pthread_mutex_unlock(&ref_lock);
+                        ref_destroy();
+                        return -1;
+                }
+                memset(a->loose, 1, target->size);
+        }
+        for (r=0; ranges != NULL && r<range_num; r++) {
+                if (ranges[r].length > 0) {
+                        memset(a->loose + ranges[r].offset, 0, ranges[r].length);
+                }
+        }
+        pthread_mutex_unlock(&ref_lock);
+        return 0;
+}
+
+// ref_clone
+int ref_clone(pthread_t tid) {
+        return ref_clone_range(tid, NULL, 0);
+}
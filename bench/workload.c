@@ -0,0 +1,622 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <math.h>
+#include "../tls.h"
+
+// workload generator - drives the tls API with skewed offsets and a mix of operations
+
+#define OPS 5 // read, write, clone, create, destroy
+#define HIST_BUCKETS 256 // latency buckets - four per power of two nanoseconds
+#define MAX_THREADS 256
+#define MAX_FANOUT 64
+
+// offset distributions
+#define DIST_UNIFORM 0
+#define DIST_ZIPF 1
+#define DIST_SEQ 2
+#define DIST_HOT 3
+
+const char* op_names[OPS] = { "read", "write", "clone", "create", "destroy" };
+const char* dist_names[] = { "uniform", "zipf", "seq", "hot" };
+
+// define zipfian generator - Gray et al., "Quickly Generating Billion-Record Synthetic Databases"
+struct zipf {
+        unsigned long n;
+        double theta;
+        double alpha;
+        double zetan;
+        double eta;
+};
+
+// define workload configuration
+struct workload {
+        unsigned int threads;
+        unsigned int seconds;
+        unsigned int interval_ms; // reporting interval
+        unsigned int size; // bytes per area
+        unsigned int ratio[OPS]; // relative weight of each operation
+        int dist;
+        double theta; // zipf skew
+        double hot_fraction; // hot-set share of the area
+        double hot_prob; // share of accesses going to the hot set
+        unsigned int len_min; // access length, uniform in [len_min, len_max]
+        unsigned int len_max;
+        unsigned int fanout; // clones per clone operation
+        unsigned int page_size;
+        int protection;
+        unsigned int color_stride;
+        unsigned long seed;
+        const char* export_name; // stats segment for tlstop - NULL for none
+        int fast; // go through the inline fast path of tls.h
+        const char* json_path; // append a JSON summary of the run for bench/benchcmp - NULL for none
+};
+
+// define per thread state - histograms are cumulative and read by the reporter
+struct worker {
+        unsigned int id;
+        pthread_t thread;
+        uint64_t rng;
+        unsigned long cursor; // next slot of a sequential walk
+        unsigned long hist[OPS][HIST_BUCKETS];
+        unsigned long errors;
+};
+
+// define clone child - clones its parent, copies one page on write and goes away
+struct child {
+        struct worker* parent;
+        pthread_t parent_tid;
+        uint64_t rng;
+};
+
+struct workload cfg = {
+        .threads = 4,
+        .seconds = 10,
+        .interval_ms = 1000,
+        .size = 1 << 20,
+        .ratio = { 80, 18, 1, 1, 0 },
+        .dist = DIST_ZIPF,
+        .theta = 0.99,
+        .hot_fraction = 0.1,
+        .hot_prob = 0.9,
+        .len_min = 8,
+        .len_max = 64,
+        .fanout = 1,
+        .page_size = 0,
+        .protection = 0,
+        .seed = 1,
+};
+
+tls_domain_t* dom;
+struct zipf zipf;
+unsigned long slots; // offsets are multiples of len_max below slots * len_max
+unsigned int ratio_sum;
+int stop;
+struct worker workers[MAX_THREADS];
+
+// xorshift64* - one generator per thread
+uint64_t rng_next(uint64_t* s) {
+        *s ^= *s >> 12;
+        *s ^= *s << 25;
+        *s ^= *s >> 27;
+        return *s * 0x2545F4914F6CDD1DULL;
+}
+
+// uniform double in [0, 1)
+double rng_unit(uint64_t* s) {
+        return (rng_next(s) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// init zipf
+void zipf_init(struct zipf* z, unsigned long n, double theta) {
+        unsigned long i;
+        z->n = n;
+        z->theta = theta;
+        z->zetan = 0;
+        for (i=1; i<=n; i++) {
+                z->zetan += 1.0 / pow((double)i, theta);
+        }
+        double zeta2 = 1.0 + 1.0 / pow(2.0, theta);
+        z->alpha = 1.0 / (1.0 - theta);
+        z->eta = (1.0 - pow(2.0 / n, 1.0 - theta)) / (1.0 - zeta2 / z->zetan);
+}
+
+// zipf rank in [0, n) - rank 0 is the hottest
+unsigned long zipf_next(struct zipf* z, uint64_t* s) {
+        double u = rng_unit(s);
+        double uz = u * z->zetan;
+        if (uz < 1.0) {
+                return 0;
+        }
+        if (uz < 1.0 + pow(0.5, z->theta)) {
+                return 1;
+        }
+        unsigned long r = (unsigned long)(z->n * pow(z->eta * u - z->eta + 1.0, z->alpha));
+        return r < z->n ? r : z->n - 1;
+}
+
+// pick offset of the next access
+unsigned int next_offset(struct worker* w) {
+        unsigned long slot = 0;
+        switch (cfg.dist) {
+        case DIST_UNIFORM:
+                slot = rng_next(&w->rng) % slots;
+                break;
+        case DIST_ZIPF:
+                // scatter ranks over the area - hot slots are not all on the first page
+                slot = (zipf_next(&zipf, &w->rng) * 0x9E3779B97F4A7C15ULL) % slots;
+                break;
+        case DIST_SEQ:
+                slot = w->cursor++ % slots;
+                break;
+        case DIST_HOT: {
+                unsigned long hot = (unsigned long)(slots * cfg.hot_fraction);
+                if (hot == 0) {
+                        hot = 1;
+                }
+                if (rng_unit(&w->rng) < cfg.hot_prob || hot == slots) {
+                        slot = rng_next(&w->rng) % hot;
+                } else {
+                        slot = hot + rng_next(&w->rng) % (slots - hot);
+                }
+                break;
+        }
+        }
+        return (unsigned int)(slot * cfg.len_max);
+}
+
+// pick length of the next access
+unsigned int next_length(struct worker* w) {
+        return cfg.len_min + rng_next(&w->rng) % (cfg.len_max - cfg.len_min + 1);
+}
+
+// pick next operation by ratio
+int next_op(struct worker* w) {
+        unsigned int r = rng_next(&w->rng) % ratio_sum;
+        int op;
+        for (op=0; op<OPS; op++) {
+                if (r < cfg.ratio[op]) {
+                        return op;
+                }
+                r -= cfg.ratio[op];
+        }
+        return 0;
+}
+
+// helper function to get monotonic time in nanoseconds
+uint64_t now_ns() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// histogram bucket of a latency
+unsigned int hist_bucket(uint64_t ns) {
+        if (ns < 4) {
+                return ns;
+        }
+        unsigned int lg = 63 - __builtin_clzll(ns);
+        return (lg - 1) * 4 + ((ns >> (lg - 2)) & 3);
+}
+
+// lowest latency of a bucket
+uint64_t hist_value(unsigned int b) {
+        if (b < 4) {
+                return b;
+        }
+        return (uint64_t)(4 + b % 4) << (b / 4 - 1);
+}
+
+// record one latency - relaxed increments, the reporter reads them while workers run
+void record(struct worker* w, int op, uint64_t ns) {
+        __atomic_add_fetch(&w->hist[op][hist_bucket(ns)], 1, __ATOMIC_RELAXED);
+}
+
+// clone child
+void* child_run(void* arg) {
+        struct child* c = (struct child*)arg;
+        char buf[8] = "cloned!";
+
+        uint64_t t = now_ns();
+        if (tls_clone_in(dom, c->parent_tid)) {
+                __atomic_add_fetch(&c->parent->errors, 1, __ATOMIC_RELAXED);
+                return NULL;
+        }
+        record(c->parent, 2, now_ns() - t);
+
+        // first write copies one page
+        unsigned int offset = (rng_next(&c->rng) % slots) * cfg.len_max;
+        if (tls_write_in(dom, offset, sizeof(buf), buf)) {
+                __atomic_add_fetch(&c->parent->errors, 1, __ATOMIC_RELAXED);
+        }
+        tls_destroy_in(dom);
+        return NULL;
+}
+
+// clone fan-out - children clone the worker's area concurrently while it waits
+int run_clone(struct worker* w) {
+        pthread_t threads[MAX_FANOUT];
+        struct child children[MAX_FANOUT];
+        unsigned int i, started = 0;
+
+        for (i=0; i<cfg.fanout; i++) {
+                children[i].parent = w;
+                children[i].parent_tid = pthread_self();
+                children[i].rng = rng_next(&w->rng) | 1;
+                if (pthread_create(&threads[i], NULL, child_run, &children[i])) {
+                        break;
+                }
+                started++;
+        }
+        for (i=0; i<started; i++) {
+                pthread_join(threads[i], NULL);
+        }
+        return started == cfg.fanout ? 0 : -1;
+}
+
+// worker thread
+void* worker_run(void* arg) {
+        struct worker* w = (struct worker*)arg;
+        char buf[65536];
+
+        memset(buf, 'w', sizeof(buf));
+        if (tls_create_in(dom, cfg.size)) {
+                w->errors++;
+                return NULL;
+        }
+
+        while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+                int op = next_op(w);
+                int ret = 0;
+                uint64_t t = now_ns();
+                switch (op) {
+                case 0:
+                        if (cfg.fast) {
+                                ret = tls_read_fast_in(dom, next_offset(w), next_length(w), buf);
+                        } else {
+                                ret = tls_read_in(dom, next_offset(w), next_length(w), buf);
+                        }
+                        break;
+                case 1:
+                        if (cfg.fast) {
+                                ret = tls_write_fast_in(dom, next_offset(w), next_length(w), buf);
+                        } else {
+                                ret = tls_write_in(dom, next_offset(w), next_length(w), buf);
+                        }
+                        break;
+                case 2:
+                        ret = run_clone(w); // children record their own clone latency
+                        break;
+                case 3:
+                        // timed create of a fresh area in place of the current one
+                        tls_destroy_in(dom);
+                        t = now_ns();
+                        ret = tls_create_in(dom, cfg.size);
+                        break;
+                case 4:
+                        // timed destroy, untimed create so the loop keeps an area
+                        ret = tls_destroy_in(dom);
+                        record(w, op, now_ns() - t);
+                        if (tls_create_in(dom, cfg.size)) {
+                                ret = -1;
+                        }
+                        break;
+                }
+                if (ret) {
+                        __atomic_add_fetch(&w->errors, 1, __ATOMIC_RELAXED);
+                } else if (op != 2 && op != 4) {
+                        record(w, op, now_ns() - t);
+                }
+        }
+
+        tls_destroy_in(dom);
+        return NULL;
+}
+
+// sum histograms of all workers into 'sum'
+void hist_collect(unsigned long sum[OPS][HIST_BUCKETS]) {
+        unsigned int i, op, b;
+        memset(sum, 0, sizeof(unsigned long) * OPS * HIST_BUCKETS);
+        for (i=0; i<cfg.threads; i++) {
+                for (op=0; op<OPS; op++) {
+                        for (b=0; b<HIST_BUCKETS; b++) {
+                                sum[op][b] += __atomic_load_n(&workers[i].hist[op][b], __ATOMIC_RELAXED);
+                        }
+                }
+        }
+}
+
+// percentile of a histogram, 0 if empty
+uint64_t hist_percentile(const unsigned long* hist, unsigned long count, double p) {
+        if (count == 0) {
+                return 0;
+        }
+        unsigned long rank = (unsigned long)(count * p);
+        unsigned long seen = 0;
+        unsigned int b;
+        for (b=0; b<HIST_BUCKETS; b++) {
+                seen += hist[b];
+                if (seen > rank) {
+                        return hist_value(b);
+                }
+        }
+        return hist_value(HIST_BUCKETS - 1);
+}
+
+// print one line - throughput and per operation latency of the histogram difference
+void report(double t, double secs, unsigned long cur[OPS][HIST_BUCKETS], unsigned long prev[OPS][HIST_BUCKETS]) {
+        unsigned long diff[HIST_BUCKETS];
+        unsigned long total = 0;
+        char line[1024];
+        int len = 0;
+        int op;
+
+        for (op=0; op<OPS; op++) {
+                unsigned long count = 0;
+                unsigned int b;
+                for (b=0; b<HIST_BUCKETS; b++) {
+                        diff[b] = cur[op][b] - (prev ? prev[op][b] : 0);
+                        count += diff[b];
+                }
+                total += count;
+                len += snprintf(line + len, sizeof(line) - len, " %10lu %9lu %9lu",
+                                count, (unsigned long)hist_percentile(diff, count, 0.5), (unsigned long)hist_percentile(diff, count, 0.99));
+        }
+        printf("%8.1f %12.0f%s\n", t, total / secs, line);
+        fflush(stdout);
+}
+
+// append the totals of the run to 'path' as one JSON object per line - keys and layout stay fixed for bench/benchcmp
+// everything under "config" has to match for two runs to be compared, the seed may differ
+int report_json(const char* path, double secs, unsigned long hist[OPS][HIST_BUCKETS], const struct tls_counters* counters, unsigned long errors) {
+        FILE* f = fopen(path, "a");
+        if (f == NULL) {
+                perror("ERROR: Could not open JSON output.");
+                return -1;
+        }
+        fprintf(f, "{\"bench\": \"workload\", \"version\": 1, \"seed\": %lu, ", cfg.seed);
+        fprintf(f, "\"config\": {\"cpus\": %ld, \"threads\": %u, \"seconds\": %u, \"size\": %u, \"ratio\": \"%u:%u:%u:%u:%u\", "
+                "\"dist\": \"%s\", \"theta\": %.2f, \"hot\": \"%.2f:%.2f\", \"len\": \"%u-%u\", \"fanout\": %u, "
+                "\"page_size\": %u, \"protection\": \"%s\", \"color_stride\": %u, \"fast\": %d}, ",
+                sysconf(_SC_NPROCESSORS_ONLN), cfg.threads, cfg.seconds, cfg.size, cfg.ratio[0], cfg.ratio[1], cfg.ratio[2], cfg.ratio[3], cfg.ratio[4],
+                dist_names[cfg.dist], cfg.theta, cfg.hot_fraction, cfg.hot_prob, cfg.len_min, cfg.len_max, cfg.fanout,
+                cfg.page_size, cfg.protection ? "none" : "pages", cfg.color_stride, cfg.fast);
+
+        unsigned long total = 0;
+        int op;
+        fprintf(f, "\"ops\": {");
+        for (op=0; op<OPS; op++) {
+                unsigned long count = 0;
+                unsigned int b;
+                for (b=0; b<HIST_BUCKETS; b++) {
+                        count += hist[op][b];
+                }
+                total += count;
+                fprintf(f, "%s\"%s\": {\"count\": %lu, \"ops_per_sec\": %.1f, \"p50_ns\": %lu, \"p99_ns\": %lu, \"p999_ns\": %lu}",
+                        op ? ", " : "", op_names[op], count, count / secs, (unsigned long)hist_percentile(hist[op], count, 0.5),
+                        (unsigned long)hist_percentile(hist[op], count, 0.99), (unsigned long)hist_percentile(hist[op], count, 0.999));
+        }
+        fprintf(f, "}, ");
+
+        // syscall and copy counts per operation - comparable across runs of slightly different length
+        double per = total > 0 ? 1.0 / total : 0;
+        fprintf(f, "\"counters\": {\"mprotects\": %lu, \"cow_copies\": %lu, \"mprotects_per_op\": %.4f, \"cow_copies_per_op\": %.6f}, ",
+                counters->mprotects, counters->cow_copies, counters->mprotects * per, counters->cow_copies * per);
+        fprintf(f, "\"elapsed_s\": %.3f, \"ops_per_sec\": %.1f, \"errors\": %lu}\n", secs, total / secs, errors);
+        int ret = ferror(f) ? -1 : 0;
+        if (fclose(f) || ret) {
+                perror("ERROR: Could not write JSON output.");
+                return -1;
+        }
+        return 0;
+}
+
+// print usage
+void usage(const char* prog) {
+        fprintf(stderr,
+                "usage: %s [options]\n"
+                "  -t threads        worker threads (%u)\n"
+                "  -d seconds        run time (%u)\n"
+                "  -i ms             reporting interval (%u)\n"
+                "  -s bytes          area size per thread (%u)\n"
+                "  -r R:W:C:CR:D     weights of read, write, clone, create, destroy (80:18:1:1:0)\n"
+                "  -o dist           offsets: uniform, zipf, seq, hot (zipf)\n"
+                "  -z theta          zipf skew, 0 < theta < 1 (%.2f)\n"
+                "  -h frac:prob      hot set: share of the area and of the accesses (%.2f:%.2f)\n"
+                "  -l min[-max]      access length in bytes (%u-%u)\n"
+                "  -f fanout         clones per clone operation (%u)\n"
+                "  -g bytes          domain page size (system page)\n"
+                "  -n                no page protection (TLS_PROTECT_NONE)\n"
+                "  -k stride         cache coloring stride (0)\n"
+                "  -F                read and write through the inline fast path of tls.h\n"
+                "  -e name           export stats to shared memory segment 'name' for tlstop\n"
+                "  -j path           append a JSON summary of the run to 'path' for bench/benchcmp\n"
+                "  -S seed           random seed (%lu)\n",
+                prog, cfg.threads, cfg.seconds, cfg.interval_ms, cfg.size, cfg.theta, cfg.hot_fraction, cfg.hot_prob,
+                cfg.len_min, cfg.len_max, cfg.fanout, cfg.seed);
+        exit(1);
+}
+
+// parse options
+void parse(int argc, char** argv) {
+        int c, i;
+        while ((c = getopt(argc, argv, "t:d:i:s:r:o:z:h:l:f:g:nk:Fe:j:S:")) != -1) {
+                switch (c) {
+                case 't':
+                        cfg.threads = atoi(optarg);
+                        break;
+                case 'd':
+                        cfg.seconds = atoi(optarg);
+                        break;
+                case 'i':
+                        cfg.interval_ms = atoi(optarg);
+                        break;
+                case 's':
+                        cfg.size = strtoul(optarg, NULL, 0);
+                        break;
+                case 'r':
+                        memset(cfg.ratio, 0, sizeof(cfg.ratio));
+                        if (sscanf(optarg, "%u:%u:%u:%u:%u", &cfg.ratio[0], &cfg.ratio[1], &cfg.ratio[2], &cfg.ratio[3], &cfg.ratio[4]) < 1) {
+                                usage(argv[0]);
+                        }
+                        break;
+                case 'o':
+                        cfg.dist = -1;
+                        for (i=0; i<4; i++) {
+                                if (strcmp(optarg, dist_names[i]) == 0) {
+                                        cfg.dist = i;
+                                }
+                        }
+                        if (cfg.dist < 0) {
+                                usage(argv[0]);
+                        }
+                        break;
+                case 'z':
+                        cfg.theta = atof(optarg);
+                        break;
+                case 'h':
+                        if (sscanf(optarg, "%lf:%lf", &cfg.hot_fraction, &cfg.hot_prob) != 2) {
+                                usage(argv[0]);
+                        }
+                        break;
+                case 'l':
+                        if (sscanf(optarg, "%u-%u", &cfg.len_min, &cfg.len_max) == 1) {
+                                cfg.len_max = cfg.len_min;
+                        }
+                        break;
+                case 'f':
+                        cfg.fanout = atoi(optarg);
+                        break;
+                case 'g':
+                        cfg.page_size = strtoul(optarg, NULL, 0);
+                        break;
+                case 'n':
+                        cfg.protection = 1;
+                        break;
+                case 'k':
+                        cfg.color_stride = atoi(optarg);
+                        break;
+                case 'F':
+                        cfg.fast = 1;
+                        break;
+                case 'e':
+                        cfg.export_name = optarg;
+                        break;
+                case 'j':
+                        cfg.json_path = optarg;
+                        break;
+                case 'S':
+                        cfg.seed = strtoul(optarg, NULL, 0);
+                        break;
+                default:
+                        usage(argv[0]);
+                }
+        }
+
+        ratio_sum = 0;
+        for (i=0; i<OPS; i++) {
+                ratio_sum += cfg.ratio[i];
+        }
+        if (cfg.threads == 0 || cfg.threads > MAX_THREADS || cfg.fanout > MAX_FANOUT || ratio_sum == 0 || cfg.interval_ms == 0) {
+                usage(argv[0]);
+        }
+        if (cfg.len_min == 0 || cfg.len_min > cfg.len_max || cfg.len_max > 65536 || cfg.len_max > cfg.size) {
+                usage(argv[0]);
+        }
+        if (cfg.theta <= 0 || cfg.theta >= 1 || cfg.hot_fraction <= 0 || cfg.hot_fraction > 1) {
+                usage(argv[0]);
+        }
+}
+
+int main(int argc, char** argv) {
+        parse(argc, argv);
+
+        struct tls_domain_config dc = { cfg.page_size, cfg.protection, 0, 0, 0, cfg.color_stride };
+        dom = tls_domain_create(&dc);
+        if (dom == NULL) {
+                return 1;
+        }
+        if (cfg.export_name != NULL && tls_stats_export_start(cfg.export_name, cfg.interval_ms)) {
+                return 1;
+        }
+        slots = cfg.size / cfg.len_max;
+        if (cfg.dist == DIST_ZIPF) {
+                zipf_init(&zipf, slots, cfg.theta);
+        }
+
+        printf("# threads %u size %u dist %s theta %.2f hot %.2f:%.2f len %u-%u ratio %u:%u:%u:%u:%u fanout %u protection %s\n",
+               cfg.threads, cfg.size, dist_names[cfg.dist], cfg.theta, cfg.hot_fraction, cfg.hot_prob, cfg.len_min, cfg.len_max,
+               cfg.ratio[0], cfg.ratio[1], cfg.ratio[2], cfg.ratio[3], cfg.ratio[4], cfg.fanout, cfg.protection ? "none" : "pages");
+        printf("# %6s %12s", "time_s", "ops/s");
+        int op;
+        for (op=0; op<OPS; op++) {
+                printf(" %10s %9s %9s", op_names[op], "p50_ns", "p99_ns");
+        }
+        printf("\n");
+
+        unsigned int i;
+        for (i=0; i<cfg.threads; i++) {
+                workers[i].id = i;
+                workers[i].rng = (cfg.seed + 1) * 0x9E3779B97F4A7C15ULL + i;
+                workers[i].cursor = (unsigned long)i * slots / cfg.threads;
+                if (pthread_create(&workers[i].thread, NULL, worker_run, &workers[i])) {
+                        perror("ERROR: Could not start worker.");
+                        return 1;
+                }
+        }
+
+        // report once per interval from cumulative histograms
+        static unsigned long cur[OPS][HIST_BUCKETS], prev[OPS][HIST_BUCKETS];
+        uint64_t start = now_ns(), last = start;
+        uint64_t end = start + (uint64_t)cfg.seconds * 1000000000ULL;
+        while (1) {
+                uint64_t next = last + (uint64_t)cfg.interval_ms * 1000000ULL;
+                if (next > end) {
+                        next = end;
+                }
+                uint64_t t = now_ns();
+                if (next > t) {
+                        struct timespec ts = { (next - t) / 1000000000ULL, (next - t) % 1000000000ULL };
+                        nanosleep(&ts, NULL);
+                }
+                t = now_ns();
+                hist_collect(cur);
+                report((t - start) / 1e9, (t - last) / 1e9, cur, prev);
+                memcpy(prev, cur, sizeof(cur));
+                last = t;
+                if (t >= end) {
+                        break;
+                }
+        }
+
+        __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+        unsigned long errors = 0;
+        for (i=0; i<cfg.threads; i++) {
+                pthread_join(workers[i].thread, NULL);
+                errors += workers[i].errors;
+        }
+
+        // totals over the whole run
+        hist_collect(cur);
+        printf("# total\n");
+        report((now_ns() - start) / 1e9, (last - start) / 1e9, cur, NULL);
+        printf("# errors %lu\n", errors);
+        if (cfg.json_path != NULL) {
+                struct tls_counters counters;
+                tls_counters_in(dom, &counters);
+                if (report_json(cfg.json_path, (last - start) / 1e9, cur, &counters, errors)) {
+                        errors++;
+                }
+        }
+
+        if (cfg.export_name != NULL) {
+                tls_stats_export_stop();
+        }
+        tls_domain_destroy(dom);
+        return errors > 0;
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <signal.h>
 #include <pthread.h>
 #include <sys/mman.h>
@@ -6,20 +7,176 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <errno.h>
+#include <time.h>
+#include <stddef.h>
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define TLS_HAVE_IO_URING 1
+#endif
+#if defined(__x86_64__) && __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#define TLS_HAVE_RSEQ 1 // glibc registers rseq for every thread - per-CPU updates need no atomics
+#endif
+#include "tls.h"
 #define HASH_SIZE 4096 // not sure
+#define POOL_BATCH 16 // pages mapped per supplier refill
+#define PROF_LEN_BUCKETS 32 // power-of-two access length buckets
+#define PROF_FIELDS 64 // distinct (offset, length) ranges tracked per thread
+#define CHECKPOINT_RING 64 // io_uring entries used by an async checkpoint
+#define CHECKPOINT_MAX_BUFFERS 16384 // io_uring limit on registered buffers
+#define SPILL_BATCH 256 // pages written to the spill file by one pwritev
+#define EAGER_MIN_CLONES 4 // clones of a template seen before tls_clone predicts their writes
+#define EAGER_DECAY 64 // write heat of a template is halved after this many clones
+#define COW_DESC_BLOCK 32 // page descriptors allocated at once for the CoW copies of an area
+#define TLS_STR(x) TLS_STR2(x)
+#define TLS_STR2(x) #x
+
+// page flags
+#define PAGE_NO_RECYCLE 1 // page may still be referenced by a pipe - never hand it back to the pool
+#define PAGE_READABLE 2 // page of a frozen area that stays PROT_READ instead of PROT_NONE
+#define PAGE_EAGER 4 // copied at clone time on a prediction - the first write confirms it
+#define PAGE_SPILLING 8 // being written to the spill file - clones copy it instead of sharing, set and cleared under domain lock
+#define PAGE_DROPPING 16 // being released by pressure reclaim - clones get a zero page for it, as its owner will
 
 // define TLS
 typedef struct thread_local_storage {
         pthread_t tid;
+        pid_t ktid; // kernel thread id - what tlstop shows
         unsigned int size; // size in bytes
         unsigned int page_num; // number of pages
+        unsigned int color; // offset 0 lies this many bytes into the first page - cache coloring
         struct page ** pages; // array of pointers to pages
+        struct tls_domain* domain; // registry this TLS belongs to
+        unsigned int prof_countdown; // accesses until the next profile sample
+        struct tls_profile* prof; // sampled access profile - NULL until first sample
+        struct splice_pin* pins; // pages referenced by pipes after tls_splice_to_pipe
+        unsigned int cow_splits; // CoW copies since the last compaction
+        struct page* spare; // unused descriptors of the block CoW copies are taken from - owner only
+        unsigned int spare_num;
+        unsigned int copiers; // clones copying pages or spill slots of this area without domain lock - guarded by it
+        int frozen; // permanently read-only - TLS_FREEZE_* flags plus one, 0 if not frozen
+        struct durable* durable; // file backing - NULL for anonymous areas
+        int reclaimable; // private pages may be dropped under memory pressure
+        unsigned long last_access; // pressure epoch of the last tls_read/tls_write
+        unsigned int spill_age; // idle spill passes before a page may be spilled (0 = never)
+        unsigned int spilled; // pages currently held in the spill file - changed under domain lock
+        unsigned int spilling; // pages flagged PAGE_SPILLING or PAGE_DROPPING - guarded by domain lock
+        struct tls_counters counters;
+        struct cow_heat* heat; // writes of this area's clones - NULL until it is first cloned
+        struct cow_heat* template_heat; // heat of the area this one was cloned from - NULL if not a clone
+        struct watch* watch; // page generations for tls_wait_change - NULL until another thread first waits
+        char** direct; // page addresses published to the inline fast path - NULL until first used
+        struct tls_fast fast; // what the fast path of tls.h sees
+        pthread_mutex_t lock; // taken by owner and background reclaim for reclaimable or spillable areas
 } TLS;
 
 // define page
 struct page {
         uintptr_t address; // start address of page
         int ref_count; // counter for shared pages
+        int flags;
+        int open; // accesses that currently need the page unprotected - guarded by lock
+        int lock; // futex word ordering protection changes of this page - 0 free, 1 held, 2 held with waiters
+        unsigned long epoch; // spill pass of the last tls_read/tls_write
+        unsigned int slot; // spill file slot plus one - 0 while the page is resident
+        struct page_block* block; // descriptors allocated together - NULL for one allocated alone
+};
+
+// define block of page descriptors - pages allocated together keep their descriptors side by side,
+// so loops over an area stream through one array; a block lives until the last of its pages is
+// released, which lets clones share a descriptor in place
+struct page_block {
+        int live; // descriptors of the block still in use
+        struct page pages[];
+};
+
+// define per-CPU areas of a domain - one slice per possible CPU, each followed by a guard page
+struct percpu {
+        char* base;
+        unsigned int size; // usable bytes per CPU
+        size_t slice; // size rounded up to domain pages
+        size_t stride; // distance between the slices of neighbouring CPUs
+        unsigned int cpu_num;
+};
+
+// define write heat of a template - which pages its clones write, shared by the template and its clones
+struct cow_heat {
+        int ref_count;
+        unsigned int page_num;
+        unsigned int clones; // clones taken since the last decay
+        unsigned int* writes; // clones that wrote each page
+};
+
+// define change watch of a TLS - written by its owner, slept on by tls_wait_change of other threads
+// kept apart from the TLS and reference counted, so waiters outlive the destruction of the area
+struct watch {
+        int ref_count; // the TLS plus waiters
+        unsigned int seq; // futex word - advanced after every write and when the area goes away
+        unsigned int waiters; // threads asleep or about to sleep on seq
+        int closed; // area destroyed
+        unsigned int page_num;
+        unsigned int gens[]; // generation of each page - advanced when tls_write touches it
+};
+
+// define durable state - TLS mapped MAP_SHARED over a file
+struct durable {
+        int fd;
+        char* base; // one mapping of the whole file - page i at base + i * page size
+        unsigned char* dirty; // pages written since the last tls_sync
+        unsigned int dirty_num;
+        unsigned int sync_pages; // tls_write syncs once this many pages are dirty (0 = off)
+        unsigned int sync_interval_ms; // tls_write syncs when the last sync is older (0 = off)
+        struct timespec last_sync;
+};
+
+// define spill file - cold pages of a domain written out to free memory
+struct spill {
+        int fd;
+        pthread_mutex_t lock; // guards slot_num, free and stats - taken after domain lock
+        unsigned int slot_num; // slots in the file - slot i at offset i * page size
+        unsigned int* free; // slots released by pages loaded back, room for slot_num
+        unsigned int free_num;
+        unsigned int passes; // spill passes running - guarded by domain lock
+        struct tls_spill_stats stats;
+};
+
+// define splice pin - holds a reference on spliced pages until the pipe's reader consumed them
+struct splice_pin {
+        int pipe_fd;
+        unsigned long written; // bytes spliced into pipe_fd by this TLS, up to and including this pin
+        unsigned int page_num;
+        struct page** pages;
+        struct splice_pin* next;
+};
+
+// define profiled field - an (offset, length) range seen by tls_read/tls_write
+struct prof_field {
+        unsigned int offset;
+        unsigned int length;
+        unsigned long reads;
+        unsigned long writes;
+};
+
+// define access profile of one thread's TLS
+struct tls_profile {
+        unsigned long samples;
+        unsigned long read_len[PROF_LEN_BUCKETS]; // length histograms
+        unsigned long write_len[PROF_LEN_BUCKETS];
+        unsigned long* page_reads; // per page heat
+        unsigned long* page_writes;
+        struct prof_field fields[PROF_FIELDS];
+        unsigned int field_num;
+        unsigned long dropped; // samples of fields that did not fit in the table
 };
 
 // define hash element
@@ -29,11 +186,65 @@ struct hash_element {
         struct hash_element *next;
 };
 
-// init hash table
-struct hash_element* hash_table[HASH_SIZE];
+// define frozen entry - never removed, so readers walk the list without locking
+struct frozen_entry {
+        pthread_t tid;
+        TLS* tls;
+        struct frozen_entry* next;
+};
+
+// define page pool - stock of faulted-in, zeroed pages kept by a background supplier
+struct page_pool {
+        pthread_mutex_t lock;
+        pthread_cond_t cond; // wakes the supplier when stock runs low
+        uintptr_t* clean; // zeroed, faulted-in pages ready to use
+        unsigned int clean_num;
+        uintptr_t* dirty; // released pages waiting to be zeroed
+        unsigned int dirty_num;
+        unsigned int target; // number of pages to keep in stock
+        unsigned int page_bytes; // size of the pages in stock
+        int running;
+        int shrunk; // memory pressure - hold no stock until it subsides
+        pthread_t supplier;
+};
+
+// define domain - an independent registry with its own configuration
+struct tls_domain {
+        pthread_mutex_t lock; // protects hash_table and bytes
+        struct hash_element* hash_table[HASH_SIZE];
+        unsigned int page_size;
+        int protection;
+        unsigned long max_bytes;
+        unsigned long bytes; // bytes currently committed to areas
+        unsigned int compact_threshold;
+        unsigned int color_stride; // start offsets of consecutive areas differ by this (0 = no coloring)
+        unsigned int color_next; // color of the next area, in strides
+        struct frozen_entry* frozen[HASH_SIZE]; // frozen areas - push only, read lock-free
+        struct page_pool pool;
+        struct spill* spill; // cold pages written out by tls_spill_cold - NULL until tls_spill_open
+        unsigned long spill_epoch; // spill passes so far
+        struct tls_counters retired; // counters of destroyed areas
+        struct percpu* percpu; // per-CPU areas - NULL until tls_percpu_create_in
+        unsigned int pins; // background passes working on the domain - guarded by domains_lock
+        pthread_cond_t unpinned; // signalled when pins drops to 0 - tls_domain_destroy waits for it
+        pthread_cond_t copied; // signalled when the copiers of an area drop to 0
+        struct tls_domain* next; // list of all domains - walked by the fault handler
+};
+
+// init default domain - used by the plain tls_* calls
+tls_domain_t default_domain = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .pool = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER },
+        .unpinned = PTHREAD_COND_INITIALIZER,
+        .copied = PTHREAD_COND_INITIALIZER,
+};
+
+// init list of domains
+tls_domain_t* domains = &default_domain;
+pthread_mutex_t domains_lock = PTHREAD_MUTEX_INITIALIZER;
 
-// helper function to insert new TLS mapping into hash table
-void hash_table_insert(pthread_t tid, TLS* tls) {
+// helper function to insert new TLS mapping into hash table - caller holds domain lock
+int hash_table_insert(tls_domain_t* dom, pthread_t tid, TLS* tls) {
         // compute hash value for given thread id
         int hash_index = tid % HASH_SIZE;
 
@@ -41,7 +252,7 @@ void hash_table_insert(pthread_t tid, TLS* tls) {
         struct hash_element* new_elem = (struct hash_element*)malloc(sizeof(struct hash_element));
         if (new_elem == NULL) {
                 perror("ERROR: Failed to allocate memory for new hash element.");
-                exit(1);
+                return -1;
         }
 
         // init new element
@@ -50,22 +261,339 @@ void hash_table_insert(pthread_t tid, TLS* tls) {
         new_elem->next = NULL;
 
         // insert new element into hash table
-        if (hash_table[hash_index] == NULL) {
+        if (dom->hash_table[hash_index] == NULL) {
                 // no collision
-                hash_table[hash_index] = new_elem;
+                dom->hash_table[hash_index] = new_elem;
         } else {
                 // collision occured - chain
-                new_elem->next = hash_table[hash_index];
-                hash_table[hash_index] = new_elem;
+                new_elem->next = dom->hash_table[hash_index];
+                dom->hash_table[hash_index] = new_elem;
+        }
+
+        return 0;
+}
+
+// helper function to find TLS of given thread - caller holds domain lock
+TLS* hash_table_find(tls_domain_t* dom, pthread_t tid) {
+        struct hash_element* elem = dom->hash_table[tid % HASH_SIZE];
+        while (elem != NULL) {
+                if (pthread_equal(elem->tid, tid)) {
+                        return elem->tls;
+                }
+                elem = elem->next;
+        }
+        return NULL;
+}
+
+// helper function to remove TLS mapping of given thread - caller holds domain lock
+TLS* hash_table_remove(tls_domain_t* dom, pthread_t tid) {
+        struct hash_element** elem = &(dom->hash_table[tid % HASH_SIZE]);
+        while (*elem != NULL) {
+                if (pthread_equal((*elem)->tid, tid)) {
+                        struct hash_element* temp = *elem;
+                        TLS* tls = temp->tls;
+                        *elem = temp->next;
+                        free(temp);
+                        return tls;
+                }
+                elem = &((*elem)->next);
         }
+        return NULL;
 }
 
 // init
 int initialized = 0;
 int page_size = 0;
+unsigned long pressure_epoch = 1; // advanced by every memory pressure event
+
+// background supplier - keeps the clean stock of a pool filled at low priority
+void* page_supplier(void* arg) {
+        struct page_pool* pool = (struct page_pool*)arg;
+        unsigned int bytes = pool->page_bytes;
+        struct sched_param param = { 0 };
+        pthread_setschedparam(pthread_self(), SCHED_IDLE, &param); // best effort
+
+        pthread_mutex_lock(&pool->lock);
+        while (pool->running) {
+                if (pool->shrunk) {
+                        pthread_cond_wait(&pool->cond, &pool->lock);
+                } else if (pool->dirty_num > 0 && pool->clean_num < pool->target) {
+                        // recycle a released page - zero it outside the lock
+                        void* addr = (void*)pool->dirty[--pool->dirty_num];
+                        pthread_mutex_unlock(&pool->lock);
+                        if (mprotect(addr, bytes, PROT_READ | PROT_WRITE)) {
+                                munmap(addr, bytes);
+                                pthread_mutex_lock(&pool->lock);
+                                continue;
+                        }
+                        memset(addr, 0, bytes);
+                        pthread_mutex_lock(&pool->lock);
+                        if (pool->clean_num < pool->target) {
+                                pool->clean[pool->clean_num++] = (uintptr_t)addr;
+                        } else {
+                                munmap(addr, bytes);
+                        }
+                } else if (pool->clean_num < pool->target) {
+                        // map a batch of fresh pages, prefaulted by MAP_POPULATE
+                        unsigned int n = pool->target - pool->clean_num;
+                        if (n > POOL_BATCH) {
+                                n = POOL_BATCH;
+                        }
+                        pthread_mutex_unlock(&pool->lock);
+                        char* batch = mmap(0, (size_t)n * bytes, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE | MAP_POPULATE, 0, 0);
+                        pthread_mutex_lock(&pool->lock);
+                        if (batch == MAP_FAILED) {
+                                // out of memory - wait for the next request instead of spinning
+                                pthread_cond_wait(&pool->cond, &pool->lock);
+                                continue;
+                        }
+                        // push highest address first - pops hand out adjacent pages in order
+                        unsigned int i;
+                        for (i=n; i-- > 0; ) {
+                                if (pool->running && pool->clean_num < pool->target) {
+                                        pool->clean[pool->clean_num++] = (uintptr_t)(batch + (size_t)i * bytes);
+                                } else {
+                                        munmap(batch + (size_t)i * bytes, bytes);
+                                }
+                        }
+                } else {
+                        pthread_cond_wait(&pool->cond, &pool->lock);
+                }
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        return NULL;
+}
+
+// take up to 'n' clean read/write pages from the pool of a domain - returns how many were taken
+unsigned int pool_take(tls_domain_t* dom, uintptr_t* addresses, unsigned int n) {
+        struct page_pool* pool = &dom->pool;
+        unsigned int taken = 0;
+
+        pthread_mutex_lock(&pool->lock);
+        while (taken < n && pool->clean_num > 0) {
+                addresses[taken++] = pool->clean[--pool->clean_num];
+        }
+        if (pool->running && pool->clean_num < pool->target / 2) {
+                pthread_cond_signal(&pool->cond); // refill below low watermark
+        }
+        pthread_mutex_unlock(&pool->lock);
+        return taken;
+}
+
+// allocate a page of the domain - take one from the pool if possible, otherwise map a fresh one
+void* page_alloc(tls_domain_t* dom, int prot) {
+        uintptr_t address = 0;
+
+        if (dom->protection == TLS_PROTECT_NONE) {
+                prot = PROT_READ | PROT_WRITE; // pages of unprotected domains are always accessible
+        }
+
+        if (pool_take(dom, &address, 1) == 0) {
+                return mmap(0, dom->page_size, prot, MAP_ANON | MAP_PRIVATE, 0, 0);
+        }
+
+        // pooled pages are read/write - only adjust if caller wants something else
+        if (prot != (PROT_READ | PROT_WRITE) && mprotect((void*)address, dom->page_size, prot)) {
+                munmap((void*)address, dom->page_size);
+                return MAP_FAILED;
+        }
+        return (void*)address;
+}
+
+// helper function to check if the page supplier of a domain has pages in stock
+int pool_stocked(tls_domain_t* dom) {
+        pthread_mutex_lock(&dom->pool.lock);
+        int stocked = dom->pool.clean_num > 0;
+        pthread_mutex_unlock(&dom->pool.lock);
+        return stocked;
+}
+
+// release a page of the domain - hand it back to the supplier for zeroing, or unmap it
+void page_free(tls_domain_t* dom, void* address) {
+        struct page_pool* pool = &dom->pool;
+
+        pthread_mutex_lock(&pool->lock);
+        if (pool->running && !pool->shrunk && pool->dirty_num < pool->target) {
+                pool->dirty[pool->dirty_num++] = (uintptr_t)address;
+                pthread_cond_signal(&pool->cond);
+                address = NULL;
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        if (address != NULL) {
+                munmap(address, dom->page_size);
+        }
+}
+
+// init /proc/self/mem descriptor - reads protected pages without touching their protection
+int proc_mem_fd = -1;
+
+// helper function to get the shared /proc/self/mem descriptor
+int proc_mem() {
+        int mem_fd = __atomic_load_n(&proc_mem_fd, __ATOMIC_ACQUIRE);
+        if (mem_fd < 0) {
+                int fd = open("/proc/self/mem", O_RDONLY | O_CLOEXEC);
+                if (fd < 0) {
+                        perror("ERROR: Could not open /proc/self/mem.");
+                        return -1;
+                }
+                if (!__atomic_compare_exchange_n(&proc_mem_fd, &mem_fd, fd, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                        close(fd); // another thread won the race
+                } else {
+                        mem_fd = fd;
+                }
+        }
+        return mem_fd;
+}
+
+// allocate 'n' zeroed page descriptors in one block - NULL on failure
+struct page* page_block_alloc(unsigned int n) {
+        struct page_block* b = (struct page_block*)calloc(1, sizeof(struct page_block) + (size_t)n * sizeof(struct page));
+        if (b == NULL) {
+                return NULL;
+        }
+        b->live = n;
+        unsigned int i;
+        for (i=0; i<n; i++) {
+                b->pages[i].block = b;
+        }
+        return b->pages;
+}
+
+// free a page descriptor - its block goes with the last one
+void page_desc_free(struct page* p) {
+        if (p->block == NULL) {
+                free(p);
+        } else if (__atomic_sub_fetch(&p->block->live, 1, __ATOMIC_ACQ_REL) == 0) {
+                free(p->block);
+        }
+}
+
+// drop one reference to a page - unmap it when the last one is gone
+void page_release(tls_domain_t* dom, struct page* p) {
+        if (__atomic_sub_fetch(&p->ref_count, 1, __ATOMIC_ACQ_REL) == 0) {
+                if (p->flags & PAGE_NO_RECYCLE) {
+                        munmap((void*)p->address, dom->page_size);
+                } else {
+                        page_free(dom, (void*)p->address);
+                }
+                page_desc_free(p);
+        }
+}
+
+// start the background supplier of a domain's pool
+int pool_start(tls_domain_t* dom, unsigned int stock) {
+        struct page_pool* pool = &dom->pool;
+
+        if (stock == 0) {
+                perror("ERROR: Invalid stock size.");
+                return -1;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        if (pool->running) {
+                pthread_mutex_unlock(&pool->lock);
+                perror("ERROR: Page supplier already running.");
+                return -1;
+        }
+
+        pool->clean = (uintptr_t*)calloc(stock, sizeof(uintptr_t));
+        pool->dirty = (uintptr_t*)calloc(stock, sizeof(uintptr_t));
+        if (pool->clean == NULL || pool->dirty == NULL) {
+                free(pool->clean);
+                free(pool->dirty);
+                pool->clean = pool->dirty = NULL;
+                pthread_mutex_unlock(&pool->lock);
+                perror("ERROR: Page pool allocation failed.");
+                return -1;
+        }
+        pool->clean_num = pool->dirty_num = 0;
+        pool->target = stock;
+        pool->page_bytes = dom->page_size;
+        pool->running = 1;
+
+        if (pthread_create(&pool->supplier, NULL, page_supplier, pool)) {
+                pool->running = 0;
+                pool->target = 0;
+                free(pool->clean);
+                free(pool->dirty);
+                pool->clean = pool->dirty = NULL;
+                pthread_mutex_unlock(&pool->lock);
+                perror("ERROR: Could not start page supplier.");
+                return -1;
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        return 0;
+}
+
+// stop the background supplier of a domain's pool and release its stock
+void pool_stop(tls_domain_t* dom) {
+        struct page_pool* pool = &dom->pool;
+
+        pthread_mutex_lock(&pool->lock);
+        if (!pool->running) {
+                pthread_mutex_unlock(&pool->lock);
+                return;
+        }
+        pool->running = 0;
+        pthread_cond_broadcast(&pool->cond);
+        pthread_mutex_unlock(&pool->lock);
+
+        pthread_join(pool->supplier, NULL);
+
+        pthread_mutex_lock(&pool->lock);
+        unsigned int i;
+        for (i=0; i<pool->clean_num; i++) {
+                munmap((void*)pool->clean[i], pool->page_bytes);
+        }
+        for (i=0; i<pool->dirty_num; i++) {
+                munmap((void*)pool->dirty[i], pool->page_bytes);
+        }
+        free(pool->clean);
+        free(pool->dirty);
+        pool->clean = pool->dirty = NULL;
+        pool->clean_num = pool->dirty_num = pool->target = 0;
+        pthread_mutex_unlock(&pool->lock);
+}
 
 // prototype for warnings
 void tls_handle_page_fault(int, siginfo_t*, void*);
+void tls_profile_free(TLS*);
+void tls_splice_free(TLS*);
+int tls_splice_reap(TLS*);
+int tls_compact_tls(TLS*, struct tls_compact_stats*);
+int tls_frozen_read(TLS*, unsigned int, unsigned int, char*);
+void tls_durable_free(TLS*);
+int tls_sync_tls(TLS*);
+int tls_durable_map(TLS*, const char*);
+int tls_spill_access(TLS*, unsigned int, unsigned int);
+int tls_spill_load(TLS*, unsigned int, unsigned int);
+void tls_spill_free(TLS*);
+unsigned long spill_pass(tls_domain_t*);
+unsigned int background_tids(tls_domain_t*, pthread_t**);
+void counter_add(unsigned long*, unsigned long);
+void counters_fold(struct tls_counters*, const struct tls_counters*);
+int cmp_address(const void*, const void*);
+void tls_fast_update(TLS*);
+void tls_fast_page(TLS*, unsigned int);
+void tls_fast_drop(TLS*, unsigned int);
+void tls_fast_span(TLS*, unsigned int, unsigned int);
+void tls_fast_off_all();
+void tls_fast_fill(tls_domain_t*, TLS*);
+void tls_heat_free(TLS*);
+void tls_protect_pages(TLS*, struct page**, unsigned int, int);
+int tls_cow_span(TLS*, unsigned int, unsigned int);
+void tls_heat_hit(TLS*, unsigned int);
+struct cow_heat* heat_clone(TLS*);
+int heat_predicts(struct cow_heat*, unsigned int);
+void tls_watch_notify(TLS*, unsigned int, unsigned int);
+void tls_watch_close(TLS*);
+void tls_free(TLS*);
+void tls_quiesce(TLS*);
+void tls_desc_drop(TLS*);
+void tls_copiers_wait(TLS*);
 
 // init code
 void tls_init() {
@@ -73,6 +601,8 @@ void tls_init() {
 
         // get size of a page
         page_size = getpagesize();
+        default_domain.page_size = page_size;
+        default_domain.protection = TLS_PROTECT_PAGES;
 
         // install signal handler for page faults - SIGSEGV, SIGBUS
         sigemptyset(&sa.sa_mask);
@@ -85,31 +615,174 @@ void tls_init() {
         initialized = 1; // init this
 }
 
+// start the background page supplier of the default domain with a stock of 'stock' pages
+int tls_page_supplier_start(unsigned int stock) {
+        if (!initialized) {
+                tls_init();
+        }
+        return pool_start(&default_domain, stock);
+}
+
+// stop the background page supplier of the default domain
+void tls_page_supplier_stop() {
+        pool_stop(&default_domain);
+}
+
+// tls_domain_create
+tls_domain_t* tls_domain_create(const struct tls_domain_config* config) {
+        if (!initialized) {
+                tls_init();
+        }
+
+        struct tls_domain_config defaults = { 0, TLS_PROTECT_PAGES, 0, 0, 0, 0 };
+        if (config == NULL) {
+                config = &defaults;
+        }
+
+        if (config->protection != TLS_PROTECT_PAGES && config->protection != TLS_PROTECT_NONE) {
+                perror("ERROR: Invalid protection mode.");
+                return NULL;
+        }
+        unsigned int ps = config->page_size > 0 ? (config->page_size + page_size - 1) / page_size * page_size : page_size;
+        if (config->color_stride >= ps) {
+                perror("ERROR: Color stride must be smaller than a page.");
+                return NULL;
+        }
+
+        tls_domain_t* dom = (tls_domain_t*)calloc(1, sizeof(tls_domain_t));
+        if (dom == NULL) {
+                perror("ERROR: Domain allocation failed.");
+                return NULL;
+        }
+
+        pthread_mutex_init(&dom->lock, NULL);
+        pthread_mutex_init(&dom->pool.lock, NULL);
+        pthread_cond_init(&dom->pool.cond, NULL);
+        pthread_cond_init(&dom->unpinned, NULL);
+        pthread_cond_init(&dom->copied, NULL);
+
+        // round page granularity up to whole system pages
+        dom->page_size = ps;
+        dom->protection = config->protection;
+        dom->max_bytes = config->max_bytes;
+        dom->compact_threshold = config->compact_threshold;
+        dom->color_stride = config->color_stride;
+
+        if (config->pool_pages > 0 && pool_start(dom, config->pool_pages)) {
+                pthread_cond_destroy(&dom->unpinned);
+                pthread_cond_destroy(&dom->copied);
+                pthread_cond_destroy(&dom->pool.cond);
+                pthread_mutex_destroy(&dom->pool.lock);
+                pthread_mutex_destroy(&dom->lock);
+                free(dom);
+                return NULL;
+        }
+
+        // publish domain to the fault handler
+        pthread_mutex_lock(&domains_lock);
+        dom->next = domains;
+        domains = dom;
+        pthread_mutex_unlock(&domains_lock);
+
+        return dom;
+}
+
+// tls_domain_destroy
+int tls_domain_destroy(tls_domain_t* dom) {
+        if (dom == NULL || dom == &default_domain) {
+                perror("ERROR: Invalid domain.");
+                return -1;
+        }
+
+        // check if domain still has areas
+        pthread_mutex_lock(&dom->lock);
+        int i;
+        for (i=0; i<HASH_SIZE; i++) {
+                if (dom->hash_table[i] != NULL) {
+                        pthread_mutex_unlock(&dom->lock);
+                        perror("ERROR: Domain still has LSAs.");
+                        return -1;
+                }
+        }
+        pthread_mutex_unlock(&dom->lock);
+
+        // unlink from list of domains
+        pthread_mutex_lock(&domains_lock);
+        tls_domain_t** d = &domains;
+        while (*d != NULL && *d != dom) {
+                d = &((*d)->next);
+        }
+        if (*d != NULL) {
+                *d = dom->next;
+        }
+
+        // background passes that took the domain before it was unlinked finish first
+        while (dom->pins > 0) {
+                pthread_cond_wait(&dom->unpinned, &domains_lock);
+        }
+        pthread_mutex_unlock(&domains_lock);
+
+        // frozen areas outlive their owners but not their domain - readers must be done with them
+        for (i=0; i<HASH_SIZE; i++) {
+                struct frozen_entry* entry = dom->frozen[i];
+                while (entry != NULL) {
+                        struct frozen_entry* next = entry->next;
+                        dom->bytes -= (unsigned long)entry->tls->page_num * dom->page_size;
+                        tls_free(entry->tls);
+                        free(entry);
+                        entry = next;
+                }
+                dom->frozen[i] = NULL;
+        }
+
+        pool_stop(dom);
+        if (dom->percpu != NULL) {
+                tls_percpu_destroy_in(dom);
+        }
+        if (dom->spill != NULL) {
+                close(dom->spill->fd);
+                pthread_mutex_destroy(&dom->spill->lock);
+                free(dom->spill->free);
+                free(dom->spill);
+        }
+        pthread_cond_destroy(&dom->unpinned);
+        pthread_cond_destroy(&dom->copied);
+        pthread_cond_destroy(&dom->pool.cond);
+        pthread_mutex_destroy(&dom->pool.lock);
+        pthread_mutex_destroy(&dom->lock);
+        free(dom);
+
+        return 0;
+}
+
 // page fault handler
 void tls_handle_page_fault(int sig, siginfo_t* si, void* context) {
         uintptr_t p_fault = ((uintptr_t) si->si_addr) & ~(page_size-1);
 
-        // check all TSL entries in hash table
-        int i;
-        for (i=0; i<HASH_SIZE; i++) {
-                struct hash_element* elem = hash_table[i];
-                while (elem != NULL) {
-                        TLS* tls = elem->tls;
+        // check all TSL entries in hash tables of all domains
+        tls_domain_t* dom;
+        for (dom = domains; dom != NULL; dom = dom->next) {
+                int i;
+                for (i=0; i<HASH_SIZE; i++) {
+                        struct hash_element* elem = dom->hash_table[i];
+                        while (elem != NULL) {
+                                TLS* tls = elem->tls;
 
-                        // check each page in current TLS
-                        int j;
-                        for (j=0; j<tls->page_num; j++) {
-                                struct page* page = tls->pages[j];
-                                if (page->address == p_fault) {
-                                        // faulting address is part of this threads's TLS
-                                        if (pthread_equal(pthread_self(), elem->tid)) {
-                                                // current rhead is access its own TLS illegally
-                                                pthread_exit(NULL);
+                                // check each page in current TLS
+                                int j;
+                                for (j=0; j<tls->page_num; j++) {
+                                        struct page* page = tls->pages[j];
+                                        if (p_fault >= page->address && p_fault < page->address + dom->page_size) {
+                                                // faulting address is part of this threads's TLS
+                                                if (pthread_equal(pthread_self(), elem->tid)) {
+                                                        // current rhead is access its own TLS illegally
+                                                        pthread_exit(NULL);
+                                                }
                                         }
                                 }
-                        }
 
-                        elem = elem-> next;
+                                elem = elem-> next;
+                        }
                 }
         }
 
@@ -119,24 +792,20 @@ void tls_handle_page_fault(int sig, siginfo_t* si, void* context) {
         raise(sig);
 }
 
-// create
-int tls_create(unsigned int size) {
+// create helper - file backed if 'path' is set
+int tls_create_tls(tls_domain_t* dom, unsigned int size, const char* path) {
         if (!initialized) {
                 tls_init();
         }
 
         // check if current thread already has LSA
         pthread_t current_thread = pthread_self();
-        int i;
-        for (i=0; i<HASH_SIZE; i++) {
-                struct hash_element* elem = hash_table[i];
-                while (elem != NULL) {
-                        if (pthread_equal(elem->tid, current_thread)) {
-                                perror("ERROR: Thread already has LSA.");
-                                return -1;
-                        }
-                        elem = elem->next;
-                }
+        pthread_mutex_lock(&dom->lock);
+        TLS* existing = hash_table_find(dom, current_thread);
+        pthread_mutex_unlock(&dom->lock);
+        if (existing != NULL) {
+                perror("ERROR: Thread already has LSA.");
+                return -1;
         }
 
         // check if size > 0
@@ -145,353 +814,4207 @@ int tls_create(unsigned int size) {
                 return -1;
         }
 
+        // pick a color - durable areas map their file from offset 0
+        unsigned int color = 0;
+        if (dom->color_stride > 0 && path == NULL) {
+                unsigned int n = __atomic_fetch_add(&dom->color_next, 1, __ATOMIC_RELAXED);
+                color = (unsigned long)n * dom->color_stride % dom->page_size;
+        }
+
+        // offsets into the area are shifted by the color and must still fit
+        if ((unsigned long)size + color > UINT_MAX) {
+                perror("ERROR: Invalid size.");
+                return -1;
+        }
+
+        // check domain budget and reserve bytes for this TLS
+        unsigned int page_num = ((unsigned long)size + color + dom->page_size - 1) / dom->page_size; // compute # pages
+        unsigned long bytes = (unsigned long)page_num * dom->page_size;
+        pthread_mutex_lock(&dom->lock);
+        if (dom->max_bytes > 0 && dom->bytes + bytes > dom->max_bytes) {
+                pthread_mutex_unlock(&dom->lock);
+                perror("ERROR: Domain budget exceeded.");
+                return -1;
+        }
+        dom->bytes += bytes;
+        pthread_mutex_unlock(&dom->lock);
+
         // allocate TLS
         TLS* tls = (TLS*)calloc(1, sizeof(TLS));
         if (tls == NULL) {
                 perror("ERROR: TLS allocation failed.");
-                return -1;
+                goto unreserve;
         }
 
         // initialize TLS
+        pthread_mutex_init(&tls->lock, NULL);
         tls->tid = current_thread;
         tls->size = size;
-        tls->page_num = (size + page_size - 1) / page_size; // compute # pages
+        tls->page_num = page_num;
+        tls->color = color;
+        tls->domain = dom;
+        tls->ktid = syscall(SYS_gettid);
 
         // allocate TLS->pages
         tls->pages = (struct page**)calloc(tls->page_num, sizeof(struct page*));
         if (tls->pages == NULL) {
                 free(tls);
                 perror("ERROR: Page allocation failed.");
-                return -1;
+                goto unreserve;
         }
 
-        // allocate all pages for this TLS
-        for (i=0; i<tls->page_num; i++) {
-                struct page* p = (struct page*)malloc(sizeof(struct page));
-                if (p == NULL) {
-                        // handle partial allocation
-                        int j;
-                        for (j=0;j<i;j++) {
-                                munmap((void*)tls->pages[j]->address, page_size);
-                                free(tls->pages[j]);
-                        }
+        // allocate all pages for this TLS - descriptors in one block, pages in one mapping unless
+        // the page supplier has faulted-in pages in stock; durable pages map the file below
+        int i;
+        struct page* desc = page_block_alloc(tls->page_num);
+        if (desc == NULL) {
+                free(tls->pages);
+                free(tls);
+                perror("ERROR: Page allocation failed.");
+                goto unreserve;
+        }
+        char* base = NULL;
+        if (path == NULL && !pool_stocked(dom)) {
+                int prot = dom->protection == TLS_PROTECT_NONE ? PROT_READ | PROT_WRITE : PROT_NONE;
+                base = mmap(0, bytes, prot, MAP_ANON | MAP_PRIVATE, 0, 0);
+                if (base == MAP_FAILED) {
+                        free(desc[0].block);
                         free(tls->pages);
                         free(tls);
-                        return -1;
-
+                        perror("ERROR: Memory mapping failed.");
+                        goto unreserve;
+                }
+        }
+        for (i=0; i<tls->page_num; i++) {
+                struct page* p = &desc[i];
+                if (path != NULL) {
+                        p->address = 0;
+                } else if (base != NULL) {
+                        p->address = (uintptr_t)(base + (size_t)i * dom->page_size);
+                } else {
+                        p->address = (uintptr_t)page_alloc(dom, PROT_NONE);
                 }
-                p->address = (uintptr_t)mmap(0, page_size, PROT_NONE, MAP_ANON | MAP_PRIVATE, 0, 0);
                 if ((void*)p->address == MAP_FAILED) {
                         // handle partial allocation
-                        free(p);
                         int j;
                         for (j=0; j<i; j++) {
-                                munmap((void*)tls->pages[j]->address, page_size);
-                                free(tls->pages[j]);
+                                page_free(dom, (void*)desc[j].address);
                         }
+                        free(desc[0].block);
                         free(tls->pages);
                         free(tls);
                         perror("ERROR: Memory mapping failed.");
-                        return -1;
+                        goto unreserve;
                 }
 
 
                 p->ref_count = 1;
+                p->flags = 0;
                 tls->pages[i] = p;
 
         }
 
-        // add this thread id and TLS mapping to global has table
-        hash_table_insert(current_thread, tls);
-
-        return 0;
-}
-
-// tls_destroy
-int tls_destroy() {
-        pthread_t current_thread = pthread_self();
-        TLS* tls = NULL;
-        int tls_found = 0;
-
-        // search for current threa's TLS in global hash table
-        int i;
-        for (i=0; i<HASH_SIZE; i++) {
-                struct hash_element* elem = hash_table[i];
-                while (elem != NULL) {
-                        if (pthread_equal(elem->tid, current_thread)) {
-                                tls = elem->tls;
-                                tls_found = 1;
-                                break;
-                        }
-                        elem = elem->next;
-                }
-                if (tls_found) {
-                        break;
-                }
-        }
-
-        // check if current thread has LSA
-        if (!tls_found) {
-                perror("ERROR: current thread does not have an LSA.");
-                return -1;
+        // map file backing
+        if (path != NULL && tls_durable_map(tls, path)) {
+                free(desc[0].block);
+                free(tls->pages);
+                free(tls);
+                goto unreserve;
         }
 
-        // clean up all pages
-        for (i=0; i<tls->page_num; i++) {
-                struct page* p = tls->pages[i];
-                if (p->ref_count == 1) {
-                        munmap((void*)p->address, page_size); // page not shared - free it
-                        free(p);
+        // add this thread id and TLS mapping to domain's hash table
+        pthread_mutex_lock(&dom->lock);
+        if (hash_table_insert(dom, current_thread, tls)) {
+                pthread_mutex_unlock(&dom->lock);
+                if (tls->durable != NULL) {
+                        tls_durable_free(tls);
                 } else {
-                        p->ref_count--; // pge is shared - decrement count
-                }
-        }
-
-        free(tls->pages); // free array of page pointers
-
-        // remove mapping from global hash table
-        for (i=0; i<HASH_SIZE; i++) {
-                struct hash_element** elem = &(hash_table[i]);
-                while (*elem != NULL) {
-                        if (pthread_equal((*elem)->tid, current_thread)) {
-                                struct hash_element* temp = *elem;
-                                *elem = (*elem)->next;
-                                free(temp);
-                                break;
+                        for (i=0; i<tls->page_num; i++) {
+                                page_release(dom, tls->pages[i]);
                         }
-                        elem = &((*elem)->next);
                 }
+                free(tls->pages);
+                free(tls);
+                goto unreserve;
         }
+        pthread_mutex_unlock(&dom->lock);
 
-
-        free(tls);
         return 0;
+
+unreserve:
+        pthread_mutex_lock(&dom->lock);
+        dom->bytes -= bytes;
+        pthread_mutex_unlock(&dom->lock);
+        return -1;
 }
 
+// create
+int tls_create_in(tls_domain_t* dom, unsigned int size) {
+        return tls_create_tls(dom, size, NULL);
+}
 
-// protect helper function
-void tls_protect(struct page* p) {
-        if (mprotect((void*) p->address, page_size, 0)) {
-                fprintf(stderr, "tls_protect: could not protect page\n");
-                exit(1);
+// define slice of a parallel create - pages [first, last) of the new mapping
+struct fill_slice {
+        char* base;
+        unsigned int first;
+        unsigned int last;
+        unsigned int page_size;
+        unsigned int color; // area byte 0 lies this far into the mapping
+        unsigned int size;
+        const char* src; // contents of the area - NULL for zeros
+        pthread_t thread;
+};
+
+// fill one slice - copying faults the pages in, zero parts are written too so every page is prefaulted
+void* fill_slice_run(void* arg) {
+        struct fill_slice* f = (struct fill_slice*)arg;
+        size_t start = (size_t)f->first * f->page_size;
+        size_t end = (size_t)f->last * f->page_size;
+        size_t data_start = f->color;
+        size_t data_end = (size_t)f->color + f->size;
+
+        size_t lo = start > data_start ? start : data_start;
+        size_t hi = end < data_end ? end : data_end;
+        if (f->src != NULL && lo < hi) {
+                memset(f->base + start, 0, lo - start);
+                memcpy(f->base + lo, f->src + (lo - data_start), hi - lo);
+                memset(f->base + hi, 0, end - hi);
+        } else {
+                memset(f->base + start, 0, end - start);
         }
+        return NULL;
 }
 
-// unprotect helper function
-void tls_unprotect(struct page* p) {
-        if (mprotect((void*) p->address, page_size, PROT_READ | PROT_WRITE)) {
+// create an area of 'size' bytes filled from 'init_src' (NULL for zeros) by 'nthreads' workers (0 = one per online CPU)
+// the area is mapped in one piece, each worker prefaults and copies its own page range, and the area becomes
+// visible to the API only once all of it is in place
+int tls_create_parallel_in(tls_domain_t* dom, unsigned int size, const char* init_src, unsigned int nthreads) {
+        if (!initialized) {
+                tls_init();
+        }
+
+        // check if current thread already has LSA
+        pthread_t current_thread = pthread_self();
+        pthread_mutex_lock(&dom->lock);
+        TLS* existing = hash_table_find(dom, current_thread);
+        pthread_mutex_unlock(&dom->lock);
+        if (existing != NULL) {
+                perror("ERROR: Thread already has LSA.");
+                return -1;
+        }
+        if (size == 0) {
+                perror("ERROR: Invalid size.");
+                return -1;
+        }
+
+        unsigned int color = 0;
+        if (dom->color_stride > 0) {
+                unsigned int n = __atomic_fetch_add(&dom->color_next, 1, __ATOMIC_RELAXED);
+                color = (unsigned long)n * dom->color_stride % dom->page_size;
+        }
+
+        // check domain budget and reserve bytes for this TLS
+        unsigned int page_num = ((unsigned long)size + color + dom->page_size - 1) / dom->page_size;
+        unsigned long bytes = (unsigned long)page_num * dom->page_size;
+        pthread_mutex_lock(&dom->lock);
+        if (dom->max_bytes > 0 && dom->bytes + bytes > dom->max_bytes) {
+                pthread_mutex_unlock(&dom->lock);
+                perror("ERROR: Domain budget exceeded.");
+                return -1;
+        }
+        dom->bytes += bytes;
+        pthread_mutex_unlock(&dom->lock);
+
+        TLS* tls = (TLS*)calloc(1, sizeof(TLS));
+        struct page** pages = (struct page**)calloc(page_num, sizeof(struct page*));
+        struct page* desc = page_block_alloc(page_num);
+        char* base = MAP_FAILED;
+        if (tls != NULL && pages != NULL && desc != NULL) {
+                base = mmap(0, bytes, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, 0, 0);
+        }
+        if (base == MAP_FAILED) {
+                free(tls);
+                free(pages);
+                free(desc ? desc[0].block : NULL);
+                perror("ERROR: Parallel TLS allocation failed.");
+                goto unreserve;
+        }
+
+        // split pages evenly - the calling thread fills the first slice itself
+        if (nthreads == 0) {
+                long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+                nthreads = cpus > 0 ? cpus : 1;
+        }
+        if (nthreads > page_num) {
+                nthreads = page_num;
+        }
+        struct fill_slice* slices = (struct fill_slice*)calloc(nthreads, sizeof(struct fill_slice));
+        if (slices == NULL) {
+                nthreads = 1;
+        }
+        struct fill_slice single;
+        struct fill_slice* f = slices ? slices : &single;
+        unsigned int i, started = 0;
+        for (i=0; i<nthreads; i++) {
+                f[i].base = base;
+                f[i].first = (unsigned long)page_num * i / nthreads;
+                f[i].last = (unsigned long)page_num * (i + 1) / nthreads;
+                f[i].page_size = dom->page_size;
+                f[i].color = color;
+                f[i].size = size;
+                f[i].src = init_src;
+        }
+        for (i=1; i<nthreads; i++) {
+                if (pthread_create(&f[i].thread, NULL, fill_slice_run, &f[i])) {
+                        break; // fill the rest here
+                }
+                started = i;
+        }
+        fill_slice_run(&f[0]);
+        for (i=started+1; i<nthreads; i++) {
+                fill_slice_run(&f[i]);
+        }
+        for (i=1; i<=started; i++) {
+                pthread_join(f[i].thread, NULL);
+        }
+        free(slices);
+
+        // one protection change for the whole area
+        if (dom->protection == TLS_PROTECT_PAGES && mprotect(base, bytes, PROT_NONE)) {
+                fprintf(stderr, "tls_create_parallel: could not protect pages\n");
+                exit(1);
+        }
+
+        pthread_mutex_init(&tls->lock, NULL);
+        tls->tid = current_thread;
+        tls->size = size;
+        tls->page_num = page_num;
+        tls->color = color;
+        tls->domain = dom;
+        tls->ktid = syscall(SYS_gettid);
+        tls->pages = pages;
+        for (i=0; i<page_num; i++) {
+                desc[i].address = (uintptr_t)(base + (size_t)i * dom->page_size);
+                desc[i].ref_count = 1;
+                pages[i] = &desc[i];
+        }
+
+        // publish - until now no other thread could see the area
+        pthread_mutex_lock(&dom->lock);
+        if (hash_table_insert(dom, current_thread, tls)) {
+                pthread_mutex_unlock(&dom->lock);
+                munmap(base, bytes);
+                free(desc[0].block);
+                free(pages);
+                free(tls);
+                goto unreserve;
+        }
+        pthread_mutex_unlock(&dom->lock);
+
+        return 0;
+
+unreserve:
+        pthread_mutex_lock(&dom->lock);
+        dom->bytes -= bytes;
+        pthread_mutex_unlock(&dom->lock);
+        return -1;
+}
+
+// helper function to wait for background passes that found a TLS before it was unlinked, then free its spill slots
+void tls_quiesce(TLS* tls) {
+        pthread_mutex_lock(&tls->lock);
+        pthread_mutex_unlock(&tls->lock);
+        tls_spill_free(tls);
+}
+
+// helper function to release a TLS no thread can reach anymore
+void tls_free(TLS* tls) {
+        tls_quiesce(tls);
+
+        // durable areas are flushed and unmapped in one piece - their pages are never shared
+        if (tls->durable != NULL) {
+                tls_durable_free(tls);
+        } else {
+                // clean up all pages - shared pages are only unmapped by their last owner
+                unsigned int i;
+                for (i=0; i<tls->page_num; i++) {
+                        page_release(tls->domain, tls->pages[i]);
+                }
+                tls_splice_free(tls);
+        }
+
+        free(tls->pages); // free array of page pointers
+        free(tls->direct);
+        tls_desc_drop(tls);
+        tls_profile_free(tls);
+        tls_heat_free(tls);
+        free(tls);
+}
+
+// tls_destroy
+int tls_destroy_in(tls_domain_t* dom) {
+        pthread_t current_thread = pthread_self();
+
+        // remove current thread's TLS from domain's hash table
+        pthread_mutex_lock(&dom->lock);
+        TLS* tls = hash_table_remove(dom, current_thread);
+        if (tls != NULL) {
+                counters_fold(&dom->retired, &tls->counters);
+                tls_watch_close(tls);
+                tls_copiers_wait(tls);
+        }
+        if (tls != NULL && !tls->frozen) {
+                dom->bytes -= (unsigned long)tls->page_num * dom->page_size;
+        }
+        pthread_mutex_unlock(&dom->lock);
+
+        // check if current thread has LSA
+        if (tls == NULL) {
+                perror("ERROR: current thread does not have an LSA.");
+                return -1;
+        }
+        if (tls_fast_cache.view == &tls->fast) {
+                memset(&tls_fast_cache, 0, sizeof(tls_fast_cache));
+        }
+
+        // frozen areas are only detached from their owner - readers may still use them
+        if (tls->frozen) {
+                return 0;
+        }
+
+        tls_free(tls);
+        return 0;
+}
+
+// tls_destroy_many - destroy the areas of 'n' threads at once, e.g. when a pool shuts down - returns areas destroyed
+// the threads must be done with their areas; threads without one are skipped
+int tls_destroy_many_in(tls_domain_t* dom, const pthread_t* tids, unsigned int n) {
+        if (tids == NULL && n > 0) {
+                perror("ERROR: Invalid thread list.");
+                return -1;
+        }
+        TLS** gone = (TLS**)malloc((n > 0 ? n : 1) * sizeof(TLS*));
+        if (gone == NULL) {
+                perror("ERROR: Could not allocate list of areas.");
+                return -1;
+        }
+
+        // unlink all areas under one hold of the domain lock
+        unsigned int i, gone_num = 0, page_total = 0;
+        int destroyed = 0;
+        pthread_mutex_lock(&dom->lock);
+        for (i=0; i<n; i++) {
+                TLS* tls = hash_table_remove(dom, tids[i]);
+                if (tls == NULL) {
+                        continue; // no area, or listed twice
+                }
+                destroyed++;
+                counters_fold(&dom->retired, &tls->counters);
+                tls_watch_close(tls);
+                tls_copiers_wait(tls);
+                if (tls->frozen) {
+                        continue; // frozen areas are only detached - readers may still use them
+                }
+                dom->bytes -= (unsigned long)tls->page_num * dom->page_size;
+                gone[gone_num++] = tls;
+                if (tls->durable == NULL) {
+                        page_total += tls->page_num;
+                }
+        }
+        pthread_mutex_unlock(&dom->lock);
+        __atomic_add_fetch(&tls_fast_gen, 1, __ATOMIC_RELEASE); // fast path caches may point at these areas
+
+        // collect the page references of all areas - pinned pages are flagged before they are dropped
+        struct page** pages = (struct page**)malloc((page_total > 0 ? page_total : 1) * sizeof(struct page*));
+        uintptr_t* addresses = (uintptr_t*)malloc((page_total > 0 ? page_total : 1) * sizeof(uintptr_t));
+        unsigned int page_count = 0;
+        for (i=0; i<gone_num; i++) {
+                TLS* tls = gone[i];
+                tls_quiesce(tls);
+                if (tls->durable != NULL) {
+                        tls_durable_free(tls);
+                } else {
+                        tls_splice_free(tls);
+                        unsigned int j;
+                        for (j=0; j<tls->page_num; j++) {
+                                if (pages != NULL && addresses != NULL) {
+                                        pages[page_count++] = tls->pages[j];
+                                } else {
+                                        page_release(dom, tls->pages[j]); // no memory for the batch - one by one
+                                }
+                        }
+                }
+                free(tls->pages);
+                free(tls->direct);
+                tls_desc_drop(tls);
+                tls_profile_free(tls);
+                tls_heat_free(tls);
+                free(tls);
+        }
+        free(gone);
+
+        // drop references in bulk - pages shared among the areas appear once per reference after sorting
+        qsort(pages, page_count, sizeof(struct page*), cmp_address);
+        unsigned int address_num = 0, recycled = 0;
+        struct page_pool* pool = &dom->pool;
+        pthread_mutex_lock(&pool->lock);
+        i = 0;
+        while (i < page_count) {
+                struct page* p = pages[i];
+                int refs = 0;
+                for (; i < page_count && pages[i] == p; i++) {
+                        refs++;
+                }
+                if (__atomic_sub_fetch(&p->ref_count, refs, __ATOMIC_ACQ_REL) > 0) {
+                        continue; // still used by a clone outside the batch
+                }
+                if (!(p->flags & PAGE_NO_RECYCLE) && pool->running && !pool->shrunk && pool->dirty_num < pool->target) {
+                        pool->dirty[pool->dirty_num++] = p->address;
+                        recycled++;
+                } else {
+                        addresses[address_num++] = p->address;
+                }
+                page_desc_free(p);
+        }
+        if (recycled > 0) {
+                pthread_cond_signal(&pool->cond);
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        // unmap the rest - one munmap per run of adjacent pages
+        qsort(addresses, address_num, sizeof(uintptr_t), cmp_address);
+        i = 0;
+        while (i < address_num) {
+                uintptr_t start = addresses[i];
+                uintptr_t end = start + dom->page_size;
+                for (i++; i < address_num && addresses[i] == end; i++) {
+                        end += dom->page_size;
+                }
+                munmap((void*)start, end - start);
+        }
+        free(pages);
+        free(addresses);
+        return destroyed;
+}
+
+
+// lock a page for a protection change - sharers open and close it concurrently, a private page is never contended
+void page_lock(struct page* p) {
+        int c = 0;
+        if (__atomic_compare_exchange_n(&p->lock, &c, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+                return;
+        }
+        if (c != 2) {
+                c = __atomic_exchange_n(&p->lock, 2, __ATOMIC_ACQUIRE);
+        }
+        while (c != 0) {
+                syscall(SYS_futex, &p->lock, FUTEX_WAIT | FUTEX_PRIVATE_FLAG, 2, NULL, NULL, 0);
+                c = __atomic_exchange_n(&p->lock, 2, __ATOMIC_ACQUIRE);
+        }
+}
+
+// try to lock a page without waiting - returns 1 if it is locked
+int page_trylock(struct page* p) {
+        int c = 0;
+        return __atomic_compare_exchange_n(&p->lock, &c, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+// unlock a page locked by page_lock or page_trylock
+void page_unlock(struct page* p) {
+        if (__atomic_exchange_n(&p->lock, 0, __ATOMIC_RELEASE) == 2) {
+                syscall(SYS_futex, &p->lock, FUTEX_WAKE | FUTEX_PRIVATE_FLAG, 1, NULL, NULL, 0);
+        }
+}
+
+// protect helper function - closes one tls_unprotect, the page is protected when the last one is closed
+void tls_protect(tls_domain_t* dom, struct page* p) {
+        if (dom->protection == TLS_PROTECT_NONE) {
+                return;
+        }
+        page_lock(p);
+        if (p->open > 0 && --p->open == 0 && mprotect((void*) p->address, dom->page_size, (p->flags & PAGE_READABLE) ? PROT_READ : 0)) {
+                fprintf(stderr, "tls_protect: could not protect page\n");
+                exit(1);
+        }
+        page_unlock(p);
+}
+
+// unprotect helper function - pair with tls_protect, a shared page stays open while any sharer uses it
+void tls_unprotect(tls_domain_t* dom, struct page* p) {
+        if (dom->protection == TLS_PROTECT_NONE) {
+                return;
+        }
+        page_lock(p);
+        if (p->open++ == 0 && mprotect((void*) p->address, dom->page_size, PROT_READ | PROT_WRITE)) {
                 fprintf(stderr, "tls_unprotect: could not unprotect page\n");
                 exit(1);
         }
+        page_unlock(p);
+}
+
+// helper function to get protection of a page - pages of frozen areas never go below PROT_READ
+int page_prot(struct page* p, int prot) {
+        if (prot == 0 && (p->flags & PAGE_READABLE)) {
+                return PROT_READ;
+        }
+        return prot;
+}
+
+// add to a counter of the current thread's TLS - single writer, relaxed so the exporter reads whole values
+void counter_add(unsigned long* counter, unsigned long n) {
+        __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+// helper function to open (prot != 0) or close a page - returns 1 if its protection has to change
+int page_open(struct page* p, int prot) {
+        if (prot != 0) {
+                return p->open++ == 0;
+        }
+        return p->open > 0 && --p->open == 0;
+}
+
+// open (prot != 0) or close all pages of a TLS - one mprotect per run of adjacent pages that change
+void tls_protect_all(TLS* tls, int prot) {
+        tls_protect_pages(tls, tls->pages, tls->page_num, prot);
+}
+
+// open (prot != 0) or close 'n' pages used by a TLS - one mprotect per run of adjacent pages that change
+// each page of a run stays locked until its mprotect is done; pages after the first are only tried, so a
+// run ends at a page another thread holds instead of waiting for it while holding the others
+void tls_protect_pages(TLS* tls, struct page** pages, unsigned int n, int prot) {
+        tls_domain_t* dom = tls->domain;
+        if (dom->protection == TLS_PROTECT_NONE) {
+                return;
+        }
+
+        unsigned int i = 0;
+        while (i < n) {
+                page_lock(pages[i]);
+                if (!page_open(pages[i], prot)) {
+                        page_unlock(pages[i]);
+                        i++;
+                        continue; // still open for a sharer
+                }
+                unsigned int first = i;
+                uintptr_t start = pages[i]->address;
+                uintptr_t end = start + dom->page_size;
+                int run_prot = page_prot(pages[i], prot);
+                for (i++; i < n && pages[i]->address == end && page_prot(pages[i], prot) == run_prot && page_trylock(pages[i]); i++) {
+                        if (!page_open(pages[i], prot)) {
+                                page_unlock(pages[i]);
+                                i++;
+                                break;
+                        }
+                        end += dom->page_size;
+                }
+                if (mprotect((void*)start, end - start, run_prot)) {
+                        fprintf(stderr, "tls_protect_all: could not change page protection\n");
+                        exit(1);
+                }
+                counter_add(&tls->counters.mprotects, 1);
+                unsigned int j;
+                for (j = first; j < first + (end - start) / dom->page_size; j++) {
+                        page_unlock(pages[j]);
+                }
+        }
+}
+
+// helper function to find TLS of current thread
+TLS* tls_find_current(tls_domain_t* dom) {
+        pthread_mutex_lock(&dom->lock);
+        TLS* tls = hash_table_find(dom, pthread_self());
+        pthread_mutex_unlock(&dom->lock);
+        return tls;
+}
+
+// init profiler - sample one of every 'profile_interval' accesses (0 = off)
+unsigned int profile_interval = 0;
+
+// start sampling tls_read/tls_write - one of every 'interval' accesses per thread
+int tls_profile_start(unsigned int interval) {
+        if (interval == 0) {
+                perror("ERROR: Invalid sampling interval.");
+                return -1;
+        }
+        __atomic_store_n(&profile_interval, interval, __ATOMIC_RELAXED);
+        tls_fast_off_all(); // sampled accesses must go through tls_read/tls_write
+        return 0;
+}
+
+// stop sampling - collected profiles are kept until their TLS is destroyed
+void tls_profile_stop() {
+        __atomic_store_n(&profile_interval, 0, __ATOMIC_RELAXED);
+}
+
+// init fast path cache of tls.h
+__thread struct tls_fast_cache tls_fast_cache;
+unsigned long tls_fast_gen = 0;
+
+// let the inline fast path of tls.h copy to and from a TLS - only plain areas of unprotected domains qualify
+void tls_fast_update(TLS* tls) {
+        tls_domain_t* dom = tls->domain;
+        int plain = dom->protection == TLS_PROTECT_NONE && !tls->frozen && tls->durable == NULL && !tls->reclaimable
+                && tls->spill_age == 0 && tls->spilled == 0 && __atomic_load_n(&profile_interval, __ATOMIC_RELAXED) == 0
+                && __atomic_load_n(&tls->watch, __ATOMIC_ACQUIRE) == NULL;
+        if (plain && tls->direct == NULL) {
+                char** direct = (char**)calloc(tls->page_num, sizeof(char*));
+                if (direct == NULL) {
+                        return; // stay on the slow path
+                }
+                tls->fast.size = tls->size;
+                tls->fast.page_size = dom->page_size;
+                tls->fast.color = tls->color;
+                tls->fast.counters = &tls->counters;
+                __atomic_store_n(&tls->direct, direct, __ATOMIC_SEQ_CST);
+        }
+        __atomic_store_n(&tls->fast.pages, plain ? tls->direct : NULL, __ATOMIC_RELEASE);
+}
+
+// point the fast path cache of the current thread at its TLS in 'dom'
+void tls_fast_fill(tls_domain_t* dom, TLS* tls) {
+        tls_fast_update(tls);
+        tls_fast_cache.domain = dom;
+        tls_fast_cache.view = &tls->fast;
+        tls_fast_cache.gen = __atomic_load_n(&tls_fast_gen, __ATOMIC_ACQUIRE);
+}
+
+// publish page 'pn' of a TLS to the fast path unless it is shared - a clone sharing it meanwhile takes it off again
+void tls_fast_page(TLS* tls, unsigned int pn) {
+        if (tls->direct == NULL) {
+                return;
+        }
+        struct page* p = tls->pages[pn];
+        if (p->flags & PAGE_EAGER) {
+                return; // its first write goes through tls_write to confirm the prediction
+        }
+        __atomic_store_n(&tls->direct[pn], (char*)p->address, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&p->ref_count, __ATOMIC_SEQ_CST) > 1) {
+                __atomic_store_n(&tls->direct[pn], NULL, __ATOMIC_SEQ_CST);
+        }
+}
+
+// publish the pages spanned by an access to the fast path - caller owns the TLS
+void tls_fast_span(TLS* tls, unsigned int offset, unsigned int length) {
+        if (tls->fast.pages == NULL || length == 0) {
+                return;
+        }
+        unsigned int pn;
+        for (pn = offset / tls->fast.page_size; pn <= (offset + length - 1) / tls->fast.page_size; pn++) {
+                tls_fast_page(tls, pn);
+        }
+}
+
+// take page 'pn' of a TLS off the fast path - after a new reference to it was taken
+void tls_fast_drop(TLS* tls, unsigned int pn) {
+        char** direct = __atomic_load_n(&tls->direct, __ATOMIC_SEQ_CST);
+        if (direct != NULL) {
+                __atomic_store_n(&direct[pn], NULL, __ATOMIC_SEQ_CST);
+        }
+}
+
+// take all areas of all domains off the fast path - they come back on their next tls_read/tls_write
+void tls_fast_off_all() {
+        pthread_mutex_lock(&domains_lock);
+        tls_domain_t* dom;
+        for (dom = domains; dom != NULL; dom = dom->next) {
+                pthread_mutex_lock(&dom->lock);
+                int i;
+                for (i=0; i<HASH_SIZE; i++) {
+                        struct hash_element* elem;
+                        for (elem = dom->hash_table[i]; elem != NULL; elem = elem->next) {
+                                __atomic_store_n(&elem->tls->fast.pages, NULL, __ATOMIC_RELEASE);
+                        }
+                }
+                pthread_mutex_unlock(&dom->lock);
+        }
+        pthread_mutex_unlock(&domains_lock);
+}
+
+// helper function to release the profile of a TLS
+void tls_profile_free(TLS* tls) {
+        if (tls->prof != NULL) {
+                free(tls->prof->page_reads);
+                free(tls->prof->page_writes);
+                free(tls->prof);
+                tls->prof = NULL;
+        }
+}
+
+// record one sampled access into the profile of the current thread's TLS - 'offset' is not shifted by the color yet
+void tls_profile_record(TLS* tls, unsigned int offset, unsigned int length, int write) {
+        struct tls_profile* prof = tls->prof;
+        if (prof == NULL) {
+                prof = (struct tls_profile*)calloc(1, sizeof(struct tls_profile));
+                if (prof == NULL) {
+                        return;
+                }
+                prof->page_reads = (unsigned long*)calloc(tls->page_num, sizeof(unsigned long));
+                prof->page_writes = (unsigned long*)calloc(tls->page_num, sizeof(unsigned long));
+                if (prof->page_reads == NULL || prof->page_writes == NULL) {
+                        free(prof->page_reads);
+                        free(prof->page_writes);
+                        free(prof);
+                        return;
+                }
+                tls->prof = prof;
+        }
+        prof->samples++;
+
+        // length histogram - bucket k holds lengths in [2^k, 2^(k+1))
+        int bucket = length ? 31 - __builtin_clz(length) : 0;
+        if (write) {
+                prof->write_len[bucket]++;
+        } else {
+                prof->read_len[bucket]++;
+        }
+
+        // page heat - pages are counted where the access lands, after the color shift
+        unsigned int ps = tls->domain->page_size;
+        unsigned int start = offset + tls->color;
+        unsigned int pn;
+        unsigned int last = length ? (start + length - 1) / ps : start / ps;
+        for (pn = start / ps; pn <= last && pn < tls->page_num; pn++) {
+                if (write) {
+                        prof->page_writes[pn]++;
+                } else {
+                        prof->page_reads[pn]++;
+                }
+        }
+
+        // offset histogram - one entry per distinct field
+        unsigned int i;
+        for (i=0; i<prof->field_num; i++) {
+                if (prof->fields[i].offset == offset && prof->fields[i].length == length) {
+                        break;
+                }
+        }
+        if (i == prof->field_num) {
+                if (prof->field_num == PROF_FIELDS) {
+                        prof->dropped++;
+                        return;
+                }
+                prof->fields[i].offset = offset;
+                prof->fields[i].length = length;
+                prof->field_num++;
+        }
+        if (write) {
+                prof->fields[i].writes++;
+        } else {
+                prof->fields[i].reads++;
+        }
+}
+
+// helper function to count pages spanned by a range
+unsigned int prof_span(unsigned int offset, unsigned int length, unsigned int ps) {
+        if (length == 0) {
+                return 1;
+        }
+        return (offset + length - 1) / ps - offset / ps + 1;
+}
+
+// helper function to sort fields by offset
+int prof_cmp_offset(const void* a, const void* b) {
+        const struct prof_field* x = a;
+        const struct prof_field* y = b;
+        return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+// helper function to sort fields by heat, hottest first
+int prof_cmp_heat(const void* a, const void* b) {
+        const struct prof_field* x = a;
+        const struct prof_field* y = b;
+        unsigned long hx = x->reads + x->writes;
+        unsigned long hy = y->reads + y->writes;
+        return (hx < hy) - (hx > hy);
+}
+
+// print profile of one TLS together with a suggested packed layout - offsets are those of the API, page counts
+// include the color shift the suggested layout would get as well
+void tls_profile_print(FILE* out, TLS* tls) {
+        struct tls_profile* prof = tls->prof;
+        unsigned int ps = tls->domain->page_size;
+        unsigned int color = tls->color;
+        unsigned int i;
+
+        fprintf(out, "thread %#lx: %lu samples, size %u, %u pages\n",
+                (unsigned long)tls->tid, prof->samples, tls->size, tls->page_num);
+
+        fprintf(out, "  length histogram (reads/writes):\n");
+        for (i=0; i<PROF_LEN_BUCKETS; i++) {
+                if (prof->read_len[i] || prof->write_len[i]) {
+                        fprintf(out, "    [%lu, %lu): %lu/%lu\n", i ? 1UL << i : 0UL, 1UL << (i + 1),
+                                prof->read_len[i], prof->write_len[i]);
+                }
+        }
+
+        fprintf(out, "  page heat (reads/writes):\n");
+        for (i=0; i<tls->page_num; i++) {
+                if (prof->page_reads[i] || prof->page_writes[i]) {
+                        fprintf(out, "    page %u: %lu/%lu\n", i, prof->page_reads[i], prof->page_writes[i]);
+                }
+        }
+
+        // merge overlapping fields into groups that have to stay together
+        struct prof_field groups[PROF_FIELDS];
+        unsigned int group_num = 0;
+        struct prof_field sorted[PROF_FIELDS];
+        memcpy(sorted, prof->fields, prof->field_num * sizeof(struct prof_field));
+        qsort(sorted, prof->field_num, sizeof(struct prof_field), prof_cmp_offset);
+        for (i=0; i<prof->field_num; i++) {
+                struct prof_field* f = &sorted[i];
+                if (group_num > 0) {
+                        struct prof_field* g = &groups[group_num - 1];
+                        if (f->offset < g->offset + g->length) {
+                                if (f->offset + f->length > g->offset + g->length) {
+                                        g->length = f->offset + f->length - g->offset;
+                                }
+                                g->reads += f->reads;
+                                g->writes += f->writes;
+                                continue;
+                        }
+                }
+                groups[group_num++] = *f;
+        }
+        qsort(groups, group_num, sizeof(struct prof_field), prof_cmp_heat);
+
+        // pack groups hottest first, 8-byte aligned, and compare pages touched
+        unsigned char* old_written = (unsigned char*)calloc(tls->page_num, 1);
+        unsigned char* new_written = (unsigned char*)calloc(tls->page_num, 1);
+        if (old_written == NULL || new_written == NULL) {
+                free(old_written);
+                free(new_written);
+                return;
+        }
+        unsigned long accesses = 0, old_spans = 0, new_spans = 0;
+        unsigned int old_pages = 0, new_pages = 0, next = 0;
+        fprintf(out, "  hot fields and suggested layout:\n");
+        for (i=0; i<group_num; i++) {
+                struct prof_field* g = &groups[i];
+                unsigned long heat = g->reads + g->writes;
+                unsigned int pn;
+
+                fprintf(out, "    offset %u length %u: %lu reads, %lu writes -> offset %u\n",
+                        g->offset, g->length, g->reads, g->writes, next);
+
+                unsigned int old_start = g->offset + color;
+                unsigned int new_start = next + color;
+                accesses += heat;
+                old_spans += heat * prof_span(old_start, g->length, ps);
+                new_spans += heat * prof_span(new_start, g->length, ps);
+                if (g->writes > 0) {
+                        for (pn = old_start / ps; pn < old_start / ps + prof_span(old_start, g->length, ps) && pn < tls->page_num; pn++) {
+                                old_pages += !old_written[pn];
+                                old_written[pn] = 1;
+                        }
+                        for (pn = new_start / ps; pn < new_start / ps + prof_span(new_start, g->length, ps) && pn < tls->page_num; pn++) {
+                                new_pages += !new_written[pn];
+                                new_written[pn] = 1;
+                        }
+                }
+                next = (next + g->length + 7) & ~7U;
+        }
+        free(old_written);
+        free(new_written);
+
+        if (accesses > 0) {
+                fprintf(out, "  estimate: written pages %u -> %u (CoW copies per clone), pages per access %.2f -> %.2f (mprotect calls if only touched pages are unprotected)\n",
+                        old_pages, new_pages, (double)old_spans / accesses, (double)new_spans / accesses);
+        }
+        if (prof->dropped > 0) {
+                fprintf(out, "  %lu samples of untracked fields dropped\n", prof->dropped);
+        }
+}
+
+// print profiles of all threads of a domain
+int tls_profile_report_in(tls_domain_t* dom, FILE* out) {
+        int i;
+        pthread_mutex_lock(&dom->lock);
+        for (i=0; i<HASH_SIZE; i++) {
+                struct hash_element* elem = dom->hash_table[i];
+                while (elem != NULL) {
+                        if (elem->tls->prof != NULL) {
+                                tls_profile_print(out, elem->tls);
+                        }
+                        elem = elem->next;
+                }
+        }
+        pthread_mutex_unlock(&dom->lock);
+        return 0;
+}
+
+// read helper - caller owns the TLS
+int tls_read_tls(TLS* tls, unsigned int offset, unsigned int length, char *buffer) {
+        tls_domain_t* dom = tls->domain;
+
+        // check if offset+length is within TLS size
+        if (offset + length > tls->size) {
+                perror("ERROR: Requested read exceeds TLS size.");
+                return -1;
+        }
+
+        // sample access for the profiler
+        unsigned int interval = __atomic_load_n(&profile_interval, __ATOMIC_RELAXED);
+        if (interval > 0 && tls->prof_countdown-- == 0) {
+                tls->prof_countdown = interval - 1;
+                tls_profile_record(tls, offset, length, 0);
+        }
+        counter_add(&tls->counters.reads, 1);
+        counter_add(&tls->counters.bytes_read, length);
+
+        // frozen areas are read without changing protection
+        if (tls->frozen) {
+                return tls_frozen_read(tls, offset, length, buffer);
+        }
+        offset += tls->color;
+
+        // record access and bring spilled pages back
+        if ((tls->spill_age > 0 || tls->spilled > 0) && tls_spill_access(tls, offset, length)) {
+                return -1;
+        }
+
+        // unprotect all pages belonging to thread's TLS
+        tls_protect_all(tls, PROT_READ | PROT_WRITE);
+
+        // perform read operation
+        unsigned int cnt, idx;
+        for (cnt=0, idx = offset; idx < (offset + length); ++cnt, ++idx) {
+                unsigned int pn = idx / dom->page_size;
+                unsigned int poff = idx % dom->page_size;
+                struct page* p = tls->pages[pn];
+                char* src = ((char*) p->address) + poff;
+                buffer[cnt] = *src;
+        }
+
+        // reprotect all pages belonging to thread's TLS
+        tls_protect_all(tls, 0);
+
+        // publish pages that are private again, e.g. after their clones went away
+        tls_fast_span(tls, offset, length);
+
+        return 0;
+}
+
+// take 'n' adjacent descriptors for CoW copies of a TLS - cut from a block the TLS keeps, a new block when it runs out
+struct page* tls_desc_take(TLS* tls, unsigned int n) {
+        if (tls->spare_num < n) {
+                unsigned int num = n > COW_DESC_BLOCK ? n : COW_DESC_BLOCK;
+                struct page* block = page_block_alloc(num);
+                if (block == NULL) {
+                        return NULL;
+                }
+                tls_desc_drop(tls);
+                tls->spare = block;
+                tls->spare_num = num;
+        }
+        struct page* p = tls->spare;
+        tls->spare += n;
+        tls->spare_num -= n;
+        return p;
+}
+
+// give back the last 'n' descriptors taken by tls_desc_take - they must be unused
+void tls_desc_return(TLS* tls, unsigned int n) {
+        tls->spare -= n;
+        tls->spare_num += n;
+}
+
+// release the descriptors a TLS keeps for CoW copies - their block goes once its used descriptors are released too
+void tls_desc_drop(TLS* tls) {
+        unsigned int i;
+        for (i=0; i<tls->spare_num; i++) {
+                page_desc_free(&tls->spare[i]);
+        }
+        tls->spare = NULL;
+        tls->spare_num = 0;
+}
+
+// copy all shared pages of a write at once - pooled pages or one mapping, one swap under the domain lock and one mprotect
+// per run of old pages instead of a round per page; only partially written pages keep their old contents
+// caller owns the TLS and has opened its pages, spans with fewer than two shared pages are left to tls_write_tls
+int tls_cow_span(TLS* tls, unsigned int offset, unsigned int length) {
+        tls_domain_t* dom = tls->domain;
+        unsigned int ps = dom->page_size;
+        unsigned int first = offset / ps;
+        unsigned int last = (offset + length - 1) / ps;
+        unsigned int pn, n = 0;
+        for (pn = first; pn <= last; pn++) {
+                n += __atomic_load_n(&tls->pages[pn]->ref_count, __ATOMIC_ACQUIRE) > 1;
+        }
+        if (n < 2) {
+                return 0;
+        }
+
+        // descriptors of the copies come from the block of the TLS, the pages from the pool stock first
+        // and the rest from one fresh mapping
+        struct page** old = (struct page**)malloc(n * sizeof(struct page*));
+        unsigned int* pns = (unsigned int*)malloc(n * sizeof(unsigned int));
+        uintptr_t* fresh = (uintptr_t*)malloc(n * sizeof(uintptr_t));
+        struct page* copies = tls_desc_take(tls, n);
+        unsigned int pooled = 0;
+        char* batch = NULL;
+        if (old != NULL && pns != NULL && fresh != NULL && copies != NULL) {
+                pooled = pool_take(dom, fresh, n);
+                if (pooled < n) {
+                        batch = mmap(0, (size_t)(n - pooled) * ps, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, 0, 0);
+                }
+        }
+        if (old == NULL || pns == NULL || fresh == NULL || copies == NULL || batch == MAP_FAILED) {
+                unsigned int i;
+                for (i=0; i<pooled; i++) {
+                        page_free(dom, (void*)fresh[i]);
+                }
+                free(old);
+                free(pns);
+                free(fresh);
+                if (copies != NULL) {
+                        tls_desc_return(tls, n);
+                }
+                perror("ERROR: Memory allocation for page copies.");
+                return -1;
+        }
+        unsigned int i;
+        for (i=pooled; i<n; i++) {
+                fresh[i] = (uintptr_t)(batch + (size_t)(i - pooled) * ps);
+        }
+        unsigned int k = 0;
+        for (pn = first; pn <= last && k < n; pn++) {
+                struct page* p = tls->pages[pn];
+                if (__atomic_load_n(&p->ref_count, __ATOMIC_ACQUIRE) <= 1) {
+                        continue;
+                }
+                struct page* copy = &copies[k];
+                copy->address = fresh[k];
+                copy->ref_count = 1;
+                copy->open = 1; // mapped read/write - closed with the rest by tls_write_tls
+
+                // pages the write covers completely are overwritten anyway
+                if ((size_t)pn * ps < offset || (size_t)(pn + 1) * ps > (size_t)offset + length) {
+                        memcpy((void*)fresh[k], (void*)p->address, ps);
+                }
+                old[k] = p;
+                pns[k] = pn;
+                k++;
+        }
+        if (k < n) {
+                // pages went private meanwhile
+                for (i=k; i<n; i++) {
+                        page_free(dom, (void*)fresh[i]);
+                }
+                tls_desc_return(tls, n - k);
+        }
+        free(fresh);
+
+        // swap under domain lock so concurrent clones see either page
+        pthread_mutex_lock(&dom->lock);
+        for (i=0; i<k; i++) {
+                tls->pages[pns[i]] = &copies[i];
+        }
+        pthread_mutex_unlock(&dom->lock);
+
+        // update original pages
+        tls_protect_pages(tls, old, k, 0);
+        for (i=0; i<k; i++) {
+                page_release(dom, old[i]);
+                tls_heat_hit(tls, pns[i]);
+        }
+        tls->cow_splits += k;
+        counter_add(&tls->counters.cow_copies, k);
+        free(old);
+        free(pns);
+        return 0;
+}
+
+// write helper - caller owns the TLS
+int tls_write_tls(TLS* tls, unsigned int offset, unsigned int length, char* buffer) {
+        tls_domain_t* dom = tls->domain;
+
+        // check if offset+length is within TLS size
+        if (offset + length > tls->size) {
+                perror("ERROR: Requested write exceeds TLS size.");
+                return -1;
+        }
+
+        // check if TLS is frozen
+        if (tls->frozen) {
+                perror("ERROR: TLS is frozen.");
+                return -1;
+        }
+
+        // sample access for the profiler
+        unsigned int interval = __atomic_load_n(&profile_interval, __ATOMIC_RELAXED);
+        if (interval > 0 && tls->prof_countdown-- == 0) {
+                tls->prof_countdown = interval - 1;
+                tls_profile_record(tls, offset, length, 1);
+        }
+        counter_add(&tls->counters.writes, 1);
+        counter_add(&tls->counters.bytes_written, length);
+
+        // drop pins of spliced data the reader has consumed - avoids needless CoW
+        if (tls->pins != NULL) {
+                tls_splice_reap(tls);
+        }
+        offset += tls->color;
+
+        // record access and bring spilled pages back
+        if ((tls->spill_age > 0 || tls->spilled > 0) && tls_spill_access(tls, offset, length)) {
+                return -1;
+        }
+
+        // unprotect all pages belonging to thread's TLS
+        tls_protect_all(tls, PROT_READ | PROT_WRITE);
+
+        // split shared pages of multi-page writes in one batch - the loop below handles the rest
+        if (length > 0 && offset / dom->page_size != (offset + length - 1) / dom->page_size && tls_cow_span(tls, offset, length)) {
+                tls_protect_all(tls, 0);
+                return -1;
+        }
+
+        // perform write operation
+        unsigned int cnt, idx;
+        for (cnt=0, idx = offset; idx < (offset + length); ++cnt, ++idx) {
+                unsigned int pn = idx / dom->page_size;
+                unsigned int poff = idx % dom->page_size;
+
+
+                //check CoW condition once per page
+                if (idx % dom->page_size == 0 || idx == offset) {
+                        struct page* p = tls->pages[pn];
+                        if (p->flags & PAGE_EAGER) {
+                                // predicted at clone time and written - the prediction was right
+                                __atomic_and_fetch(&p->flags, ~PAGE_EAGER, __ATOMIC_RELAXED); // a failed checkpoint may flag it too
+                                tls_heat_hit(tls, pn);
+                        }
+                        // CoW mechanism
+                        if (__atomic_load_n(&p->ref_count, __ATOMIC_ACQUIRE) > 1) {
+                                // page is shared, create new private copy
+                                struct page* copy = tls_desc_take(tls, 1);
+                                if (copy == NULL) {
+                                        perror("ERROR: Memory allocation for page copy.");
+                                        tls_protect_all(tls, 0); // close what was opened above - sharers rely on the protection
+                                        return -1;
+                                }
+                                void* new_page = page_alloc(dom, PROT_READ | PROT_WRITE);
+                                if (new_page == MAP_FAILED) {
+                                        tls_desc_return(tls, 1);
+                                        perror("ERROR: mmap failed for page copy.");
+                                        tls_protect_all(tls, 0);
+                                        return -1;
+                                }
+                                memcpy(new_page, (void*)p->address, dom->page_size);
+                                copy->address = (uintptr_t)new_page;
+                                copy->ref_count = 1;
+                                copy->open = 1; // mapped read/write - closed with the rest below
+
+                                // swap under domain lock so concurrent clones see either page
+                                pthread_mutex_lock(&dom->lock);
+                                tls->pages[pn] = copy;
+                                pthread_mutex_unlock(&dom->lock);
+
+                                // update original page
+                                tls_protect(dom, p);
+                                page_release(dom, p);
+                                p = copy;
+                                tls->cow_splits++;
+                                counter_add(&tls->counters.cow_copies, 1);
+                                tls_heat_hit(tls, pn);
+                        }
+                }
+                struct page* p = tls->pages[pn];
+                char* dst = ((char*) p->address) + poff;
+                *dst = buffer[cnt];
+        }
+
+        // reprotect all pages belonging to thread's TLS
+        tls_protect_all(tls, 0);
+
+        // wake threads waiting for changes of the written pages
+        if (length > 0 && __atomic_load_n(&tls->watch, __ATOMIC_ACQUIRE) != NULL) {
+                tls_watch_notify(tls, offset, length);
+        }
+
+        // publish written pages - CoW copies and pages whose clones went away
+        tls_fast_span(tls, offset, length);
+
+        // track dirty pages of durable areas and sync by policy
+        if (tls->durable != NULL && length > 0) {
+                struct durable* d = tls->durable;
+                unsigned int pn;
+                for (pn = offset / dom->page_size; pn <= (offset + length - 1) / dom->page_size; pn++) {
+                        d->dirty_num += !d->dirty[pn];
+                        d->dirty[pn] = 1;
+                }
+                int sync = d->sync_pages > 0 && d->dirty_num >= d->sync_pages;
+                if (!sync && d->sync_interval_ms > 0) {
+                        struct timespec now;
+                        clock_gettime(CLOCK_MONOTONIC, &now);
+                        long ms = (now.tv_sec - d->last_sync.tv_sec) * 1000 + (now.tv_nsec - d->last_sync.tv_nsec) / 1000000;
+                        sync = ms >= d->sync_interval_ms;
+                }
+                if (sync && tls_sync_tls(tls)) {
+                        return -1;
+                }
+        }
+
+        // gather pages scattered by CoW splits back into one mapping
+        if (dom->compact_threshold > 0 && tls->cow_splits >= dom->compact_threshold) {
+                tls_compact_tls(tls, NULL);
+        }
+
+        return 0;
+}
+
+// tls_read
+int tls_read_in(tls_domain_t* dom, unsigned int offset, unsigned int length, char *buffer) {
+        // search for current thread's TLS in domain's hash table
+        TLS* tls = tls_find_current(dom);
+
+        // check if current thread has LSA
+        if (tls == NULL) {
+                perror("ERROR: Current thread does not have an LSA.");
+                return -1;
+        }
+
+        // later small accesses may take the inline fast path of tls.h
+        tls_fast_fill(dom, tls);
+
+        // reclaimable and spillable areas are locked against background reclaim
+        __atomic_store_n(&tls->last_access, __atomic_load_n(&pressure_epoch, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+        if (!tls->reclaimable && tls->spill_age == 0) {
+                return tls_read_tls(tls, offset, length, buffer);
+        }
+        pthread_mutex_lock(&tls->lock);
+        int ret = tls_read_tls(tls, offset, length, buffer);
+        pthread_mutex_unlock(&tls->lock);
+        return ret;
+}
+
+// tls_write
+int tls_write_in(tls_domain_t* dom, unsigned int offset, unsigned int length, char* buffer) {
+        // search for current thread's TLS in domain's hash table
+        TLS* tls = tls_find_current(dom);
+
+        // check if current thread has LSA
+        if (tls == NULL) {
+                perror("ERROR: current thread does not have an LSA.");
+                return -1;
+        }
+
+        // later small accesses may take the inline fast path of tls.h
+        tls_fast_fill(dom, tls);
+
+        // reclaimable and spillable areas are locked against background reclaim
+        __atomic_store_n(&tls->last_access, __atomic_load_n(&pressure_epoch, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+        if (!tls->reclaimable && tls->spill_age == 0) {
+                return tls_write_tls(tls, offset, length, buffer);
+        }
+        pthread_mutex_lock(&tls->lock);
+        int ret = tls_write_tls(tls, offset, length, buffer);
+        pthread_mutex_unlock(&tls->lock);
+        return ret;
+}
+
+// clone helper - shares pages overlapping 'ranges' (all pages if NULL), the rest start zeroed
+int tls_clone_tls(tls_domain_t* dom, pthread_t tid, const struct tls_range* ranges, unsigned int range_num) {
+        pthread_t current_thread = pthread_self();
+
+        // clone tls - allocate tls for current thread
+        TLS* new_tls = (TLS*)calloc(1, sizeof(TLS));
+        if (new_tls == NULL) {
+                perror("ERROR: cloning TLS allocation failed.");
+                return -1;
+        }
+
+        pthread_mutex_lock(&dom->lock);
+
+        // check if current thread already has LSA
+        if (hash_table_find(dom, current_thread) != NULL) {
+                pthread_mutex_unlock(&dom->lock);
+                free(new_tls);
+                perror("ERROR: current thread already has LSA.");
+                return -1;
+        }
+
+        // check if target thread has LSA
+        TLS* target_tls = hash_table_find(dom, tid);
+        if (target_tls == NULL) {
+                pthread_mutex_unlock(&dom->lock);
+                free(new_tls);
+                perror("ERROR: target thread does not have LSA.");
+                return -1;
+        }
+
+        // check domain budget
+        unsigned long bytes = (unsigned long)target_tls->page_num * dom->page_size;
+        if (dom->max_bytes > 0 && dom->bytes + bytes > dom->max_bytes) {
+                pthread_mutex_unlock(&dom->lock);
+                free(new_tls);
+                perror("ERROR: Domain budget exceeded.");
+                return -1;
+        }
+
+        pthread_mutex_init(&new_tls->lock, NULL);
+        new_tls->tid = current_thread;
+        new_tls->size = target_tls->size;
+        new_tls->page_num = target_tls->page_num;
+        new_tls->color = target_tls->color; // shared pages keep their layout
+        new_tls->domain = dom;
+        new_tls->ktid = syscall(SYS_gettid);
+        new_tls->pages = (struct page**)calloc(new_tls->page_num, sizeof(struct page*));
+        if (new_tls->pages == NULL) {
+                pthread_mutex_unlock(&dom->lock);
+                free(new_tls);
+                perror("ERROR: cloning TLS allocation failed.");
+                return -1;
+        }
+
+        // mark pages to share with the target - durable pages are copied, never shared
+        int i;
+        unsigned char* shared = NULL;
+        unsigned int fresh_num = 0, spill_num = 0, eager_num = 0, spilling_num = 0;
+        int copy = target_tls->durable != NULL;
+        struct cow_heat* heat = copy ? NULL : heat_clone(target_tls);
+        int predict = heat != NULL && heat->clones > EAGER_MIN_CLONES;
+        if (ranges != NULL || copy || target_tls->spilled > 0 || target_tls->spilling > 0 || predict) {
+                shared = (unsigned char*)calloc(new_tls->page_num, 1);
+                if (shared == NULL) {
+                        pthread_mutex_unlock(&dom->lock);
+                        free(new_tls->pages);
+                        free(new_tls);
+                        perror("ERROR: cloning TLS allocation failed.");
+                        return -1;
+                }
+                unsigned int r;
+                for (r=0; ranges != NULL && r<range_num; r++) {
+                        if (ranges[r].length == 0) {
+                                continue;
+                        }
+                        if (ranges[r].offset + ranges[r].length > target_tls->size || ranges[r].offset + ranges[r].length < ranges[r].offset) {
+                                pthread_mutex_unlock(&dom->lock);
+                                free(shared);
+                                free(new_tls->pages);
+                                free(new_tls);
+                                perror("ERROR: Clone range exceeds TLS size.");
+                                return -1;
+                        }
+                        unsigned int pn;
+                        unsigned int first = (ranges[r].offset + target_tls->color) / dom->page_size;
+                        unsigned int last = (ranges[r].offset + ranges[r].length - 1 + target_tls->color) / dom->page_size;
+                        for (pn = first; pn <= last; pn++) {
+                                shared[pn] = 1;
+                        }
+                }
+                if (ranges == NULL || copy) {
+                        memset(shared, !copy, new_tls->page_num);
+                }
+
+                // spilled pages hold no data in memory - copy them from the spill file instead
+                // pages earlier clones went on to write are copied now, in the same mapping as the fresh ones
+                for (i=0; i<new_tls->page_num; i++) {
+                        if (shared[i] && target_tls->pages[i]->slot) {
+                                shared[i] = 2;
+                                spill_num++;
+                        } else if (shared[i] == 1 && (target_tls->pages[i]->flags & PAGE_DROPPING)) {
+                                shared[i] = 0; // pressure reclaim is zeroing it - start from zeros too
+                        } else if (shared[i] == 1 && (target_tls->pages[i]->flags & PAGE_SPILLING)) {
+                                shared[i] = 4; // a spill pass drops it once written out - copy it while it is intact
+                                spilling_num++;
+                        } else if (shared[i] == 1 && predict && heat_predicts(heat, i)) {
+                                shared[i] = 3;
+                                eager_num++;
+                        }
+                        fresh_num += shared[i] != 1;
+                }
+        }
+
+        // reserve all unshared pages in one mapping - untouched pages cost no memory
+        char* fresh = NULL;
+        struct page* desc = NULL;
+        if (fresh_num > 0) {
+                desc = page_block_alloc(fresh_num);
+                if (desc == NULL) {
+                        pthread_mutex_unlock(&dom->lock);
+                        free(shared);
+                        free(new_tls->pages);
+                        free(new_tls);
+                        perror("ERROR: cloning TLS allocation failed.");
+                        return -1;
+                }
+                int prot = (copy || spill_num > 0 || eager_num + spilling_num > 0 || dom->protection == TLS_PROTECT_NONE) ? PROT_READ | PROT_WRITE : PROT_NONE;
+                fresh = mmap(0, (size_t)fresh_num * dom->page_size, prot, MAP_ANON | MAP_PRIVATE, 0, 0);
+                if (fresh == MAP_FAILED) {
+                        pthread_mutex_unlock(&dom->lock);
+                        free(desc[0].block);
+                        free(shared);
+                        free(new_tls->pages);
+                        free(new_tls);
+                        perror("ERROR: Memory mapping failed.");
+                        return -1;
+                }
+        }
+
+        // note what to copy - the target pages are pinned so the copies can run without domain lock
+        int copying = copy || spill_num > 0 || eager_num + spilling_num > 0;
+        struct page** src = copying ? (struct page**)calloc(new_tls->page_num, sizeof(struct page*)) : NULL;
+        unsigned int* slots = spill_num > 0 ? (unsigned int*)calloc(new_tls->page_num, sizeof(unsigned int)) : NULL;
+        if ((copying && src == NULL) || (spill_num > 0 && slots == NULL)) {
+                pthread_mutex_unlock(&dom->lock);
+                munmap(fresh, (size_t)fresh_num * dom->page_size);
+                free(desc[0].block);
+                free(src);
+                free(slots);
+                free(shared);
+                free(new_tls->pages);
+                free(new_tls);
+                perror("ERROR: cloning TLS allocation failed.");
+                return -1;
+        }
+
+        // share pages, adjust reference counts
+        unsigned int slot = 0;
+        for (i=0; i<new_tls->page_num; i++) {
+                if (shared == NULL || shared[i] == 1) {
+                        new_tls->pages[i] = target_tls->pages[i];
+                        __atomic_add_fetch(&new_tls->pages[i]->ref_count, 1, __ATOMIC_SEQ_CST);
+                        tls_fast_drop(target_tls, i); // its owner must CoW from now on
+                        continue;
+                }
+                struct page* p = &desc[slot];
+                p->address = (uintptr_t)(fresh + (size_t)slot * dom->page_size);
+                p->ref_count = 1;
+                p->flags = shared != NULL && shared[i] == 3 ? PAGE_EAGER : 0;
+                new_tls->pages[i] = p;
+                slot++;
+
+                // durable pages stay mapped while the target has copiers, other pages are held by a reference
+                // until copied - a write of the owner meanwhile copies them on write
+                if (copy) {
+                        src[i] = target_tls->pages[i];
+                } else if (shared[i] >= 3) {
+                        src[i] = target_tls->pages[i];
+                        __atomic_add_fetch(&src[i]->ref_count, 1, __ATOMIC_SEQ_CST);
+                        tls_fast_drop(target_tls, i);
+                } else if (shared[i] == 2) {
+                        slots[i] = target_tls->pages[i]->slot; // kept while the target has copiers
+                }
+        }
+        free(shared);
+
+        // reserve the bytes and copy without domain lock - reads of /proc/self/mem and of the spill file may wait for I/O
+        if (copying) {
+                target_tls->copiers++;
+                dom->bytes += bytes;
+                pthread_mutex_unlock(&dom->lock);
+
+                int mem_fd = dom->protection == TLS_PROTECT_NONE ? -1 : proc_mem();
+                for (i=0; i<new_tls->page_num; i++) {
+                        void* dst = (void*)new_tls->pages[i]->address;
+                        if (src[i] != NULL) {
+                                void* from = (void*)src[i]->address;
+                                if (mem_fd < 0) {
+                                        memcpy(dst, from, dom->page_size);
+                                } else if (pread(mem_fd, dst, dom->page_size, (off_t)(uintptr_t)from) != dom->page_size) {
+                                        perror("ERROR: Could not copy TLS page.");
+                                }
+                        } else if (slots != NULL && slots[i] > 0) {
+                                off_t off = (off_t)(slots[i] - 1) * dom->page_size;
+                                if (pread(dom->spill->fd, dst, dom->page_size, off) != dom->page_size) {
+                                        perror("ERROR: Could not copy spilled page.");
+                                }
+                        }
+                }
+                if (dom->protection == TLS_PROTECT_PAGES) {
+                        mprotect(fresh, (size_t)fresh_num * dom->page_size, PROT_NONE);
+                }
+
+                pthread_mutex_lock(&dom->lock);
+                if (--target_tls->copiers == 0) {
+                        pthread_cond_broadcast(&dom->copied);
+                }
+                dom->bytes -= bytes;
+        }
+
+        // add this thread mapping to domain's hash table
+        int ret = hash_table_insert(dom, current_thread, new_tls);
+        if (ret == 0) {
+                dom->bytes += bytes;
+
+                // writes of this clone teach the template which pages to copy for the next ones
+                if (heat != NULL) {
+                        __atomic_add_fetch(&heat->ref_count, 1, __ATOMIC_RELAXED);
+                        new_tls->template_heat = heat;
+                }
+        }
+        pthread_mutex_unlock(&dom->lock);
+
+        // drop the references held for copying
+        for (i=0; !copy && src != NULL && i<new_tls->page_num; i++) {
+                if (src[i] != NULL) {
+                        page_release(dom, src[i]);
+                }
+        }
+        free(src);
+        free(slots);
+        if (ret) {
+                for (i=0; i<new_tls->page_num; i++) {
+                        page_release(dom, new_tls->pages[i]);
+                }
+                free(new_tls->pages);
+                free(new_tls);
+                return -1;
+        }
+
+        return 0;
+
+}
+
+// wait until no clone copies pages or spill slots of an area anymore - caller holds domain lock
+void tls_copiers_wait(TLS* tls) {
+        while (tls->copiers > 0) {
+                pthread_cond_wait(&tls->domain->copied, &tls->domain->lock);
+        }
+}
+
+// helper function to drop a reference to a write heat
+void heat_release(struct cow_heat* heat) {
+        if (heat != NULL && __atomic_sub_fetch(&heat->ref_count, 1, __ATOMIC_ACQ_REL) == 0) {
+                free(heat->writes);
+                free(heat);
+        }
+}
+
+// release the write heat of a TLS that is going away
+void tls_heat_free(TLS* tls) {
+        heat_release(tls->heat);
+        heat_release(tls->template_heat);
+        tls->heat = tls->template_heat = NULL;
+}
+
+// record that a clone wrote page 'pn' it got from its template
+void tls_heat_hit(TLS* tls, unsigned int pn) {
+        if (tls->template_heat != NULL) {
+                __atomic_add_fetch(&tls->template_heat->writes[pn], 1, __ATOMIC_RELAXED);
+        }
+}
+
+// count a new clone of a template - returns the template's write heat, NULL if it has none - caller holds domain lock
+struct cow_heat* heat_clone(TLS* target) {
+        struct cow_heat* heat = target->heat;
+        if (heat == NULL) {
+                heat = (struct cow_heat*)calloc(1, sizeof(struct cow_heat));
+                if (heat == NULL) {
+                        return NULL; // no prediction, clones still work
+                }
+                heat->writes = (unsigned int*)calloc(target->page_num, sizeof(unsigned int));
+                if (heat->writes == NULL) {
+                        free(heat);
+                        return NULL;
+                }
+                heat->ref_count = 1; // held by the template
+                heat->page_num = target->page_num;
+                target->heat = heat;
+        }
+
+        // old clones count less - templates whose clones change habits are relearned
+        if (heat->clones >= EAGER_DECAY) {
+                unsigned int i;
+                for (i=0; i<heat->page_num; i++) {
+                        __atomic_store_n(&heat->writes[i], __atomic_load_n(&heat->writes[i], __ATOMIC_RELAXED) / 2, __ATOMIC_RELAXED);
+                }
+                heat->clones /= 2;
+        }
+        heat->clones++;
+        return heat;
+}
+
+// helper function to check if clones of a template wrote a page in at least half of the cases
+int heat_predicts(struct cow_heat* heat, unsigned int pn) {
+        return heat != NULL && heat->clones > EAGER_MIN_CLONES && __atomic_load_n(&heat->writes[pn], __ATOMIC_RELAXED) * 2 >= heat->clones - 1;
+}
+
+// tls_clone
+int tls_clone_in(tls_domain_t* dom, pthread_t tid) {
+        return tls_clone_tls(dom, tid, NULL, 0);
+}
+
+// tls_clone_range - share only the pages overlapping 'ranges' with the target
+int tls_clone_range_in(tls_domain_t* dom, pthread_t tid, const struct tls_range* ranges, unsigned int range_num) {
+        if (ranges == NULL && range_num > 0) {
+                perror("ERROR: Invalid clone ranges.");
+                return -1;
+        }
+        static const struct tls_range none = { 0, 0 };
+        return tls_clone_tls(dom, tid, ranges ? ranges : &none, ranges ? range_num : 1);
+}
+
+// helper function to release a splice pin
+void splice_pin_free(tls_domain_t* dom, struct splice_pin* pin) {
+        unsigned int i;
+        for (i=0; i<pin->page_num; i++) {
+                page_release(dom, pin->pages[i]);
+        }
+        free(pin->pages);
+        free(pin);
+}
+
+// release pins whose data has been read from the pipe - returns number of pins left
+int tls_splice_reap(TLS* tls) {
+        struct splice_pin** pin = &tls->pins;
+        int left = 0;
+        while (*pin != NULL) {
+                // bytes spliced into the same pipe after this pin
+                unsigned long newest = (*pin)->written;
+                struct splice_pin* other;
+                for (other = tls->pins; other != NULL; other = other->next) {
+                        if (other->pipe_fd == (*pin)->pipe_fd && other->written > newest) {
+                                newest = other->written;
+                        }
+                }
+
+                // data is consumed once less is unread than what was spliced after it
+                int unread;
+                if (ioctl((*pin)->pipe_fd, FIONREAD, &unread) == 0 && (unsigned long)unread <= newest - (*pin)->written) {
+                        struct splice_pin* temp = *pin;
+                        *pin = temp->next;
+                        splice_pin_free(tls->domain, temp);
+                } else {
+                        left++;
+                        pin = &((*pin)->next);
+                }
+        }
+        return left;
+}
+
+// release all pins of a TLS that is going away
+void tls_splice_free(TLS* tls) {
+        tls_splice_reap(tls);
+        while (tls->pins != NULL) {
+                // pipe still references these pages - unmap instead of recycling them
+                struct splice_pin* pin = tls->pins;
+                unsigned int i;
+                for (i=0; i<pin->page_num; i++) {
+                        pin->pages[i]->flags |= PAGE_NO_RECYCLE;
+                }
+                tls->pins = pin->next;
+                splice_pin_free(tls->domain, pin);
+        }
+}
+
+// tls_splice_to_pipe - zero-copy transfer of a TLS range into a pipe
+int tls_splice_to_pipe_in(tls_domain_t* dom, int pipe_fd, unsigned int offset, unsigned int length) {
+        // search for current thread's TLS in domain's hash table
+        TLS* tls = tls_find_current(dom);
+
+        // check if current thread has LSA
+        if (tls == NULL) {
+                perror("ERROR: current thread does not have an LSA.");
+                return -1;
+        }
+
+        // check if offset+length is within TLS size
+        if (offset + length > tls->size) {
+                perror("ERROR: Requested splice exceeds TLS size.");
+                return -1;
+        }
+
+        // a pinned durable page would be copied off its file by the next write
+        if (tls->durable != NULL) {
+                perror("ERROR: Cannot splice a durable TLS.");
+                return -1;
+        }
+        if (length == 0) {
+                return 0;
+        }
+
+        tls_splice_reap(tls);
+
+        // pin spanned pages first - any later tls_write to them copies on write
+        offset += tls->color;
+        unsigned int first = offset / dom->page_size;
+        unsigned int last = (offset + length - 1) / dom->page_size;
+        struct splice_pin* pin = (struct splice_pin*)calloc(1, sizeof(struct splice_pin));
+        struct iovec* iov = (struct iovec*)calloc(last - first + 1, sizeof(struct iovec));
+        if (pin == NULL || iov == NULL) {
+                free(pin);
+                free(iov);
+                perror("ERROR: splice pin allocation failed.");
+                return -1;
+        }
+        pin->pages = (struct page**)calloc(last - first + 1, sizeof(struct page*));
+        if (pin->pages == NULL) {
+                free(pin);
+                free(iov);
+                perror("ERROR: splice pin allocation failed.");
+                return -1;
+        }
+
+        // bring spilled pages back - locked so no spill pass runs before they are pinned
+        pthread_mutex_lock(&tls->lock);
+        if (tls->spilled > 0 && tls_spill_load(tls, first, last)) {
+                pthread_mutex_unlock(&tls->lock);
+                free(pin->pages);
+                free(pin);
+                free(iov);
+                return -1;
+        }
+        unsigned int i;
+        for (i=first; i<=last; i++) {
+                struct page* p = tls->pages[i];
+                __atomic_add_fetch(&p->ref_count, 1, __ATOMIC_RELAXED);
+                pin->pages[pin->page_num++] = p;
+                tls_fast_drop(tls, i);
+
+                // vmsplice needs readable pages
+                tls_unprotect(dom, p);
+
+                unsigned int start = (i == first) ? offset % dom->page_size : 0;
+                unsigned int end = (i == last) ? (offset + length - 1) % dom->page_size + 1 : dom->page_size;
+                iov[i - first].iov_base = (char*)p->address + start;
+                iov[i - first].iov_len = end - start;
+        }
+        pthread_mutex_unlock(&tls->lock);
+
+        // splice all pieces - pages are referenced by the pipe, not copied
+        unsigned long done = 0;
+        struct iovec* cur = iov;
+        unsigned int cur_num = last - first + 1;
+        while (done < length) {
+                ssize_t n = vmsplice(pipe_fd, cur, cur_num > IOV_MAX ? IOV_MAX : cur_num, 0);
+                if (n < 0) {
+                        break;
+                }
+                done += n;
+                while (n > 0 && (size_t)n >= cur->iov_len) {
+                        n -= cur->iov_len;
+                        cur++;
+                        cur_num--;
+                }
+                if (n > 0) {
+                        cur->iov_base = (char*)cur->iov_base + n;
+                        cur->iov_len -= n;
+                }
+        }
+        free(iov);
+
+        for (i=0; i<pin->page_num; i++) {
+                tls_protect(dom, pin->pages[i]);
+        }
+
+        if (done == 0) {
+                splice_pin_free(dom, pin);
+                perror("ERROR: vmsplice failed.");
+                return -1;
+        }
+
+        // record pipe position after this splice
+        unsigned long newest = 0;
+        struct splice_pin* other;
+        for (other = tls->pins; other != NULL; other = other->next) {
+                if (other->pipe_fd == pipe_fd && other->written > newest) {
+                        newest = other->written;
+                }
+        }
+        pin->pipe_fd = pipe_fd;
+        pin->written = newest + done;
+        pin->next = tls->pins;
+        tls->pins = pin;
+
+        if (done < length) {
+                perror("ERROR: vmsplice failed.");
+                return -1;
+        }
+        return 0;
+}
+
+// release pins of data the pipe readers consumed - returns number of pins still held
+int tls_splice_release_in(tls_domain_t* dom) {
+        TLS* tls = tls_find_current(dom);
+        if (tls == NULL) {
+                perror("ERROR: current thread does not have an LSA.");
+                return -1;
+        }
+        return tls_splice_reap(tls);
+}
+
+// define checkpoint - CoW snapshot of a TLS being written to a file in the background
+struct checkpoint {
+        tls_domain_t* dom;
+        int fd;
+        unsigned int page_num;
+        unsigned int color; // bytes of the first page before offset 0 - not written
+        struct page** pages; // snapshot - holds a reference on every page
+        void (*callback)(int, void*);
+        void* arg;
+#ifdef TLS_HAVE_IO_URING
+        int ring_fd; // -1 when writing through the thread fallback
+        struct io_uring_params params;
+        void* sq_ring;
+        size_t sq_ring_size;
+        void* cq_ring;
+        size_t cq_ring_size;
+        struct io_uring_sqe* sqes;
+#endif
+};
+
+// helper function to finish a checkpoint - drop snapshot and report status
+void checkpoint_finish(struct checkpoint* cp, int status) {
+        unsigned int i;
+        for (i=0; i<cp->page_num; i++) {
+                page_release(cp->dom, cp->pages[i]);
+        }
+        free(cp->pages);
+        if (cp->callback != NULL) {
+                cp->callback(status, cp->arg);
+        }
+        free(cp);
+}
+
+// fallback worker - copies snapshot pages to the file from a plain thread
+void* checkpoint_thread_worker(void* arg) {
+        struct checkpoint* cp = (struct checkpoint*)arg;
+        unsigned int ps = cp->dom->page_size;
+        int status = 0;
+
+        // protected pages can only be read through /proc/self/mem
+        int mem_fd = -1;
+        char* bounce = NULL;
+        if (cp->dom->protection == TLS_PROTECT_PAGES) {
+                mem_fd = proc_mem();
+                bounce = (char*)malloc(ps);
+                if (mem_fd < 0 || bounce == NULL) {
+                        status = -1;
+                }
+        }
+
+        unsigned int i;
+        for (i=0; i<cp->page_num && status == 0; i++) {
+                char* src = (char*)cp->pages[i]->address;
+                if (mem_fd >= 0) {
+                        if (pread(mem_fd, bounce, ps, (off_t)cp->pages[i]->address) != ps) {
+                                status = -1;
+                                break;
+                        }
+                        src = bounce;
+                }
+                unsigned int skip = i == 0 ? cp->color : 0;
+                if (pwrite(cp->fd, src + skip, ps - skip, (off_t)i * ps - cp->color + skip) != ps - skip) {
+                        status = -1;
+                }
+        }
+
+        free(bounce);
+        checkpoint_finish(cp, status);
+        return NULL;
+}
+
+#ifdef TLS_HAVE_IO_URING
+// helper function to tear down the io_uring of a checkpoint - closing the ring does not wait for
+// requests in flight, so the caller reaps them first
+void checkpoint_uring_close(struct checkpoint* cp) {
+        if (cp->sqes != NULL) {
+                munmap(cp->sqes, cp->params.sq_entries * sizeof(struct io_uring_sqe));
+        }
+        if (cp->cq_ring != NULL && cp->cq_ring != cp->sq_ring) {
+                munmap(cp->cq_ring, cp->cq_ring_size);
+        }
+        if (cp->sq_ring != NULL) {
+                munmap(cp->sq_ring, cp->sq_ring_size);
+        }
+        close(cp->ring_fd);
+        cp->ring_fd = -1;
+        cp->sq_ring = cp->cq_ring = NULL;
+        cp->sqes = NULL;
+}
+
+// set up an io_uring and register the snapshot pages as fixed buffers - called by the owner
+int checkpoint_uring_setup(struct checkpoint* cp) {
+        cp->ring_fd = -1;
+        cp->sq_ring = cp->cq_ring = NULL;
+        cp->sqes = NULL;
+        if (cp->page_num > CHECKPOINT_MAX_BUFFERS) {
+                return -1;
+        }
+
+        memset(&cp->params, 0, sizeof(cp->params));
+        cp->ring_fd = syscall(__NR_io_uring_setup, CHECKPOINT_RING, &cp->params);
+        if (cp->ring_fd < 0) {
+                return -1; // no io_uring in this kernel or sandbox
+        }
+
+        // map submission and completion rings
+        struct io_uring_params* pr = &cp->params;
+        cp->sq_ring_size = pr->sq_off.array + pr->sq_entries * sizeof(unsigned);
+        cp->cq_ring_size = pr->cq_off.cqes + pr->cq_entries * sizeof(struct io_uring_cqe);
+        if (pr->features & IORING_FEAT_SINGLE_MMAP) {
+                if (cp->cq_ring_size > cp->sq_ring_size) {
+                        cp->sq_ring_size = cp->cq_ring_size;
+                }
+                cp->cq_ring_size = cp->sq_ring_size;
+        }
+        cp->sq_ring = mmap(0, cp->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, cp->ring_fd, IORING_OFF_SQ_RING);
+        if (cp->sq_ring == MAP_FAILED) {
+                cp->sq_ring = NULL;
+                checkpoint_uring_close(cp);
+                return -1;
+        }
+        if (pr->features & IORING_FEAT_SINGLE_MMAP) {
+                cp->cq_ring = cp->sq_ring;
+        } else {
+                cp->cq_ring = mmap(0, cp->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, cp->ring_fd, IORING_OFF_CQ_RING);
+                if (cp->cq_ring == MAP_FAILED) {
+                        cp->cq_ring = NULL;
+                        checkpoint_uring_close(cp);
+                        return -1;
+                }
+        }
+        cp->sqes = mmap(0, pr->sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, cp->ring_fd, IORING_OFF_SQES);
+        if (cp->sqes == MAP_FAILED) {
+                cp->sqes = NULL;
+                checkpoint_uring_close(cp);
+                return -1;
+        }
+
+        // register pages - the kernel pins them, so they need not stay accessible afterwards
+        struct iovec* iov = (struct iovec*)calloc(cp->page_num, sizeof(struct iovec));
+        if (iov == NULL) {
+                checkpoint_uring_close(cp);
+                return -1;
+        }
+        unsigned int i;
+        for (i=0; i<cp->page_num; i++) {
+                iov[i].iov_base = (void*)cp->pages[i]->address;
+                iov[i].iov_len = cp->dom->page_size;
+                tls_unprotect(cp->dom, cp->pages[i]);
+        }
+        int ret = syscall(__NR_io_uring_register, cp->ring_fd, IORING_REGISTER_BUFFERS, iov, cp->page_num);
+        for (i=0; i<cp->page_num; i++) {
+                tls_protect(cp->dom, cp->pages[i]);
+        }
+        free(iov);
+        if (ret < 0) {
+                checkpoint_uring_close(cp); // e.g. RLIMIT_MEMLOCK too low
+                return -1;
+        }
+
+        return 0;
+}
+
+// io_uring worker - keeps the ring full of fixed-buffer page writes and reaps completions
+void* checkpoint_uring_worker(void* arg) {
+        struct checkpoint* cp = (struct checkpoint*)arg;
+        struct io_uring_params* pr = &cp->params;
+        char* sq = (char*)cp->sq_ring;
+        char* cq = (char*)cp->cq_ring;
+        unsigned* sq_head = (unsigned*)(sq + pr->sq_off.head);
+        unsigned* sq_tail = (unsigned*)(sq + pr->sq_off.tail);
+        unsigned sq_mask = *(unsigned*)(sq + pr->sq_off.ring_mask);
+        unsigned* sq_array = (unsigned*)(sq + pr->sq_off.array);
+        unsigned* cq_head = (unsigned*)(cq + pr->cq_off.head);
+        unsigned* cq_tail = (unsigned*)(cq + pr->cq_off.tail);
+        unsigned cq_mask = *(unsigned*)(cq + pr->cq_off.ring_mask);
+        struct io_uring_cqe* cqes = (struct io_uring_cqe*)(cq + pr->cq_off.cqes);
+        unsigned int ps = cp->dom->page_size;
+        unsigned int next = 0, inflight = 0, i;
+        int status = 0;
+
+        // writes queued but not yet consumed by the kernel count as pending until a later submit takes them
+        while ((status == 0 && (next < cp->page_num || *sq_tail != __atomic_load_n(sq_head, __ATOMIC_ACQUIRE))) || inflight > 0) {
+                // queue page-aligned writes while there is room
+                unsigned tail = *sq_tail;
+                unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+                while (status == 0 && next < cp->page_num && inflight + (tail - head) < pr->cq_entries && tail - head < pr->sq_entries) {
+                        unsigned idx = tail & sq_mask;
+                        struct io_uring_sqe* sqe = &cp->sqes[idx];
+                        memset(sqe, 0, sizeof(*sqe));
+                        sqe->opcode = IORING_OP_WRITE_FIXED;
+                        sqe->fd = cp->fd;
+                        unsigned int skip = next == 0 ? cp->color : 0;
+                        sqe->off = (unsigned long long)next * ps - cp->color + skip;
+                        sqe->addr = cp->pages[next]->address + skip;
+                        sqe->len = ps - skip;
+                        sqe->buf_index = next;
+                        sqe->user_data = next;
+                        sq_array[idx] = idx;
+                        tail++;
+                        next++;
+                }
+                __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+
+                // submit everything the kernel has not consumed yet and wait for at least one completion
+                // after an error nothing more is submitted - the writes in flight still read the pages and are waited for
+                unsigned submit = status == 0 ? tail - head : 0;
+                int ret = syscall(__NR_io_uring_enter, cp->ring_fd, submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+                if (ret < 0) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        status = -1;
+                        if (submit == 0) {
+                                // cannot even wait - keep the pages out of the pool, it would zero them under the kernel
+                                for (i=0; i<cp->page_num; i++) {
+                                        __atomic_or_fetch(&cp->pages[i]->flags, PAGE_NO_RECYCLE, __ATOMIC_RELAXED);
+                                }
+                                break;
+                        }
+                        continue;
+                }
+                inflight += ret;
+
+                // reap completions
+                unsigned chead = *cq_head;
+                while (chead != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+                        struct io_uring_cqe* cqe = &cqes[chead & cq_mask];
+                        if (cqe->res != (int)(ps - (cqe->user_data == 0 ? cp->color : 0))) {
+                                status = -1;
+                        }
+                        chead++;
+                        inflight--;
+                }
+                __atomic_store_n(cq_head, chead, __ATOMIC_RELEASE);
+        }
+
+        checkpoint_uring_close(cp);
+        checkpoint_finish(cp, status);
+        return NULL;
+}
+#endif
+
+// tls_checkpoint_async - write a snapshot of the TLS to fd in the background
+int tls_checkpoint_async_in(tls_domain_t* dom, int fd, void (*callback)(int, void*), void* arg) {
+        // search for current thread's TLS in domain's hash table
+        TLS* tls = tls_find_current(dom);
+
+        // check if current thread has LSA
+        if (tls == NULL) {
+                perror("ERROR: current thread does not have an LSA.");
+                return -1;
+        }
+
+        // durable areas persist through tls_sync instead
+        if (tls->durable != NULL) {
+                perror("ERROR: Cannot checkpoint a durable TLS.");
+                return -1;
+        }
+
+        struct checkpoint* cp = (struct checkpoint*)calloc(1, sizeof(struct checkpoint));
+        if (cp == NULL) {
+                perror("ERROR: checkpoint allocation failed.");
+                return -1;
+        }
+        cp->pages = (struct page**)calloc(tls->page_num, sizeof(struct page*));
+        if (cp->pages == NULL) {
+                free(cp);
+                perror("ERROR: checkpoint allocation failed.");
+                return -1;
+        }
+        cp->dom = dom;
+        cp->fd = fd;
+        cp->callback = callback;
+        cp->arg = arg;
+
+        // take snapshot - shared pages are copied on the owner's next write, spilled pages are brought back first
+        pthread_mutex_lock(&tls->lock);
+        if (tls->spilled > 0 && tls_spill_load(tls, 0, tls->page_num - 1)) {
+                pthread_mutex_unlock(&tls->lock);
+                free(cp->pages);
+                free(cp);
+                return -1;
+        }
+        unsigned int i;
+        for (i=0; i<tls->page_num; i++) {
+                cp->pages[i] = tls->pages[i];
+                __atomic_add_fetch(&cp->pages[i]->ref_count, 1, __ATOMIC_RELAXED);
+                tls_fast_drop(tls, i);
+        }
+        pthread_mutex_unlock(&tls->lock);
+        cp->page_num = tls->page_num;
+        cp->color = tls->color;
+
+        // prefer io_uring, fall back to a plain thread
+        void* (*worker)(void*) = checkpoint_thread_worker;
+#ifdef TLS_HAVE_IO_URING
+        if (checkpoint_uring_setup(cp) == 0) {
+                worker = checkpoint_uring_worker;
+        }
+#endif
+
+        pthread_t thread;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        int ret = pthread_create(&thread, &attr, worker, cp);
+        pthread_attr_destroy(&attr);
+        if (ret) {
+#ifdef TLS_HAVE_IO_URING
+                if (cp->ring_fd >= 0) {
+                        checkpoint_uring_close(cp);
+                }
+#endif
+                cp->callback = NULL;
+                checkpoint_finish(cp, -1);
+                perror("ERROR: Could not start checkpoint writer.");
+                return -1;
+        }
+
+        return 0;
+}
+
+// helper function to sort addresses
+int cmp_address(const void* a, const void* b) {
+        uintptr_t x = *(const uintptr_t*)a;
+        uintptr_t y = *(const uintptr_t*)b;
+        return (x > y) - (x < y);
+}
+
+// count mappings in /proc/self/maps that hold pages of a TLS
+unsigned int tls_count_vmas(TLS* tls) {
+        uintptr_t* addr = (uintptr_t*)malloc(tls->page_num * sizeof(uintptr_t));
+        if (addr == NULL) {
+                return 0;
+        }
+        unsigned int i;
+        for (i=0; i<tls->page_num; i++) {
+                addr[i] = tls->pages[i]->address;
+        }
+        qsort(addr, tls->page_num, sizeof(uintptr_t), cmp_address);
+
+        FILE* maps = fopen("/proc/self/maps", "r");
+        if (maps == NULL) {
+                free(addr);
+                return 0;
+        }
+        unsigned int count = 0;
+        char* line = NULL;
+        size_t line_size = 0;
+        while (getline(&line, &line_size, maps) > 0) {
+                unsigned long start, end;
+                if (sscanf(line, "%lx-%lx", &start, &end) != 2) {
+                        continue;
+                }
+                // find first page at or above start
+                unsigned int lo = 0, hi = tls->page_num;
+                while (lo < hi) {
+                        unsigned int mid = (lo + hi) / 2;
+                        if (addr[mid] < start) {
+                                lo = mid + 1;
+                        } else {
+                                hi = mid;
+                        }
+                }
+                if (lo < tls->page_num && addr[lo] < end) {
+                        count++;
+                }
+        }
+        free(line);
+        fclose(maps);
+        free(addr);
+        return count;
+}
+
+// helper function to check if a page holds only zeros
+int page_is_zero(const void* address, unsigned int size) {
+        const uint64_t* w = (const uint64_t*)address;
+        unsigned int i;
+        for (i=0; i<size / sizeof(uint64_t); i++) {
+                if (w[i] != 0) {
+                        return 0;
+                }
+        }
+        return 1;
+}
+
+// move private pages of a TLS into one contiguous mapping
+int tls_compact_tls(TLS* tls, struct tls_compact_stats* stats) {
+        tls_domain_t* dom = tls->domain;
+        unsigned int ps = dom->page_size;
+        unsigned int i;
+
+        if (stats != NULL) {
+                memset(stats, 0, sizeof(*stats));
+                stats->vmas_before = tls_count_vmas(tls);
+        }
+        tls->cow_splits = 0;
+
+        // durable pages must stay on their file - the mapping is contiguous already
+        if (tls->durable != NULL) {
+                if (stats != NULL) {
+                        stats->vmas_after = stats->vmas_before;
+                }
+                return 0;
+        }
+
+        // hold domain lock - no clone may start sharing a page while it moves
+        pthread_mutex_lock(&dom->lock);
+
+        // count private pages and check if they already form one run
+        unsigned int private_num = 0, runs = 0;
+        uintptr_t next = 0;
+        for (i=0; i<tls->page_num; i++) {
+                struct page* p = tls->pages[i];
+                if (__atomic_load_n(&p->ref_count, __ATOMIC_ACQUIRE) != 1) {
+                        continue;
+                }
+                if (private_num == 0 || p->address != next) {
+                        runs++;
+                }
+                next = p->address + ps;
+                private_num++;
+        }
+        if (runs <= 1) {
+                pthread_mutex_unlock(&dom->lock);
+                if (stats != NULL) {
+                        stats->vmas_after = stats->vmas_before;
+                }
+                return 0;
+        }
+
+        char* region = mmap(0, (size_t)private_num * ps, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, 0, 0);
+        if (region == MAP_FAILED) {
+                pthread_mutex_unlock(&dom->lock);
+                perror("ERROR: mmap failed for compaction.");
+                return -1;
+        }
+
+        // copy pages in index order - zero pages are skipped so they stay unfaulted
+        unsigned int slot = 0;
+        for (i=0; i<tls->page_num; i++) {
+                struct page* p = tls->pages[i];
+                if (__atomic_load_n(&p->ref_count, __ATOMIC_ACQUIRE) != 1) {
+                        continue;
+                }
+                char* dst = region + (size_t)slot * ps;
+                tls_unprotect(dom, p);
+                if (!page_is_zero((void*)p->address, ps)) {
+                        memcpy(dst, (void*)p->address, ps);
+                }
+                page_free(dom, (void*)p->address);
+                p->address = (uintptr_t)dst;
+                p->open = 0; // region is protected in one piece below
+                tls_fast_page(tls, i);
+                slot++;
+        }
+        pthread_mutex_unlock(&dom->lock);
+
+        // one mapping, one protection change
+        if (dom->protection == TLS_PROTECT_PAGES && mprotect(region, (size_t)private_num * ps, 0)) {
+                fprintf(stderr, "tls_compact: could not protect pages\n");
+                exit(1);
+        }
+
+        if (stats != NULL) {
+                stats->pages_moved = private_num;
+                stats->vmas_after = tls_count_vmas(tls);
+        }
+        return 0;
+}
+
+// tls_compact
+int tls_compact_in(tls_domain_t* dom, struct tls_compact_stats* stats) {
+        TLS* tls = tls_find_current(dom);
+        if (tls == NULL) {
+                perror("ERROR: current thread does not have an LSA.");
+                return -1;
+        }
+        if (tls->frozen) {
+                perror("ERROR: TLS is frozen.");
+                return -1;
+        }
+
+        // reclaimable and spillable areas are locked against background reclaim
+        if (!tls->reclaimable && tls->spill_age == 0) {
+                return tls_compact_tls(tls, stats);
+        }
+        pthread_mutex_lock(&tls->lock);
+        int ret = tls_compact_tls(tls, stats);
+        pthread_mutex_unlock(&tls->lock);
+        return ret;
+}
+
+// set number of CoW splits after which tls_write compacts automatically (0 = never)
+void tls_compact_threshold_in(tls_domain_t* dom, unsigned int splits) {
+        __atomic_store_n(&dom->compact_threshold, splits, __ATOMIC_RELAXED);
+}
+
+
+// read from a frozen TLS - one copy or pread per run of adjacent pages
+int tls_frozen_read(TLS* tls, unsigned int offset, unsigned int length, char* buffer) {
+        unsigned int ps = tls->domain->page_size;
+        int readable = (tls->frozen - 1) & TLS_FREEZE_READABLE;
+        if (tls->domain->protection == TLS_PROTECT_NONE) {
+                readable = 1;
+        }
+
+        int mem_fd = readable ? -1 : proc_mem();
+        if (!readable && mem_fd < 0) {
+                return -1;
+        }
+
+        offset += tls->color;
+        while (length > 0) {
+                unsigned int pn = offset / ps;
+                unsigned int poff = offset % ps;
+                uintptr_t src = tls->pages[pn]->address + poff;
+
+                // extend over following pages that are adjacent in memory
+                unsigned int n = ps - poff;
+                while (n < length && tls->pages[pn + 1]->address == tls->pages[pn]->address + ps) {
+                        pn++;
+                        n += ps;
+                }
+                if (n > length) {
+                        n = length;
+                }
+
+                if (readable) {
+                        memcpy(buffer, (void*)src, n);
+                } else if (pread(mem_fd, buffer, n, (off_t)src) != n) {
+                        perror("ERROR: Could not read frozen TLS.");
+                        return -1;
+                }
+                buffer += n;
+                offset += n;
+                length -= n;
+        }
+        return 0;
+}
+
+// tls_freeze - make the current thread's TLS permanently read-only and readable by any thread
+int tls_freeze_in(tls_domain_t* dom, int flags) {
+        TLS* tls = tls_find_current(dom);
+        if (tls == NULL) {
+                perror("ERROR: current thread does not have an LSA.");
+                return -1;
+        }
+        if (tls->frozen) {
+                perror("ERROR: TLS is already frozen.");
+                return -1;
+        }
+
+        struct frozen_entry* entry = (struct frozen_entry*)malloc(sizeof(struct frozen_entry));
+        if (entry == NULL) {
+                perror("ERROR: Failed to allocate memory for frozen entry.");
+                return -1;
+        }
+
+        // stop spilling and bring spilled pages back - frozen areas are read in place
+        pthread_mutex_lock(&tls->lock);
+        tls->spill_age = 0;
+        pthread_mutex_unlock(&tls->lock);
+        if (tls->spilled > 0 && tls_spill_load(tls, 0, tls->page_num - 1)) {
+                free(entry);
+                return -1;
+        }
+
+        // gather private pages first - frozen pages never move again
+        tls_compact_tls(tls, NULL);
+        tls_splice_reap(tls);
+
+        if (flags & TLS_FREEZE_READABLE) {
+                unsigned int i;
+                for (i=0; i<tls->page_num; i++) {
+                        tls->pages[i]->flags |= PAGE_READABLE;
+                        tls_unprotect(dom, tls->pages[i]);
+                        tls_protect(dom, tls->pages[i]); // pages still open for a sharer get PROT_READ on its close
+                }
+        }
+        tls->frozen = flags + 1;
+        tls_fast_update(tls);
+
+        // publish - readers see a complete entry or none
+        int hash_index = tls->tid % HASH_SIZE;
+        entry->tid = tls->tid;
+        entry->tls = tls;
+        entry->next = __atomic_load_n(&dom->frozen[hash_index], __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&dom->frozen[hash_index], &entry->next, entry, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        }
+
+        return 0;
+}
+
+// tls_read_from - read a frozen TLS of another thread without locking
+int tls_read_from_in(tls_domain_t* dom, pthread_t tid, unsigned int offset, unsigned int length, char* buffer) {
+        struct frozen_entry* entry = __atomic_load_n(&dom->frozen[tid % HASH_SIZE], __ATOMIC_ACQUIRE);
+        while (entry != NULL && !pthread_equal(entry->tid, tid)) {
+                entry = entry->next;
+        }
+
+        // check if target thread has a frozen LSA
+        if (entry == NULL) {
+                perror("ERROR: target thread does not have a frozen LSA.");
+                return -1;
+        }
+
+        // check if offset+length is within TLS size
+        if (offset + length > entry->tls->size) {
+                perror("ERROR: Requested read exceeds TLS size.");
+                return -1;
+        }
+
+        return tls_frozen_read(entry->tls, offset, length, buffer);
+}
+
+// helper function to get the futex bits of pages 'first' to 'last' - page pn wakes bit pn % 32
+unsigned int watch_mask(unsigned int first, unsigned int last) {
+        if (last - first >= 31) {
+                return FUTEX_BITSET_MATCH_ANY;
+        }
+        unsigned int mask = 0, pn;
+        for (pn = first; pn <= last; pn++) {
+                mask |= 1u << (pn % 32);
+        }
+        return mask;
+}
+
+// helper function to sum the generations of pages 'first' to 'last' - changes whenever one of them is written
+unsigned long watch_sum(struct watch* w, unsigned int first, unsigned int last) {
+        unsigned long sum = 0;
+        unsigned int pn;
+        for (pn = first; pn <= last; pn++) {
+                sum += __atomic_load_n(&w->gens[pn], __ATOMIC_ACQUIRE);
+        }
+        return sum;
+}
+
+// helper function to drop a reference to a watch
+void watch_put(struct watch* w) {
+        if (__atomic_sub_fetch(&w->ref_count, 1, __ATOMIC_ACQ_REL) == 0) {
+                free(w);
+        }
+}
+
+// advance the generations of the pages a write touched and wake the threads waiting on them - caller owns the TLS
+void tls_watch_notify(TLS* tls, unsigned int offset, unsigned int length) {
+        struct watch* w = __atomic_load_n(&tls->watch, __ATOMIC_ACQUIRE);
+        unsigned int first = offset / tls->domain->page_size;
+        unsigned int last = (offset + length - 1) / tls->domain->page_size;
+        unsigned int pn;
+        for (pn = first; pn <= last; pn++) {
+                __atomic_store_n(&w->gens[pn], w->gens[pn] + 1, __ATOMIC_RELEASE); // owner is the only writer
+        }
+        // waiters count themselves before they read seq - either they see the new seq or we see them
+        __atomic_add_fetch(&w->seq, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&w->waiters, __ATOMIC_SEQ_CST) > 0) {
+                syscall(SYS_futex, &w->seq, FUTEX_WAKE_BITSET | FUTEX_PRIVATE_FLAG, INT_MAX, NULL, NULL, watch_mask(first, last));
+        }
+}
+
+// detach the watch of a TLS that goes away - its waiters wake up and fail; caller holds domain lock
+void tls_watch_close(TLS* tls) {
+        struct watch* w = tls->watch;
+        if (w == NULL) {
+                return;
+        }
+        __atomic_store_n(&tls->watch, NULL, __ATOMIC_RELEASE);
+        __atomic_store_n(&w->closed, 1, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&w->seq, 1, __ATOMIC_SEQ_CST);
+        syscall(SYS_futex, &w->seq, FUTEX_WAKE | FUTEX_PRIVATE_FLAG, INT_MAX, NULL, NULL, 0);
+        watch_put(w);
+}
+
+// tls_wait_change - sleep until thread 'tid' writes to [offset, offset + length) of its TLS
+// returns 0 on a change, 1 when 'timeout_ms' passed first (negative waits forever) and -1 on errors or when the area is destroyed
+int tls_wait_change_in(tls_domain_t* dom, pthread_t tid, unsigned int offset, unsigned int length, int timeout_ms) {
+        // the owner would only wake itself by writing
+        if (pthread_equal(tid, pthread_self())) {
+                perror("ERROR: Thread cannot wait for changes of its own LSA.");
+                return -1;
+        }
+        struct timespec deadline;
+        if (timeout_ms >= 0) {
+                clock_gettime(CLOCK_MONOTONIC, &deadline);
+                deadline.tv_sec += timeout_ms / 1000;
+                deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+                if (deadline.tv_nsec >= 1000000000) {
+                        deadline.tv_sec++;
+                        deadline.tv_nsec -= 1000000000;
+                }
+        }
+
+        pthread_mutex_lock(&dom->lock);
+        TLS* tls = hash_table_find(dom, tid);
+
+        // check if target thread has LSA
+        if (tls == NULL) {
+                pthread_mutex_unlock(&dom->lock);
+                perror("ERROR: target thread does not have an LSA.");
+                return -1;
+        }
+
+        // check if offset+length is within TLS size
+        if (length == 0 || offset + length > tls->size || offset + length < offset) {
+                pthread_mutex_unlock(&dom->lock);
+                perror("ERROR: Requested range exceeds TLS size.");
+                return -1;
+        }
+
+        // first waiter sets up the generations - from then on writes leave the inline fast path, which does not advance them
+        struct watch* w = tls->watch;
+        if (w == NULL) {
+                w = (struct watch*)calloc(1, sizeof(struct watch) + tls->page_num * sizeof(unsigned int));
+                if (w == NULL) {
+                        pthread_mutex_unlock(&dom->lock);
+                        perror("ERROR: Watch allocation failed.");
+                        return -1;
+                }
+                w->ref_count = 1;
+                w->page_num = tls->page_num;
+                __atomic_store_n(&tls->watch, w, __ATOMIC_SEQ_CST);
+                __atomic_store_n(&tls->fast.pages, NULL, __ATOMIC_SEQ_CST);
+        }
+        __atomic_add_fetch(&w->ref_count, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&w->waiters, 1, __ATOMIC_SEQ_CST);
+        unsigned int first = (offset + tls->color) / dom->page_size;
+        unsigned int last = (offset + tls->color + length - 1) / dom->page_size;
+        pthread_mutex_unlock(&dom->lock);
+
+        // sleep on seq with the bits of the watched pages - writes to other pages mostly leave us asleep
+        unsigned long base = watch_sum(w, first, last);
+        unsigned int mask = watch_mask(first, last);
+        int ret;
+        while (1) {
+                unsigned int seq = __atomic_load_n(&w->seq, __ATOMIC_SEQ_CST);
+                if (__atomic_load_n(&w->closed, __ATOMIC_SEQ_CST)) {
+                        perror("ERROR: target thread destroyed its LSA.");
+                        ret = -1;
+                        break;
+                }
+                if (watch_sum(w, first, last) != base) {
+                        ret = 0;
+                        break;
+                }
+                if (syscall(SYS_futex, &w->seq, FUTEX_WAIT_BITSET | FUTEX_PRIVATE_FLAG, seq,
+                            timeout_ms >= 0 ? &deadline : NULL, NULL, mask) == -1 && errno == ETIMEDOUT) {
+                        ret = watch_sum(w, first, last) != base ? 0 : 1;
+                        break;
+                }
+        }
+        __atomic_sub_fetch(&w->waiters, 1, __ATOMIC_SEQ_CST);
+        watch_put(w);
+        return ret;
+}
+
+// helper function to set up file backing of a new TLS - pages map the file in one piece
+int tls_durable_map(TLS* tls, const char* path) {
+        tls_domain_t* dom = tls->domain;
+        size_t bytes = (size_t)tls->page_num * dom->page_size;
+
+        struct durable* d = (struct durable*)calloc(1, sizeof(struct durable));
+        if (d == NULL) {
+                perror("ERROR: Durable state allocation failed.");
+                return -1;
+        }
+        d->dirty = (unsigned char*)calloc(tls->page_num, 1);
+        if (d->dirty == NULL) {
+                free(d);
+                perror("ERROR: Durable state allocation failed.");
+                return -1;
+        }
+
+        // existing contents of the file are the recovered state
+        d->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        if (d->fd < 0) {
+                free(d->dirty);
+                free(d);
+                perror("ERROR: Could not open durable file.");
+                return -1;
+        }
+        struct stat st;
+        if (fstat(d->fd, &st) || ((size_t)st.st_size < bytes && ftruncate(d->fd, bytes))) {
+                close(d->fd);
+                free(d->dirty);
+                free(d);
+                perror("ERROR: Could not size durable file.");
+                return -1;
+        }
+
+        int prot = dom->protection == TLS_PROTECT_NONE ? PROT_READ | PROT_WRITE : PROT_NONE;
+        d->base = mmap(0, bytes, prot, MAP_SHARED, d->fd, 0);
+        if (d->base == MAP_FAILED) {
+                close(d->fd);
+                free(d->dirty);
+                free(d);
+                perror("ERROR: Memory mapping failed.");
+                return -1;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &d->last_sync);
+
+        unsigned int i;
+        for (i=0; i<tls->page_num; i++) {
+                tls->pages[i]->address = (uintptr_t)(d->base + (size_t)i * dom->page_size);
+                tls->pages[i]->ref_count = 1;
+                tls->pages[i]->flags = PAGE_NO_RECYCLE;
+        }
+        tls->durable = d;
+        return 0;
+}
+
+// msync pages dirtied since the last sync - one call per run of adjacent dirty pages
+int tls_sync_tls(TLS* tls) {
+        struct durable* d = tls->durable;
+        unsigned int ps = tls->domain->page_size;
+        int ret = 0;
+
+        unsigned int i = 0;
+        while (d->dirty_num > 0 && i < tls->page_num) {
+                if (!d->dirty[i]) {
+                        i++;
+                        continue;
+                }
+                unsigned int start = i;
+                while (i < tls->page_num && d->dirty[i]) {
+                        d->dirty[i++] = 0;
+                }
+                d->dirty_num -= i - start;
+                if (msync(d->base + (size_t)start * ps, (size_t)(i - start) * ps, MS_SYNC)) {
+                        perror("ERROR: msync failed.");
+                        ret = -1;
+                }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &d->last_sync);
+        return ret;
+}
+
+// release file backing of a TLS that is going away
+void tls_durable_free(TLS* tls) {
+        struct durable* d = tls->durable;
+        tls_sync_tls(tls);
+        munmap(d->base, (size_t)tls->page_num * tls->domain->page_size);
+        close(d->fd);
+        unsigned int i;
+        for (i=0; i<tls->page_num; i++) {
+                page_desc_free(tls->pages[i]);
+        }
+        free(d->dirty);
+        free(d);
+        tls->durable = NULL;
+}
+
+// tls_create_durable - create a TLS backed by a file that survives crashes
+int tls_create_durable_in(tls_domain_t* dom, unsigned int size, const char* path) {
+        if (path == NULL) {
+                perror("ERROR: Invalid durable file path.");
+                return -1;
+        }
+        return tls_create_tls(dom, size, path);
+}
+
+// tls_sync - write pages dirtied since the last sync to the file
+int tls_sync_in(tls_domain_t* dom) {
+        TLS* tls = tls_find_current(dom);
+        if (tls == NULL || tls->durable == NULL) {
+                perror("ERROR: current thread does not have a durable LSA.");
+                return -1;
+        }
+        return tls_sync_tls(tls);
+}
+
+// set when tls_write syncs a durable TLS - after 'pages' dirty pages or 'interval_ms' since the last sync
+int tls_sync_policy_in(tls_domain_t* dom, unsigned int pages, unsigned int interval_ms) {
+        TLS* tls = tls_find_current(dom);
+        if (tls == NULL || tls->durable == NULL) {
+                perror("ERROR: current thread does not have a durable LSA.");
+                return -1;
+        }
+        tls->durable->sync_pages = pages;
+        tls->durable->sync_interval_ms = interval_ms;
+        return 0;
+}
+
+// define pressure monitor - thread waiting on a PSI trigger
+struct pressure_monitor {
+        pthread_mutex_t lock;
+        int running;
+        int psi_fd;
+        int stop_fd[2]; // pipe that wakes the monitor to stop
+        unsigned int window_us;
+        void (*callback)(const struct tls_pressure_stats*, void*);
+        void* arg;
+        struct tls_pressure_stats stats;
+        pthread_t thread;
+};
+
+struct pressure_monitor monitor = { .lock = PTHREAD_MUTEX_INITIALIZER, .psi_fd = -1 };
+
+// drop the stock of a domain's pool and stop refilling - returns pages released
+unsigned long pool_shrink(tls_domain_t* dom) {
+        struct page_pool* pool = &dom->pool;
+        unsigned long released = 0;
+
+        pthread_mutex_lock(&pool->lock);
+        if (pool->running) {
+                pool->shrunk = 1;
+                unsigned int i;
+                for (i=0; i<pool->clean_num; i++) {
+                        munmap((void*)pool->clean[i], pool->page_bytes);
+                }
+                for (i=0; i<pool->dirty_num; i++) {
+                        munmap((void*)pool->dirty[i], pool->page_bytes);
+                }
+                released = pool->clean_num + pool->dirty_num;
+                pool->clean_num = pool->dirty_num = 0;
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        return released;
+}
+
+// let a shrunk pool refill its stock
+void pool_unshrink(tls_domain_t* dom) {
+        struct page_pool* pool = &dom->pool;
+
+        pthread_mutex_lock(&pool->lock);
+        if (pool->shrunk) {
+                pool->shrunk = 0;
+                pthread_cond_signal(&pool->cond);
+        }
+        pthread_mutex_unlock(&pool->lock);
+}
+
+// helper function to take a snapshot of the domain list - each domain stays pinned until domains_unpin
+tls_domain_t** domains_pin(unsigned int* n) {
+        pthread_mutex_lock(&domains_lock);
+        unsigned int num = 0;
+        tls_domain_t* dom;
+        for (dom = domains; dom != NULL; dom = dom->next) {
+                num++;
+        }
+        tls_domain_t** list = (tls_domain_t**)malloc((num > 0 ? num : 1) * sizeof(tls_domain_t*));
+        *n = 0;
+        for (dom = domains; list != NULL && dom != NULL; dom = dom->next) {
+                dom->pins++;
+                list[(*n)++] = dom;
+        }
+        pthread_mutex_unlock(&domains_lock);
+        return list;
+}
+
+// helper function to release domains pinned by domains_pin
+void domains_unpin(tls_domain_t** list, unsigned int n) {
+        pthread_mutex_lock(&domains_lock);
+        unsigned int i;
+        for (i=0; i<n; i++) {
+                if (--list[i]->pins == 0) {
+                        pthread_cond_broadcast(&list[i]->unpinned);
+                }
+        }
+        pthread_mutex_unlock(&domains_lock);
+        free(list);
+}
+
+// drop private pages of the reclaimable TLS of 'tid' if it was not used since the last pressure event
+// pages are picked and flagged under domain lock, the madvise calls run under the TLS lock alone
+unsigned long tls_reclaim_tls(tls_domain_t* dom, pthread_t tid, unsigned long epoch) {
+        unsigned long released = 0;
+
+        pthread_mutex_lock(&dom->lock);
+        TLS* tls = hash_table_find(dom, tid);
+        if (tls == NULL || !tls->reclaimable || tls->frozen || tls->durable != NULL || __atomic_load_n(&tls->last_access, __ATOMIC_RELAXED) >= epoch) {
+                pthread_mutex_unlock(&dom->lock);
+                return 0;
+        }
+        if (pthread_mutex_trylock(&tls->lock)) {
+                pthread_mutex_unlock(&dom->lock);
+                return 0; // owner is using it - not idle
+        }
+
+        // flag private pages - clones no longer share them
+        unsigned int i, flagged = 0;
+        for (i=0; i<tls->page_num; i++) {
+                if (__atomic_load_n(&tls->pages[i]->ref_count, __ATOMIC_ACQUIRE) == 1) {
+                        __atomic_or_fetch(&tls->pages[i]->flags, PAGE_DROPPING, __ATOMIC_RELAXED);
+                        flagged++;
+                }
+        }
+        tls->spilling = flagged;
+        pthread_mutex_unlock(&dom->lock);
+
+        // one madvise per run of adjacent flagged pages
+        i = 0;
+        while (i < tls->page_num) {
+                if (!(tls->pages[i]->flags & PAGE_DROPPING)) {
+                        i++;
+                        continue;
+                }
+                uintptr_t start = tls->pages[i]->address;
+                uintptr_t end = start + dom->page_size;
+                for (i++; i < tls->page_num && tls->pages[i]->address == end && (tls->pages[i]->flags & PAGE_DROPPING); i++) {
+                        end += dom->page_size;
+                }
+                if (madvise((void*)start, end - start, MADV_DONTNEED) == 0) {
+                        released += (end - start) / dom->page_size;
+                }
+        }
+
+        if (flagged > 0) {
+                pthread_mutex_lock(&dom->lock);
+                for (i=0; i<tls->page_num; i++) {
+                        __atomic_and_fetch(&tls->pages[i]->flags, ~PAGE_DROPPING, __ATOMIC_RELAXED);
+                }
+                tls->spilling = 0;
+                pthread_mutex_unlock(&dom->lock);
+        }
+        pthread_mutex_unlock(&tls->lock);
+
+        return released;
+}
+
+// handle one pressure event - shrink pools, reclaim idle areas and spill cold pages of all domains
+// domains are pinned rather than locked, and each area is only locked while it is worked on
+void pressure_reclaim() {
+        unsigned long epoch = __atomic_fetch_add(&pressure_epoch, 1, __ATOMIC_RELAXED);
+        unsigned long pool_pages = 0, area_pages = 0, spill_pages = 0;
+
+        unsigned int n, d;
+        tls_domain_t** list = domains_pin(&n);
+        for (d=0; d<n; d++) {
+                tls_domain_t* dom = list[d];
+                pool_pages += pool_shrink(dom);
+
+                pthread_mutex_lock(&dom->lock);
+                pthread_t* tids;
+                unsigned int tid_num = background_tids(dom, &tids);
+                pthread_mutex_unlock(&dom->lock);
+                unsigned int i;
+                for (i=0; i<tid_num; i++) {
+                        area_pages += tls_reclaim_tls(dom, tids[i], epoch);
+                }
+                free(tids);
+                spill_pages += spill_pass(dom);
+        }
+        domains_unpin(list, n);
+
+        pthread_mutex_lock(&monitor.lock);
+        monitor.stats.events++;
+        monitor.stats.pool_pages_released += pool_pages;
+        monitor.stats.area_pages_released += area_pages;
+        monitor.stats.area_pages_spilled += spill_pages;
+        struct tls_pressure_stats stats = monitor.stats;
+        pthread_mutex_unlock(&monitor.lock);
+
+        if (monitor.callback != NULL) {
+                monitor.callback(&stats, monitor.arg);
+        }
+}
+
+// monitor thread - reclaims on PSI events, restores pools after a quiet period
+void* pressure_monitor_thread(void* arg) {
+        struct pollfd fds[2] = { { monitor.psi_fd, POLLPRI, 0 }, { monitor.stop_fd[0], POLLIN, 0 } };
+        int quiet_ms = monitor.window_us / 1000 * 4; // four windows without events
+        int shrunk = 0;
+
+        while (1) {
+                int n = poll(fds, 2, shrunk ? quiet_ms : -1);
+                if (n < 0) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        perror("ERROR: poll on memory pressure failed.");
+                        break;
+                }
+                if (fds[1].revents) {
+                        break; // stop requested
+                }
+                if (n == 0) {
+                        // pressure subsided - let pools refill
+                        pthread_mutex_lock(&domains_lock);
+                        tls_domain_t* dom;
+                        for (dom = domains; dom != NULL; dom = dom->next) {
+                                pool_unshrink(dom);
+                        }
+                        pthread_mutex_unlock(&domains_lock);
+                        shrunk = 0;
+                        continue;
+                }
+                if (fds[0].revents & POLLERR) {
+                        fprintf(stderr, "tls_pressure_monitor: PSI trigger is gone\n");
+                        break;
+                }
+                if (fds[0].revents & POLLPRI) {
+                        pressure_reclaim();
+                        shrunk = 1;
+                }
+        }
+
+        // leave pools running normally
+        pthread_mutex_lock(&domains_lock);
+        tls_domain_t* dom;
+        for (dom = domains; dom != NULL; dom = dom->next) {
+                pool_unshrink(dom);
+        }
+        pthread_mutex_unlock(&domains_lock);
+
+        return NULL;
+}
+
+// start reacting to memory pressure - stall of 'stall_us' within 'window_us' triggers reclaim
+int tls_pressure_monitor_start(unsigned int stall_us, unsigned int window_us, void (*callback)(const struct tls_pressure_stats*, void*), void* arg) {
+        if (!initialized) {
+                tls_init();
+        }
+
+        pthread_mutex_lock(&monitor.lock);
+        if (monitor.running) {
+                pthread_mutex_unlock(&monitor.lock);
+                perror("ERROR: Pressure monitor already running.");
+                return -1;
+        }
+
+        // subscribe to PSI - see Documentation/accounting/psi.rst
+        monitor.psi_fd = open("/proc/pressure/memory", O_RDWR | O_NONBLOCK | O_CLOEXEC);
+        if (monitor.psi_fd < 0) {
+                pthread_mutex_unlock(&monitor.lock);
+                perror("ERROR: Could not open /proc/pressure/memory.");
+                return -1;
+        }
+        char trigger[64];
+        snprintf(trigger, sizeof(trigger), "some %u %u", stall_us, window_us);
+        if (write(monitor.psi_fd, trigger, strlen(trigger) + 1) < 0) {
+                close(monitor.psi_fd);
+                pthread_mutex_unlock(&monitor.lock);
+                perror("ERROR: Could not install PSI trigger.");
+                return -1;
+        }
+        if (pipe(monitor.stop_fd)) {
+                close(monitor.psi_fd);
+                pthread_mutex_unlock(&monitor.lock);
+                perror("ERROR: Could not create monitor pipe.");
+                return -1;
+        }
+
+        monitor.window_us = window_us;
+        monitor.callback = callback;
+        monitor.arg = arg;
+        memset(&monitor.stats, 0, sizeof(monitor.stats));
+        if (pthread_create(&monitor.thread, NULL, pressure_monitor_thread, NULL)) {
+                close(monitor.psi_fd);
+                close(monitor.stop_fd[0]);
+                close(monitor.stop_fd[1]);
+                pthread_mutex_unlock(&monitor.lock);
+                perror("ERROR: Could not start pressure monitor.");
+                return -1;
+        }
+        monitor.running = 1;
+        pthread_mutex_unlock(&monitor.lock);
+
+        return 0;
+}
+
+// stop the pressure monitor
+void tls_pressure_monitor_stop() {
+        pthread_mutex_lock(&monitor.lock);
+        if (!monitor.running) {
+                pthread_mutex_unlock(&monitor.lock);
+                return;
+        }
+        monitor.running = 0;
+        pthread_mutex_unlock(&monitor.lock);
+
+        char c = 0;
+        if (write(monitor.stop_fd[1], &c, 1) < 0) {
+                perror("ERROR: Could not wake pressure monitor.");
+        }
+        pthread_join(monitor.thread, NULL);
+        close(monitor.psi_fd);
+        close(monitor.stop_fd[0]);
+        close(monitor.stop_fd[1]);
+        monitor.psi_fd = -1;
+}
+
+// get what the pressure monitor released so far
+void tls_pressure_stats(struct tls_pressure_stats* stats) {
+        pthread_mutex_lock(&monitor.lock);
+        *stats = monitor.stats;
+        pthread_mutex_unlock(&monitor.lock);
+}
+
+// flag the current thread's TLS as reclaimable - its private pages may read back as zeros after memory pressure
+int tls_set_reclaimable_in(tls_domain_t* dom, int reclaimable) {
+        TLS* tls = tls_find_current(dom);
+        if (tls == NULL) {
+                perror("ERROR: current thread does not have an LSA.");
+                return -1;
+        }
+        pthread_mutex_lock(&tls->lock);
+        tls->reclaimable = reclaimable != 0;
+        tls_fast_update(tls);
+        pthread_mutex_unlock(&tls->lock);
+        return 0;
+}
+
+// helper function to sort slots, highest first - popping from the end reuses them in file order
+int cmp_slot_desc(const void* a, const void* b) {
+        unsigned int x = *(const unsigned int*)a;
+        unsigned int y = *(const unsigned int*)b;
+        return (x < y) - (x > y);
+}
+
+// change protection of listed pages of a TLS - one mprotect per run of adjacent pages
+void spill_protect(TLS* tls, const unsigned int* pn, unsigned int n, int prot) {
+        tls_domain_t* dom = tls->domain;
+        if (dom->protection == TLS_PROTECT_NONE) {
+                return;
+        }
+
+        unsigned int i = 0;
+        while (i < n) {
+                uintptr_t start = tls->pages[pn[i]]->address;
+                uintptr_t end = start + dom->page_size;
+                for (i++; i < n && tls->pages[pn[i]]->address == end; i++) {
+                        end += dom->page_size;
+                }
+                if (mprotect((void*)start, end - start, prot)) {
+                        fprintf(stderr, "tls_spill: could not change page protection\n");
+                        exit(1);
+                }
+        }
+}
+
+// helper function to list the threads whose areas background passes may work on - caller holds domain lock
+// passes look each area up again before they touch it, so the list may go stale meanwhile
+unsigned int background_tids(tls_domain_t* dom, pthread_t** tids) {
+        unsigned int n = 0, cap = 0;
+        *tids = NULL;
+        int i;
+        for (i=0; i<HASH_SIZE; i++) {
+                struct hash_element* elem;
+                for (elem = dom->hash_table[i]; elem != NULL; elem = elem->next) {
+                        TLS* tls = elem->tls;
+                        if ((!tls->reclaimable && tls->spill_age == 0) || tls->frozen || tls->durable != NULL) {
+                                continue;
+                        }
+                        if (n == cap) {
+                                cap = cap ? cap * 2 : 64;
+                                pthread_t* grown = (pthread_t*)realloc(*tids, cap * sizeof(pthread_t));
+                                if (grown == NULL) {
+                                        return n; // the rest waits for the next pass
+                                }
+                                *tids = grown;
+                        }
+                        (*tids)[n++] = elem->tid;
+                }
+        }
+        return n;
+}
+
+// write cold private pages of the spillable TLS of 'tid' to the spill file
+// pages are picked and flagged under domain lock, then written out under the TLS lock alone - lookups go on meanwhile
+unsigned long tls_spill_tls(tls_domain_t* dom, pthread_t tid, unsigned long epoch) {
+        struct spill* s = dom->spill;
+        unsigned int ps = dom->page_size;
+        unsigned long spilled = 0;
+
+        pthread_mutex_lock(&dom->lock);
+        TLS* tls = hash_table_find(dom, tid);
+        if (tls == NULL || tls->spill_age == 0 || tls->frozen || tls->durable != NULL) {
+                pthread_mutex_unlock(&dom->lock);
+                return 0;
+        }
+        if (pthread_mutex_trylock(&tls->lock)) {
+                pthread_mutex_unlock(&dom->lock);
+                return 0; // owner is using it - not cold
+        }
+
+        // pick resident private pages not accessed during the last spill_age passes - clones copy them from now on
+        unsigned int* cold = (unsigned int*)malloc(tls->page_num * sizeof(unsigned int));
+        unsigned int* out = (unsigned int*)malloc(tls->page_num * sizeof(unsigned int));
+        unsigned int* slots = (unsigned int*)malloc(tls->page_num * sizeof(unsigned int));
+        unsigned int cold_num = 0, i;
+        for (i=0; cold != NULL && out != NULL && slots != NULL && i<tls->page_num; i++) {
+                struct page* p = tls->pages[i];
+                if (p->slot == 0 && __atomic_load_n(&p->ref_count, __ATOMIC_ACQUIRE) == 1 && epoch - __atomic_load_n(&p->epoch, __ATOMIC_RELAXED) >= tls->spill_age) {
+                        __atomic_or_fetch(&p->flags, PAGE_SPILLING, __ATOMIC_RELAXED);
+                        cold[cold_num++] = i;
+                }
+        }
+        tls->spilling = cold_num;
+        pthread_mutex_unlock(&dom->lock);
+        if (cold_num == 0) {
+                pthread_mutex_unlock(&tls->lock);
+                free(cold);
+                free(out);
+                free(slots);
+                return 0;
+        }
+        spill_protect(tls, cold, cold_num, PROT_READ);
+
+        // zero pages are dropped without writing - they read back as zeros anyway
+        unsigned int out_num = 0, dropped = 0;
+        for (i=0; i<cold_num; i++) {
+                if (!page_is_zero((void*)tls->pages[cold[i]]->address, ps)) {
+                        out[out_num++] = cold[i];
+                }
+        }
+
+        // make room to track every slot as free, then assign released slots first and grow the file for the rest
+        pthread_mutex_lock(&s->lock);
+        unsigned int grow = out_num > s->free_num ? out_num - s->free_num : 0;
+        unsigned int* free_slots = grow ? (unsigned int*)realloc(s->free, (s->slot_num + grow) * sizeof(unsigned int)) : s->free;
+        int keep = free_slots == NULL; // no room for the slots - every cold page stays resident
+        if (keep) {
+                perror("ERROR: Spill slot allocation failed.");
+                out_num = 0;
+        } else {
+                s->free = free_slots;
+        }
+        if (s->free_num > 1) {
+                qsort(s->free, s->free_num, sizeof(unsigned int), cmp_slot_desc);
+        }
+        for (i=0; i<out_num; i++) {
+                slots[i] = s->free_num > 0 ? s->free[--s->free_num] : s->slot_num++;
+        }
+        pthread_mutex_unlock(&s->lock);
+
+        // one pwritev per run of consecutive slots - a page whose write failed stays resident and gives its slot back
+        struct iovec iov[SPILL_BATCH];
+        i = 0;
+        while (i < out_num) {
+                unsigned int n = 0;
+                do {
+                        iov[n].iov_base = (void*)tls->pages[out[i + n]]->address;
+                        iov[n].iov_len = ps;
+                        n++;
+                } while (i + n < out_num && n < SPILL_BATCH && slots[i + n] == slots[i] + n);
+
+                ssize_t done = pwritev(s->fd, iov, n, (off_t)slots[i] * ps);
+                if (done != (ssize_t)n * ps) {
+                        perror("ERROR: Could not write to spill file.");
+                        pthread_mutex_lock(&s->lock);
+                        unsigned int j;
+                        for (j=i; j<i+n; j++) {
+                                s->free[s->free_num++] = slots[j];
+                                slots[j] = UINT_MAX;
+                        }
+                        pthread_mutex_unlock(&s->lock);
+                }
+                i += n;
+        }
+
+        // placeholders stay mapped, inaccessible until loaded back
+        spill_protect(tls, cold, cold_num, 0);
+
+        // hand written pages over to their slots - from here on clones copy them from the file
+        pthread_mutex_lock(&dom->lock);
+        for (i=0; i<out_num; i++) {
+                if (slots[i] != UINT_MAX) {
+                        tls->pages[out[i]]->slot = slots[i] + 1;
+                        tls->spilled++;
+                }
+        }
+        for (i=0; i<cold_num; i++) {
+                __atomic_and_fetch(&tls->pages[cold[i]]->flags, ~PAGE_SPILLING, __ATOMIC_RELAXED);
+        }
+        tls->spilling = 0;
+        pthread_mutex_unlock(&dom->lock);
+
+        // release memory of written and zero pages - zero pages may be shared by now, they stay zero either way
+        unsigned int o = 0, written = 0;
+        for (i=0; !keep && i<cold_num; i++) {
+                struct page* p = tls->pages[cold[i]];
+                if (o < out_num && out[o] == cold[i]) {
+                        if (slots[o++] == UINT_MAX) {
+                                continue;
+                        }
+                        written++;
+                } else {
+                        dropped++;
+                }
+                if (__atomic_load_n(&p->ref_count, __ATOMIC_ACQUIRE) > 1) {
+                        continue; // a clone took it while it was spilling and still copies it - it is freed with the clone's reference
+                }
+                madvise((void*)p->address, ps, MADV_DONTNEED);
+                spilled++;
+        }
+        pthread_mutex_unlock(&tls->lock);
+
+        pthread_mutex_lock(&s->lock);
+        s->stats.pages_out += written;
+        s->stats.pages_dropped += dropped;
+        pthread_mutex_unlock(&s->lock);
+
+        free(cold);
+        free(out);
+        free(slots);
+        return spilled;
+}
+
+// one spill pass over all areas of a domain - the domain lock is only held to find areas and pick their pages
+unsigned long spill_pass(tls_domain_t* dom) {
+        pthread_mutex_lock(&dom->lock);
+        if (dom->spill == NULL) {
+                pthread_mutex_unlock(&dom->lock);
+                return 0;
+        }
+        dom->spill->passes++; // keeps the spill file open
+        unsigned long epoch = dom->spill_epoch;
+        pthread_t* tids;
+        unsigned int n = background_tids(dom, &tids);
+        pthread_mutex_unlock(&dom->lock);
+
+        unsigned long pages = 0;
+        unsigned int i;
+        for (i=0; i<n; i++) {
+                pages += tls_spill_tls(dom, tids[i], epoch);
+        }
+        free(tids);
+
+        pthread_mutex_lock(&dom->lock);
+        dom->spill->passes--;
+        __atomic_store_n(&dom->spill_epoch, epoch + 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&dom->lock);
+
+        return pages;
+}
+
+// load spilled pages 'first' to 'last' of a TLS back from the spill file - caller owns the TLS
+// slots are read without domain lock - clones may copy from them until they are released below
+int tls_spill_load(TLS* tls, unsigned int first, unsigned int last) {
+        tls_domain_t* dom = tls->domain;
+        struct spill* s = dom->spill;
+        int ret = 0;
+        if (tls->spilled == 0) {
+                return 0;
+        }
+
+        unsigned int pn, loaded = last + 1;
+        for (pn = first; pn <= last; pn++) {
+                struct page* p = tls->pages[pn];
+                if (p->slot == 0) {
+                        continue;
+                }
+                tls_unprotect(dom, p);
+                ssize_t n = pread(s->fd, (void*)p->address, dom->page_size, (off_t)(p->slot - 1) * dom->page_size);
+                tls_protect(dom, p);
+                if (n != dom->page_size) {
+                        perror("ERROR: Could not read from spill file.");
+                        ret = -1;
+                        loaded = pn;
+                        break;
+                }
+        }
+
+        // slots change only under domain lock - clones read them concurrently
+        pthread_mutex_lock(&dom->lock);
+        tls_copiers_wait(tls);
+        pthread_mutex_lock(&s->lock);
+        for (pn = first; pn < loaded && pn <= last; pn++) {
+                struct page* p = tls->pages[pn];
+                if (p->slot == 0) {
+                        continue;
+                }
+                s->free[s->free_num++] = p->slot - 1;
+                p->slot = 0;
+                tls->spilled--;
+                s->stats.pages_in++;
+        }
+        pthread_mutex_unlock(&s->lock);
+        pthread_mutex_unlock(&dom->lock);
+
+        return ret;
+}
+
+// record spill epoch of the pages spanned by an access and load spilled ones back - caller owns the TLS
+int tls_spill_access(TLS* tls, unsigned int offset, unsigned int length) {
+        tls_domain_t* dom = tls->domain;
+        if (length == 0) {
+                return 0;
+        }
+
+        unsigned int first = offset / dom->page_size;
+        unsigned int last = (offset + length - 1) / dom->page_size;
+        if (tls->spill_age > 0) {
+                unsigned long epoch = __atomic_load_n(&dom->spill_epoch, __ATOMIC_RELAXED);
+                unsigned int pn;
+                for (pn = first; pn <= last; pn++) {
+                        __atomic_store_n(&tls->pages[pn]->epoch, epoch, __ATOMIC_RELAXED);
+                }
+        }
+        if (tls->spilled > 0) {
+                return tls_spill_load(tls, first, last);
+        }
+        return 0;
+}
+
+// release spill slots of a TLS that is going away - no clone can find it anymore
+void tls_spill_free(TLS* tls) {
+        if (tls->spilled == 0) {
+                return;
+        }
+        struct spill* s = tls->domain->spill;
+        pthread_mutex_lock(&s->lock);
+        unsigned int i;
+        for (i=0; i<tls->page_num && tls->spilled > 0; i++) {
+                if (tls->pages[i]->slot) {
+                        s->free[s->free_num++] = tls->pages[i]->slot - 1;
+                        tls->pages[i]->slot = 0;
+                        tls->spilled--;
+                }
+        }
+        pthread_mutex_unlock(&s->lock);
+}
+
+// tls_spill_open - give a domain a spill file at 'path' - it is unlinked at once and lives as long as the domain
+int tls_spill_open_in(tls_domain_t* dom, const char* path) {
+        if (!initialized) {
+                tls_init();
+        }
+
+        struct spill* s = (struct spill*)calloc(1, sizeof(struct spill));
+        if (s == NULL) {
+                perror("ERROR: Spill file allocation failed.");
+                return -1;
+        }
+
+        pthread_mutex_lock(&dom->lock);
+        if (dom->spill != NULL) {
+                pthread_mutex_unlock(&dom->lock);
+                free(s);
+                perror("ERROR: Domain already has a spill file.");
+                return -1;
+        }
+        s->fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+        if (s->fd < 0) {
+                pthread_mutex_unlock(&dom->lock);
+                free(s);
+                perror("ERROR: Could not create spill file.");
+                return -1;
+        }
+        unlink(path);
+        pthread_mutex_init(&s->lock, NULL);
+        dom->spill = s;
+        pthread_mutex_unlock(&dom->lock);
+
+        return 0;
+}
+
+// tls_spill_close - drop the spill file of a domain, fails while pages are spilled
+int tls_spill_close_in(tls_domain_t* dom) {
+        pthread_mutex_lock(&dom->lock);
+        struct spill* s = dom->spill;
+        if (s == NULL) {
+                pthread_mutex_unlock(&dom->lock);
+                perror("ERROR: Domain has no spill file.");
+                return -1;
+        }
+        pthread_mutex_lock(&s->lock);
+        int busy = s->free_num < s->slot_num || s->passes > 0;
+        pthread_mutex_unlock(&s->lock);
+        if (busy) {
+                pthread_mutex_unlock(&dom->lock);
+                perror("ERROR: Spill file still holds pages.");
+                return -1;
+        }
+        dom->spill = NULL;
+        pthread_mutex_unlock(&dom->lock);
+
+        close(s->fd);
+        pthread_mutex_destroy(&s->lock);
+        free(s->free);
+        free(s);
+        return 0;
+}
+
+// tls_spill_cold - run one spill pass, returns pages released
+long tls_spill_cold_in(tls_domain_t* dom) {
+        if (__atomic_load_n(&dom->spill, __ATOMIC_ACQUIRE) == NULL) {
+                perror("ERROR: Domain has no spill file.");
+                return -1;
+        }
+        return spill_pass(dom);
+}
+
+// get what the spill file of a domain holds and moved so far
+int tls_spill_stats_in(tls_domain_t* dom, struct tls_spill_stats* stats) {
+        pthread_mutex_lock(&dom->lock);
+        struct spill* s = dom->spill;
+        if (s == NULL) {
+                pthread_mutex_unlock(&dom->lock);
+                perror("ERROR: Domain has no spill file.");
+                return -1;
+        }
+        pthread_mutex_lock(&s->lock);
+        *stats = s->stats;
+        stats->slots = s->slot_num;
+        stats->slots_used = s->slot_num - s->free_num;
+        pthread_mutex_unlock(&s->lock);
+        pthread_mutex_unlock(&dom->lock);
+        return 0;
+}
+
+// let pages of the current thread's TLS be spilled after 'idle_passes' spill passes without access (0 = never)
+int tls_set_spillable_in(tls_domain_t* dom, unsigned int idle_passes) {
+        TLS* tls = tls_find_current(dom);
+        if (tls == NULL) {
+                perror("ERROR: current thread does not have an LSA.");
+                return -1;
+        }
+        if (tls->frozen || tls->durable != NULL) {
+                perror("ERROR: Frozen and durable TLS cannot spill.");
+                return -1;
+        }
+        pthread_mutex_lock(&tls->lock);
+        tls->spill_age = idle_passes;
+        tls_fast_update(tls);
+        pthread_mutex_unlock(&tls->lock);
+        return 0;
+}
+
+// define stats exporter - thread publishing counters to a named shared memory segment
+struct stats_exporter {
+        pthread_mutex_t lock;
+        int running;
+        char name[NAME_MAX];
+        unsigned int interval_ms;
+        struct tls_stats_shm* shm;
+        struct tls_stats_shm snap; // built off the segment, then copied in under the seqlock
+        int stop_fd[2]; // pipe that wakes the exporter to stop
+        pthread_t thread;
+};
+
+struct stats_exporter exporter = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// add counters of 'src' to 'dst' - src may be updated by its owner meanwhile
+void counters_fold(struct tls_counters* dst, const struct tls_counters* src) {
+        dst->reads += __atomic_load_n(&src->reads, __ATOMIC_RELAXED);
+        dst->writes += __atomic_load_n(&src->writes, __ATOMIC_RELAXED);
+        dst->bytes_read += __atomic_load_n(&src->bytes_read, __ATOMIC_RELAXED);
+        dst->bytes_written += __atomic_load_n(&src->bytes_written, __ATOMIC_RELAXED);
+        dst->mprotects += __atomic_load_n(&src->mprotects, __ATOMIC_RELAXED);
+        dst->cow_copies += __atomic_load_n(&src->cow_copies, __ATOMIC_RELAXED);
+}
+
+// sum counters of all areas of a domain, live and destroyed - for benchmarks checking syscall and CoW counts
+void tls_counters_in(tls_domain_t* dom, struct tls_counters* counters) {
+        memset(counters, 0, sizeof(*counters));
+        pthread_mutex_lock(&dom->lock);
+        counters_fold(counters, &dom->retired);
+        int i;
+        for (i=0; i<HASH_SIZE; i++) {
+                struct hash_element* elem;
+                for (elem = dom->hash_table[i]; elem != NULL; elem = elem->next) {
+                        counters_fold(counters, &elem->tls->counters);
+                }
+        }
+        pthread_mutex_unlock(&dom->lock);
+}
+
+// count faulted-in bytes of pages at 'addresses' - one mincore per run of adjacent pages
+// pages freed meanwhile make mincore fail and count as not resident
+unsigned long pages_resident(const uintptr_t* addresses, unsigned int page_num, size_t size) {
+        unsigned char vec[256];
+        unsigned long resident = 0;
+
+        unsigned int i = 0;
+        while (i < page_num) {
+                uintptr_t start = addresses[i];
+                uintptr_t end = start + size;
+                for (i++; i < page_num && addresses[i] == end; i++) {
+                        end += size;
+                }
+                uintptr_t chunk;
+                for (chunk = start; chunk < end; chunk += sizeof(vec) * page_size) {
+                        size_t len = end - chunk < sizeof(vec) * page_size ? end - chunk : sizeof(vec) * page_size;
+                        if (mincore((void*)chunk, len, vec)) {
+                                continue;
+                        }
+                        size_t j;
+                        for (j=0; j<len / page_size; j++) {
+                                resident += (vec[j] & 1) * page_size;
+                        }
+                }
+        }
+        return resident;
+}
+
+// helper function to sort stats entries, largest resident first
+int cmp_resident(const void* a, const void* b) {
+        const struct tls_stats_thread* x = (const struct tls_stats_thread*)a;
+        const struct tls_stats_thread* y = (const struct tls_stats_thread*)b;
+        return (x->resident_bytes < y->resident_bytes) - (x->resident_bytes > y->resident_bytes);
+}
+
+// copy counters and page addresses of the areas of 'dom' out under domain lock
+// returns the number of areas, their entries in *threads and the addresses of their pages in *addresses
+unsigned int stats_copy(tls_domain_t* dom, struct tls_counters* retired, struct tls_stats_thread** threads, uintptr_t** addresses) {
+        *threads = NULL;
+        *addresses = NULL;
+
+        pthread_mutex_lock(&dom->lock);
+        counters_fold(retired, &dom->retired);
+        unsigned int area_num = 0;
+        unsigned long page_num = 0;
+        int i;
+        for (i=0; i<HASH_SIZE; i++) {
+                struct hash_element* elem;
+                for (elem = dom->hash_table[i]; elem != NULL; elem = elem->next) {
+                        area_num++;
+                        page_num += elem->tls->page_num;
+                }
+        }
+        struct tls_stats_thread* t = (struct tls_stats_thread*)calloc(area_num > 0 ? area_num : 1, sizeof(struct tls_stats_thread));
+        uintptr_t* a = (uintptr_t*)malloc((page_num > 0 ? page_num : 1) * sizeof(uintptr_t));
+        if (t == NULL || a == NULL) {
+                pthread_mutex_unlock(&dom->lock);
+                free(t);
+                free(a);
+                return 0;
+        }
+
+        unsigned int n = 0;
+        unsigned long p = 0;
+        for (i=0; i<HASH_SIZE; i++) {
+                struct hash_element* elem;
+                for (elem = dom->hash_table[i]; elem != NULL; elem = elem->next) {
+                        TLS* tls = elem->tls;
+                        t[n].ktid = tls->ktid;
+                        t[n].page_num = tls->page_num;
+                        t[n].spilled_pages = tls->spilled;
+                        unsigned int j;
+                        for (j=0; j<tls->page_num; j++) {
+                                t[n].shared_pages += __atomic_load_n(&tls->pages[j]->ref_count, __ATOMIC_RELAXED) > 1;
+                                a[p++] = tls->pages[j]->address;
+                        }
+                        counters_fold(&t[n].counters, &tls->counters);
+                        n++;
+                }
+        }
+        pthread_mutex_unlock(&dom->lock);
+
+        *threads = t;
+        *addresses = a;
+        return n;
 }
 
-// tls_read
-int tls_read(unsigned int offset, unsigned int length, char *buffer) {
-        pthread_t current_thread = pthread_self();
-        TLS* tls = NULL;
-        int tls_found = 0;
+// gather counters and area summaries of all domains into the exporter's snapshot
+// domain locks are held only while copying, mincore and sorting run without them
+void stats_collect(struct tls_stats_shm* snap) {
+        memset(&snap->totals, 0, sizeof(snap->totals));
+        snap->areas = 0;
+        snap->bytes = 0;
+        snap->resident_bytes = 0;
+        snap->thread_num = 0;
 
-        // search for current thread's TLS in global hash table
-        int i;
-        for (i=0; i<HASH_SIZE; i++) {
-                struct hash_element* elem = hash_table[i];
-                while (elem != NULL) {
-                        if (pthread_equal(elem->tid, current_thread)) {
-                                tls = elem->tls;
-                                tls_found = 1;
-                                break;
+        unsigned int dom_num;
+        tls_domain_t** list = domains_pin(&dom_num);
+        if (list == NULL) {
+                return;
+        }
+        unsigned int d;
+        for (d=0; d<dom_num; d++) {
+                tls_domain_t* dom = list[d];
+                struct tls_stats_thread* threads;
+                uintptr_t* addresses;
+                unsigned int n = stats_copy(dom, &snap->totals, &threads, &addresses);
+
+                unsigned int i;
+                unsigned long p = 0;
+                for (i=0; i<n; i++) {
+                        struct tls_stats_thread* t = &threads[i];
+                        t->resident_bytes = pages_resident(addresses + p, t->page_num, dom->page_size);
+                        p += t->page_num;
+                        counters_fold(&snap->totals, &t->counters);
+                        snap->areas++;
+                        snap->bytes += (unsigned long)t->page_num * dom->page_size;
+                        snap->resident_bytes += t->resident_bytes;
+
+                        // keep the largest - replace the smallest entry once the table is full
+                        if (snap->thread_num < TLS_STATS_THREADS) {
+                                snap->threads[snap->thread_num++] = *t;
+                                continue;
+                        }
+                        unsigned int k, min = 0;
+                        for (k=1; k<TLS_STATS_THREADS; k++) {
+                                if (snap->threads[k].resident_bytes < snap->threads[min].resident_bytes) {
+                                        min = k;
+                                }
+                        }
+                        if (t->resident_bytes > snap->threads[min].resident_bytes) {
+                                snap->threads[min] = *t;
                         }
-                        elem = elem->next;
                 }
-                if (tls_found) {
+                free(threads);
+                free(addresses);
+        }
+        domains_unpin(list, dom_num);
+
+        qsort(snap->threads, snap->thread_num, sizeof(struct tls_stats_thread), cmp_resident);
+}
+
+// publish the snapshot - seqlock writer, never waits for readers
+void stats_publish(struct tls_stats_shm* shm, struct tls_stats_shm* snap) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        snap->updated_ns = (unsigned long)now.tv_sec * 1000000000UL + now.tv_nsec;
+        snap->updates++;
+
+        unsigned long seq = shm->seq;
+        __atomic_store_n(&shm->seq, seq + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        size_t body = offsetof(struct tls_stats_shm, pid);
+        memcpy((char*)shm + body, (char*)snap + body, sizeof(struct tls_stats_shm) - body);
+        __atomic_store_n(&shm->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+// exporter thread - one update per interval until stopped
+void* stats_exporter_thread(void* arg) {
+        struct pollfd fd = { exporter.stop_fd[0], POLLIN, 0 };
+
+        while (1) {
+                stats_collect(&exporter.snap);
+                stats_publish(exporter.shm, &exporter.snap);
+
+                int n = poll(&fd, 1, exporter.interval_ms);
+                if (n < 0 && errno != EINTR) {
+                        perror("ERROR: poll in stats exporter failed.");
                         break;
                 }
+                if (n > 0) {
+                        break; // stop requested
+                }
         }
+        return NULL;
+}
 
-        // check if current thread has LSA
-        if (!tls_found) {
-                perror("ERROR: Current thread does not have an LSA.");
+// start publishing counters to shared memory segment 'name' (e.g. "/tls-1234") every 'interval_ms'
+int tls_stats_export_start(const char* name, unsigned int interval_ms) {
+        if (!initialized) {
+                tls_init();
+        }
+        if (interval_ms == 0 || strlen(name) >= NAME_MAX) {
+                perror("ERROR: Invalid stats export settings.");
                 return -1;
         }
 
-        // check if offset+length is within TLS size
-        if (offset + length > tls->size) {
-                perror("ERROR: Requested read exceeds TLS size.");
+        pthread_mutex_lock(&exporter.lock);
+        if (exporter.running) {
+                pthread_mutex_unlock(&exporter.lock);
+                perror("ERROR: Stats exporter already running.");
                 return -1;
         }
 
-        // unprotect all pages belonging to thread's TLS
-        for (i=0; i<tls->page_num; i++) {
-                tls_unprotect(tls->pages[i]);
+        int fd = shm_open(name, O_CREAT | O_RDWR | O_CLOEXEC, 0644);
+        if (fd < 0) {
+                pthread_mutex_unlock(&exporter.lock);
+                perror("ERROR: Could not open stats segment.");
+                return -1;
         }
-
-        // perform read operation
-        unsigned int cnt, idx;
-        for (cnt=0, idx = offset; idx < (offset + length); ++cnt, ++idx) {
-                unsigned int pn = idx / page_size;
-                unsigned int poff = idx % page_size;
-                struct page* p = tls->pages[pn];
-                char* src = ((char*) p->address) + poff;
-                buffer[cnt] = *src;
+        if (ftruncate(fd, sizeof(struct tls_stats_shm))) {
+                close(fd);
+                shm_unlink(name);
+                pthread_mutex_unlock(&exporter.lock);
+                perror("ERROR: Could not size stats segment.");
+                return -1;
+        }
+        exporter.shm = mmap(0, sizeof(struct tls_stats_shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (exporter.shm == MAP_FAILED) {
+                shm_unlink(name);
+                pthread_mutex_unlock(&exporter.lock);
+                perror("ERROR: Could not map stats segment.");
+                return -1;
+        }
+        if (pipe(exporter.stop_fd)) {
+                munmap(exporter.shm, sizeof(struct tls_stats_shm));
+                shm_unlink(name);
+                pthread_mutex_unlock(&exporter.lock);
+                perror("ERROR: Could not create exporter pipe.");
+                return -1;
         }
 
-        // reprotect all pages belonging to thread's TLS
-        for (i=0; i<tls->page_num; i++) {
-                tls_protect(tls->pages[i]);
+        // header first - a viewer attaching now sees no updates yet
+        memset(&exporter.snap, 0, sizeof(exporter.snap));
+        exporter.snap.pid = getpid();
+        exporter.snap.interval_ms = interval_ms;
+        exporter.shm->seq = 0;
+        exporter.shm->magic = TLS_STATS_MAGIC;
+        exporter.shm->version = TLS_STATS_VERSION;
+        exporter.interval_ms = interval_ms;
+        strcpy(exporter.name, name);
+
+        if (pthread_create(&exporter.thread, NULL, stats_exporter_thread, NULL)) {
+                munmap(exporter.shm, sizeof(struct tls_stats_shm));
+                shm_unlink(name);
+                close(exporter.stop_fd[0]);
+                close(exporter.stop_fd[1]);
+                pthread_mutex_unlock(&exporter.lock);
+                perror("ERROR: Could not start stats exporter.");
+                return -1;
         }
+        exporter.running = 1;
+        pthread_mutex_unlock(&exporter.lock);
 
         return 0;
 }
 
-// tls_write
-int tls_write(unsigned int offset, unsigned int length, char* buffer) {
-        pthread_t current_thread = pthread_self();
-        TLS* tls = NULL;
-        int tls_found = 0;
+// stop the stats exporter and remove its segment
+void tls_stats_export_stop() {
+        pthread_mutex_lock(&exporter.lock);
+        if (!exporter.running) {
+                pthread_mutex_unlock(&exporter.lock);
+                return;
+        }
+        exporter.running = 0;
 
-        // search for current thread's TLS in global hash table
-        int i;
-        for (i=0; i<HASH_SIZE; i++) {
-                struct hash_element* elem = hash_table[i];
-                while (elem != NULL) {
-                        if (pthread_equal(elem->tid, current_thread)) {
-                                tls = elem->tls;
-                                tls_found = 1;
-                                break;
+        char c = 0;
+        if (write(exporter.stop_fd[1], &c, 1) < 0) {
+                perror("ERROR: Could not wake stats exporter.");
+        }
+        pthread_join(exporter.thread, NULL);
+        close(exporter.stop_fd[0]);
+        close(exporter.stop_fd[1]);
+        munmap(exporter.shm, sizeof(struct tls_stats_shm));
+        shm_unlink(exporter.name);
+        pthread_mutex_unlock(&exporter.lock);
+}
+
+// helper function to get the number of CPU ids the kernel may report - highest possible CPU plus one
+// counting CPUs is not enough: with holes in the possible mask ids reach past the count
+long percpu_possible() {
+        long cpus = -1;
+        char list[256];
+        FILE* f = fopen("/sys/devices/system/cpu/possible", "r");
+        if (f != NULL) {
+                // ranges like "0-7,16-23" - the last id of any range counts
+                if (fgets(list, sizeof(list), f) != NULL) {
+                        char* p = list;
+                        while (*p >= '0' && *p <= '9') {
+                                long last = strtol(p, &p, 10);
+                                if (*p == '-') {
+                                        last = strtol(p + 1, &p, 10);
+                                }
+                                cpus = last + 1 > cpus ? last + 1 : cpus;
+                                if (*p == ',') {
+                                        p++;
+                                }
                         }
-                        elem = elem->next;
-                }
-                if (tls_found) {
-                        break;
                 }
+                fclose(f);
+        }
+        if (cpus <= 0) {
+                cpus = sysconf(_SC_NPROCESSORS_CONF);
         }
+        return cpus;
+}
 
-        // check if current thread has LSA
-        if (!tls_found) {
-                perror("ERROR: current thread does not have an LSA.");
+// create per-CPU areas of 'size' bytes for all possible CPUs of the machine - memory scales with cores, not threads
+// slices start on page boundaries so CPUs never share a cache line, and a guard page stops overruns into the next one
+int tls_percpu_create_in(tls_domain_t* dom, unsigned int size) {
+        if (!initialized) {
+                tls_init();
+        }
+        long cpus = percpu_possible();
+        if (size == 0 || cpus <= 0) {
+                perror("ERROR: Invalid per-CPU area size.");
+                return -1;
+        }
+        struct percpu* pc = (struct percpu*)calloc(1, sizeof(struct percpu));
+        if (pc == NULL) {
+                perror("ERROR: Per-CPU allocation failed.");
                 return -1;
         }
+        pc->size = size;
+        pc->cpu_num = cpus;
+        pc->slice = ((size_t)size + dom->page_size - 1) / dom->page_size * dom->page_size;
+        pc->stride = pc->slice + page_size;
+        unsigned long bytes = (unsigned long)pc->cpu_num * pc->slice;
 
-        // check if offset+length is within TLS size
-        if (offset + length > tls->size) {
-                perror("ERROR: Requested write exceeds TLS size.");
+        pthread_mutex_lock(&dom->lock);
+        if (dom->percpu != NULL) {
+                pthread_mutex_unlock(&dom->lock);
+                free(pc);
+                perror("ERROR: Domain already has per-CPU areas.");
+                return -1;
+        }
+        if (dom->max_bytes > 0 && dom->bytes + bytes > dom->max_bytes) {
+                pthread_mutex_unlock(&dom->lock);
+                free(pc);
+                perror("ERROR: Domain budget exceeded.");
                 return -1;
         }
 
-        // unprotect all pages belonging to thread's TLS
-        for (i=0; i<tls->page_num; i++) {
-                tls_unprotect(tls->pages[i]);
+        // slices are faulted in by the first update, i.e. on their own CPU's NUMA node
+        pc->base = mmap(0, pc->cpu_num * pc->stride, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE | MAP_NORESERVE, 0, 0);
+        if (pc->base == MAP_FAILED) {
+                pthread_mutex_unlock(&dom->lock);
+                free(pc);
+                perror("ERROR: Memory mapping failed.");
+                return -1;
         }
+        unsigned int cpu;
+        for (cpu=0; cpu<pc->cpu_num; cpu++) {
+                if (mprotect(pc->base + cpu * pc->stride + pc->slice, page_size, PROT_NONE)) {
+                        pthread_mutex_unlock(&dom->lock);
+                        munmap(pc->base, pc->cpu_num * pc->stride);
+                        free(pc);
+                        perror("ERROR: Could not protect per-CPU guard page.");
+                        return -1;
+                }
+        }
+        dom->bytes += bytes;
+        __atomic_store_n(&dom->percpu, pc, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&dom->lock);
 
-        // perform write operation
-        unsigned int cnt, idx;
-        for (cnt=0, idx = offset; idx < (offset + length); ++cnt, ++idx) {
-                unsigned int pn = idx / page_size;
-                unsigned int poff = idx % page_size;
+        return 0;
+}
 
+// release per-CPU areas of a domain - no thread may update them anymore
+int tls_percpu_destroy_in(tls_domain_t* dom) {
+        pthread_mutex_lock(&dom->lock);
+        struct percpu* pc = dom->percpu;
+        if (pc == NULL) {
+                pthread_mutex_unlock(&dom->lock);
+                perror("ERROR: Domain has no per-CPU areas.");
+                return -1;
+        }
+        __atomic_store_n(&dom->percpu, NULL, __ATOMIC_RELEASE);
+        dom->bytes -= (unsigned long)pc->cpu_num * pc->slice;
+        pthread_mutex_unlock(&dom->lock);
 
-                //check CoW condition once per page
-                if (idx % page_size == 0 || idx == offset) {
-                        struct page* p = tls->pages[pn];
-                        // CoW mechanism
-                        if (p->ref_count > 1) {
-                                // page is shared, create new private copy
-                                struct page* copy = (struct page*) calloc(1, sizeof(struct page));
-                                if (copy == NULL) {
-                                        perror("ERROR: Memory allocation for page copy.");
-                                        return -1;
-                                }
-                                void* new_page = mmap(0, page_size, PROT_WRITE, MAP_ANON | MAP_PRIVATE, 0, 0);
-                                if (new_page == MAP_FAILED) {
-                                        free(copy);
-                                        perror("ERROR: mmap failed for page copy.");
-                                        return -1;
-                                }
-                                memcpy(new_page, (void*)p->address, page_size);
-                                copy->address = (uintptr_t)new_page;
-                                copy->ref_count = 1;
-                                tls->pages[pn] = copy;
+        munmap(pc->base, pc->cpu_num * pc->stride);
+        free(pc);
+        return 0;
+}
 
-                                // update original page
-                                p->ref_count--;
-                                tls_protect(p);
-                                p = copy;
+// helper function to get per-CPU areas and check a range of them - NULL if invalid
+struct percpu* percpu_range(tls_domain_t* dom, unsigned int offset, unsigned int length) {
+        struct percpu* pc = __atomic_load_n(&dom->percpu, __ATOMIC_ACQUIRE);
+        if (pc == NULL) {
+                perror("ERROR: Domain has no per-CPU areas.");
+                return NULL;
+        }
+        if (offset + length > pc->size || offset + length < offset) {
+                perror("ERROR: Requested range exceeds per-CPU area size.");
+                return NULL;
+        }
+        return pc;
+}
+
+#ifdef TLS_HAVE_RSEQ
+// add 'delta' to 'counter' if the thread still runs on 'cpu' - returns -1 if the sequence was aborted
+// the add is the commit of an rseq critical section: preemption, migration or a signal before it makes
+// the kernel restart at the abort label instead, so the slice of a CPU is only ever written on that CPU
+int percpu_add_rseq(long* counter, long delta, int cpu) {
+        __asm__ __volatile__ goto (
+                ".pushsection __rseq_cs, \"aw\"\n\t"
+                ".balign 32\n\t"
+                "3:\n\t"
+                ".long 0, 0\n\t"
+                ".quad 1f, (2f - 1f), 4f\n\t"
+                ".popsection\n\t"
+                "leaq 3b(%%rip), %%rax\n\t"
+                "movq %%rax, %%fs:%c[cs](%[rseq])\n\t"
+                "1:\n\t"
+                "cmpl %[cpu], %%fs:%c[cpu_id](%[rseq])\n\t"
+                "jnz 4f\n\t"
+                "addq %[delta], %[counter]\n\t"
+                "2:\n\t"
+                ".pushsection __rseq_failure, \"ax\"\n\t"
+                ".byte 0x0f, 0xb9, 0x3d\n\t" // ud1 - the kernel checks the signature right before the abort label
+                ".long " TLS_STR(RSEQ_SIG) "\n\t"
+                "4:\n\t"
+                "jmp %l[abort]\n\t"
+                ".popsection\n\t"
+                :
+                : [cpu] "r" (cpu), [rseq] "r" (__rseq_offset), [counter] "m" (*counter), [delta] "er" (delta),
+                  [cs] "i" (offsetof(struct rseq, rseq_cs)), [cpu_id] "i" (offsetof(struct rseq, cpu_id))
+                : "memory", "cc", "rax"
+                : abort);
+        return 0;
+abort:
+        return -1;
+}
+#endif
+
+// add 'delta' to the long at 'offset' of the current CPU's area - no lock, no atomic instruction with rseq
+int tls_percpu_add_in(tls_domain_t* dom, unsigned int offset, long delta) {
+        struct percpu* pc = percpu_range(dom, offset, sizeof(long));
+        if (pc == NULL) {
+                return -1;
+        }
+        if (offset % sizeof(long)) {
+                perror("ERROR: Per-CPU counter is not aligned.");
+                return -1;
+        }
+#ifdef TLS_HAVE_RSEQ
+        // registered by glibc for all threads or for none - mixing with the atomic path below is not possible
+        if (__rseq_size > 0) {
+                volatile struct rseq* rs = (volatile struct rseq*)((char*)__builtin_thread_pointer() + __rseq_offset);
+                while ((int)rs->cpu_id >= 0) {
+                        unsigned int cpu = rs->cpu_id_start;
+                        if (cpu >= pc->cpu_num) {
+                                // every possible CPU has a slice - sharing another CPU's slice would race with its plain adds
+                                perror("ERROR: No per-CPU area for this CPU.");
+                                return -1;
+                        }
+                        if (percpu_add_rseq((long*)(pc->base + cpu * pc->stride + offset), delta, cpu) == 0) {
+                                return 0;
                         }
                 }
-                struct page* p = tls->pages[pn];
-                char* dst = ((char*) p->address) + poff;
-                *dst = buffer[cnt];
         }
-
-        // reprotect all pages belonging to thread's TLS
-        for (i=0; i<tls->page_num; i++) {
-                tls_protect(tls->pages[i]);
+#endif
+        // no rseq - an atomic add stays exact when the thread migrates between sched_getcpu and the add
+        int cpu = sched_getcpu();
+        if (cpu < 0) {
+                cpu = 0;
         }
-
+        if ((unsigned int)cpu >= pc->cpu_num) {
+                perror("ERROR: No per-CPU area for this CPU.");
+                return -1;
+        }
+        __atomic_add_fetch((long*)(pc->base + cpu * pc->stride + offset), delta, __ATOMIC_RELAXED);
         return 0;
 }
 
-// tls_clone
-int tls_clone(pthread_t tid) {
-        pthread_t current_thread = pthread_self();
-        TLS* current_tls = NULL;
-        TLS* target_tls = NULL;
-        int target_tls_found = 0;
+#ifdef TLS_HAVE_RSEQ
+// store 'desired' to 'slot' if it holds '*seen' and the thread still runs on 'cpu' - 0 if stored, 1 if the
+// slot held another value (left in '*seen'), -1 if the sequence was aborted; the store is the commit
+int percpu_cas_rseq(long* slot, long* seen, long desired, int cpu) {
+        __asm__ __volatile__ goto (
+                ".pushsection __rseq_cs, \"aw\"\n\t"
+                ".balign 32\n\t"
+                "3:\n\t"
+                ".long 0, 0\n\t"
+                ".quad 1f, (2f - 1f), 4f\n\t"
+                ".popsection\n\t"
+                "leaq 3b(%%rip), %%rax\n\t"
+                "movq %%rax, %%fs:%c[cs](%[rseq])\n\t"
+                "1:\n\t"
+                "cmpl %[cpu], %%fs:%c[cpu_id](%[rseq])\n\t"
+                "jnz 4f\n\t"
+                "movq %[slot], %%rax\n\t"
+                "cmpq %%rax, %[expected]\n\t"
+                "jnz 5f\n\t"
+                "movq %[desired], %[slot]\n\t"
+                "2:\n\t"
+                ".pushsection __rseq_failure, \"ax\"\n\t"
+                ".byte 0x0f, 0xb9, 0x3d\n\t" // ud1 - the kernel checks the signature right before the abort label
+                ".long " TLS_STR(RSEQ_SIG) "\n\t"
+                "4:\n\t"
+                "jmp %l[abort]\n\t"
+                ".popsection\n\t"
+                "jmp %l[stored]\n\t"
+                "5:\n\t"
+                "movq %%rax, %[seen]\n\t"
+                :
+                : [cpu] "r" (cpu), [rseq] "r" (__rseq_offset), [slot] "m" (*slot), [seen] "m" (*seen),
+                  [expected] "r" (*seen), [desired] "r" (desired),
+                  [cs] "i" (offsetof(struct rseq, rseq_cs)), [cpu_id] "i" (offsetof(struct rseq, cpu_id))
+                : "memory", "cc", "rax"
+                : abort, stored);
+        return 1;
+stored:
+        return 0;
+abort:
+        return -1;
+}
+#endif
 
-        // check if current thread already has LSA
-        int i;
-        for (i=0; i<HASH_SIZE; i++) {
-                struct hash_element* elem = hash_table[i];
-                while (elem != NULL) {
-                        if (pthread_equal(elem->tid, current_thread)) {
-                                current_tls = elem->tls;
-                                break;
+// store 'desired' to the long at 'offset' of the current CPU's area if it still holds '*expected' - for
+// per-CPU caches; 0 if stored, 1 if not, with the value found left in '*expected' for the next attempt
+int tls_percpu_cas_in(tls_domain_t* dom, unsigned int offset, long* expected, long desired) {
+        struct percpu* pc = percpu_range(dom, offset, sizeof(long));
+        if (pc == NULL) {
+                return -1;
+        }
+        if (offset % sizeof(long)) {
+                perror("ERROR: Per-CPU slot is not aligned.");
+                return -1;
+        }
+#ifdef TLS_HAVE_RSEQ
+        if (__rseq_size > 0) {
+                volatile struct rseq* rs = (volatile struct rseq*)((char*)__builtin_thread_pointer() + __rseq_offset);
+                while ((int)rs->cpu_id >= 0) {
+                        unsigned int cpu = rs->cpu_id_start;
+                        if (cpu >= pc->cpu_num) {
+                                perror("ERROR: No per-CPU area for this CPU.");
+                                return -1;
                         }
-                        if (pthread_equal(elem->tid, tid)) {
-                                target_tls = elem->tls;
-                                target_tls_found = 1;
+                        int r = percpu_cas_rseq((long*)(pc->base + cpu * pc->stride + offset), expected, desired, cpu);
+                        if (r >= 0) {
+                                return r;
                         }
-                        elem = elem->next;
                 }
         }
-
-        if (current_tls != NULL) {
-                perror("ERROR: current thread already has LSA.");
+#endif
+        // no rseq - the slot may be another CPU's by the time of the exchange, which only an atomic keeps exact
+        int cpu = sched_getcpu();
+        if (cpu < 0) {
+                cpu = 0;
+        }
+        if ((unsigned int)cpu >= pc->cpu_num) {
+                perror("ERROR: No per-CPU area for this CPU.");
                 return -1;
         }
+        long* slot = (long*)(pc->base + cpu * pc->stride + offset);
+        return __atomic_compare_exchange_n(slot, expected, desired, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED) ? 0 : 1;
+}
 
-        // check if target thread has LSA
-        if (!target_tls_found) {
-                perror("ERROR: target thread does not have LSA.");
+// sum the long at 'offset' over all CPUs - lock-free, concurrent adds are either in or not
+int tls_percpu_sum_in(tls_domain_t* dom, unsigned int offset, long* sum) {
+        struct percpu* pc = percpu_range(dom, offset, sizeof(long));
+        if (pc == NULL || offset % sizeof(long)) {
                 return -1;
         }
+        long total = 0;
+        unsigned int cpu;
+        for (cpu=0; cpu<pc->cpu_num; cpu++) {
+                total += __atomic_load_n((long*)(pc->base + cpu * pc->stride + offset), __ATOMIC_RELAXED);
+        }
+        *sum = total;
+        return 0;
+}
 
-        // clone tls - allocate tls for current thread
-        TLS* new_tls = (TLS*)calloc(1, sizeof(TLS));
-        if (new_tls == NULL) {
-                perror("ERROR: cloning TLS allocation failed.");
+// copy a range of the area of CPU 'cpu'
+int tls_percpu_read_in(tls_domain_t* dom, unsigned int cpu, unsigned int offset, unsigned int length, char* buffer) {
+        struct percpu* pc = percpu_range(dom, offset, length);
+        if (pc == NULL) {
                 return -1;
         }
-
-        new_tls->tid = current_thread;
-        new_tls->size = target_tls->size;
-        new_tls->page_num = target_tls->page_num;
-        new_tls->pages = (struct page**)calloc(new_tls->page_num, sizeof(struct page*));
-        if (new_tls->pages == NULL) {
-                free(new_tls);
-                perror("ERROR: cloning TLS allocation failed.");
+        if (cpu >= pc->cpu_num) {
+                perror("ERROR: No per-CPU area for this CPU.");
                 return -1;
         }
+        memcpy(buffer, pc->base + cpu * pc->stride + offset, length);
+        return 0;
+}
 
-        // copy pages, adjust reference counts
-        for (i=0; i<new_tls->page_num; i++) {
-                new_tls->pages[i] = target_tls->pages[i];
-                new_tls->pages[i]->ref_count++;
-        }
+// number of per-CPU areas of a domain - -1 if it has none
+int tls_percpu_cpus_in(tls_domain_t* dom) {
+        struct percpu* pc = __atomic_load_n(&dom->percpu, __ATOMIC_ACQUIRE);
+        return pc == NULL ? -1 : (int)pc->cpu_num;
+}
 
-        // add this thread mapping to global hash table
-        hash_table_insert(current_thread, new_tls);
+// API on the default domain
+int tls_create(unsigned int size) {
+        return tls_create_in(&default_domain, size);
+}
 
-        return 0;
+int tls_create_parallel(unsigned int size, const char* init_src, unsigned int nthreads) {
+        return tls_create_parallel_in(&default_domain, size, init_src, nthreads);
+}
+
+int tls_destroy() {
+        return tls_destroy_in(&default_domain);
+}
 
-}
\ No newline at end of file
+int tls_destroy_many(const pthread_t* tids, unsigned int n) {
+        return tls_destroy_many_in(&default_domain, tids, n);
+}
+
+int tls_read(unsigned int offset, unsigned int length, char *buffer) {
+        return tls_read_in(&default_domain, offset, length, buffer);
+}
+
+int tls_write(unsigned int offset, unsigned int length, char* buffer) {
+        return tls_write_in(&default_domain, offset, length, buffer);
+}
+
+int tls_clone(pthread_t tid) {
+        return tls_clone_in(&default_domain, tid);
+}
+
+int tls_splice_to_pipe(int pipe_fd, unsigned int offset, unsigned int length) {
+        return tls_splice_to_pipe_in(&default_domain, pipe_fd, offset, length);
+}
+
+int tls_splice_release() {
+        return tls_splice_release_in(&default_domain);
+}
+
+int tls_checkpoint_async(int fd, void (*callback)(int, void*), void* arg) {
+        return tls_checkpoint_async_in(&default_domain, fd, callback, arg);
+}
+
+int tls_compact(struct tls_compact_stats* stats) {
+        return tls_compact_in(&default_domain, stats);
+}
+
+void tls_compact_threshold(unsigned int splits) {
+        tls_compact_threshold_in(&default_domain, splits);
+}
+
+int tls_freeze(int flags) {
+        return tls_freeze_in(&default_domain, flags);
+}
+
+int tls_read_from(pthread_t tid, unsigned int offset, unsigned int length, char* buffer) {
+        return tls_read_from_in(&default_domain, tid, offset, length, buffer);
+}
+
+int tls_wait_change(pthread_t tid, unsigned int offset, unsigned int length, int timeout_ms) {
+        return tls_wait_change_in(&default_domain, tid, offset, length, timeout_ms);
+}
+
+int tls_clone_range(pthread_t tid, const struct tls_range* ranges, unsigned int range_num) {
+        return tls_clone_range_in(&default_domain, tid, ranges, range_num);
+}
+
+int tls_create_durable(unsigned int size, const char* path) {
+        return tls_create_durable_in(&default_domain, size, path);
+}
+
+int tls_sync() {
+        return tls_sync_in(&default_domain);
+}
+
+int tls_sync_policy(unsigned int pages, unsigned int interval_ms) {
+        return tls_sync_policy_in(&default_domain, pages, interval_ms);
+}
+
+int tls_set_reclaimable(int reclaimable) {
+        return tls_set_reclaimable_in(&default_domain, reclaimable);
+}
+
+int tls_profile_report(FILE* out) {
+        return tls_profile_report_in(&default_domain, out);
+}
+
+int tls_spill_open(const char* path) {
+        return tls_spill_open_in(&default_domain, path);
+}
+
+int tls_spill_close() {
+        return tls_spill_close_in(&default_domain);
+}
+
+long tls_spill_cold() {
+        return tls_spill_cold_in(&default_domain);
+}
+
+int tls_spill_stats(struct tls_spill_stats* stats) {
+        return tls_spill_stats_in(&default_domain, stats);
+}
+
+void tls_counters(struct tls_counters* counters) {
+        tls_counters_in(&default_domain, counters);
+}
+
+int tls_percpu_create(unsigned int size) {
+        return tls_percpu_create_in(&default_domain, size);
+}
+
+int tls_percpu_destroy() {
+        return tls_percpu_destroy_in(&default_domain);
+}
+
+int tls_percpu_add(unsigned int offset, long delta) {
+        return tls_percpu_add_in(&default_domain, offset, delta);
+}
+
+int tls_percpu_cas(unsigned int offset, long* expected, long desired) {
+        return tls_percpu_cas_in(&default_domain, offset, expected, desired);
+}
+
+int tls_percpu_sum(unsigned int offset, long* sum) {
+        return tls_percpu_sum_in(&default_domain, offset, sum);
+}
+
+int tls_percpu_read(unsigned int cpu, unsigned int offset, unsigned int length, char* buffer) {
+        return tls_percpu_read_in(&default_domain, cpu, offset, length, buffer);
+}
+
+int tls_percpu_cpus() {
+        return tls_percpu_cpus_in(&default_domain);
+}
+
+int tls_set_spillable(unsigned int idle_passes) {
+        return tls_set_spillable_in(&default_domain, idle_passes);
+}
@@ -0,0 +1,257 @@
+#ifndef TLS_H
+#define TLS_H
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+
+// protection modes of a domain
+#define TLS_PROTECT_PAGES 0 // pages are inaccessible outside tls_read/tls_write
+#define TLS_PROTECT_NONE 1 // pages stay read/write - no mprotect per access
+
+// freeze flags
+#define TLS_FREEZE_READABLE 1 // keep frozen pages mapped PROT_READ - reads need no syscall
+
+// stats segment
+#define TLS_STATS_MAGIC 0x544c5353 // "TLSS" - start of a stats segment
+#define TLS_STATS_VERSION 1
+#define TLS_STATS_THREADS 64 // areas published per stats update, largest resident first
+
+// define domain - an independent registry with its own configuration
+typedef struct tls_domain tls_domain_t;
+
+// define domain configuration
+struct tls_domain_config {
+        unsigned int page_size; // page granularity in bytes, rounded up to system pages (0 = system page)
+        int protection; // TLS_PROTECT_PAGES or TLS_PROTECT_NONE
+        unsigned int pool_pages; // pages kept in stock by a background supplier (0 = no supplier)
+        unsigned long max_bytes; // budget for all areas of the domain (0 = unlimited)
+        unsigned int compact_threshold; // CoW splits that trigger tls_compact (0 = explicit only)
+        unsigned int color_stride; // cache coloring - start offsets of consecutive areas differ by this many bytes (0 = off)
+};
+
+// define range of a TLS - used by tls_clone_range
+struct tls_range {
+        unsigned int offset;
+        unsigned int length;
+};
+
+// define compaction report
+struct tls_compact_stats {
+        unsigned int vmas_before; // mappings holding pages of the TLS before compaction
+        unsigned int vmas_after;
+        unsigned int pages_moved;
+};
+
+// define pressure report - cumulative since the monitor started
+struct tls_pressure_stats {
+        unsigned long events; // pressure notifications handled
+        unsigned long pool_pages_released; // pages dropped from page supplier stock
+        unsigned long area_pages_released; // private pages dropped from idle reclaimable areas
+        unsigned long area_pages_spilled; // cold pages moved to spill files
+};
+
+// define spill report - cumulative since the spill file was opened
+struct tls_spill_stats {
+        unsigned long pages_out; // pages written to the spill file
+        unsigned long pages_in; // pages loaded back
+        unsigned long pages_dropped; // cold zero pages released without writing
+        unsigned int slots_used; // slots holding spilled pages
+        unsigned int slots; // size of the spill file in pages
+};
+
+// define counters - written by the owner of an area only, read by the stats exporter
+struct tls_counters {
+        unsigned long reads;
+        unsigned long writes;
+        unsigned long bytes_read;
+        unsigned long bytes_written;
+        unsigned long mprotects; // protection changes issued by tls_read/tls_write
+        unsigned long cow_copies;
+};
+
+// define per area entry of a stats segment
+struct tls_stats_thread {
+        pid_t ktid;
+        unsigned int page_num;
+        unsigned long resident_bytes; // faulted-in bytes - shared pages count for every sharer
+        unsigned int shared_pages;
+        unsigned int spilled_pages;
+        struct tls_counters counters;
+};
+
+// define stats segment - rewritten by the exporter under a seqlock, readers retry instead of blocking it
+struct tls_stats_shm {
+        unsigned int magic;
+        unsigned int version;
+        unsigned long seq; // odd while an update is being written
+        pid_t pid;
+        unsigned int interval_ms;
+        unsigned long updated_ns; // CLOCK_MONOTONIC time of the last update
+        unsigned long updates;
+        unsigned int areas; // live areas of all domains
+        unsigned long bytes; // bytes committed to live areas
+        unsigned long resident_bytes;
+        struct tls_counters totals; // live and destroyed areas
+        unsigned int thread_num; // entries used in threads
+        struct tls_stats_thread threads[TLS_STATS_THREADS];
+};
+
+// domains
+tls_domain_t* tls_domain_create(const struct tls_domain_config* config);
+int tls_domain_destroy(tls_domain_t* dom);
+int tls_page_supplier_start(unsigned int stock);
+void tls_page_supplier_stop();
+
+// API on a domain
+int tls_create_in(tls_domain_t* dom, unsigned int size);
+int tls_create_parallel_in(tls_domain_t* dom, unsigned int size, const char* init_src, unsigned int nthreads);
+int tls_destroy_in(tls_domain_t* dom);
+int tls_destroy_many_in(tls_domain_t* dom, const pthread_t* tids, unsigned int n);
+int tls_read_in(tls_domain_t* dom, unsigned int offset, unsigned int length, char* buffer);
+int tls_write_in(tls_domain_t* dom, unsigned int offset, unsigned int length, char* buffer);
+int tls_clone_in(tls_domain_t* dom, pthread_t tid);
+int tls_clone_range_in(tls_domain_t* dom, pthread_t tid, const struct tls_range* ranges, unsigned int range_num);
+int tls_splice_to_pipe_in(tls_domain_t* dom, int pipe_fd, unsigned int offset, unsigned int length);
+int tls_splice_release_in(tls_domain_t* dom);
+int tls_checkpoint_async_in(tls_domain_t* dom, int fd, void (*callback)(int, void*), void* arg);
+int tls_compact_in(tls_domain_t* dom, struct tls_compact_stats* stats);
+void tls_compact_threshold_in(tls_domain_t* dom, unsigned int splits);
+int tls_freeze_in(tls_domain_t* dom, int flags);
+int tls_read_from_in(tls_domain_t* dom, pthread_t tid, unsigned int offset, unsigned int length, char* buffer);
+int tls_wait_change_in(tls_domain_t* dom, pthread_t tid, unsigned int offset, unsigned int length, int timeout_ms);
+int tls_create_durable_in(tls_domain_t* dom, unsigned int size, const char* path);
+int tls_sync_in(tls_domain_t* dom);
+int tls_sync_policy_in(tls_domain_t* dom, unsigned int pages, unsigned int interval_ms);
+int tls_set_reclaimable_in(tls_domain_t* dom, int reclaimable);
+int tls_profile_report_in(tls_domain_t* dom, FILE* out);
+int tls_spill_open_in(tls_domain_t* dom, const char* path);
+int tls_spill_close_in(tls_domain_t* dom);
+long tls_spill_cold_in(tls_domain_t* dom);
+int tls_spill_stats_in(tls_domain_t* dom, struct tls_spill_stats* stats);
+int tls_set_spillable_in(tls_domain_t* dom, unsigned int idle_passes);
+void tls_counters_in(tls_domain_t* dom, struct tls_counters* counters);
+int tls_percpu_create_in(tls_domain_t* dom, unsigned int size);
+int tls_percpu_destroy_in(tls_domain_t* dom);
+int tls_percpu_add_in(tls_domain_t* dom, unsigned int offset, long delta);
+int tls_percpu_cas_in(tls_domain_t* dom, unsigned int offset, long* expected, long desired);
+int tls_percpu_sum_in(tls_domain_t* dom, unsigned int offset, long* sum);
+int tls_percpu_read_in(tls_domain_t* dom, unsigned int cpu, unsigned int offset, unsigned int length, char* buffer);
+int tls_percpu_cpus_in(tls_domain_t* dom);
+
+// API on the default domain
+int tls_create(unsigned int size);
+int tls_create_parallel(unsigned int size, const char* init_src, unsigned int nthreads);
+int tls_destroy();
+int tls_destroy_many(const pthread_t* tids, unsigned int n);
+int tls_read(unsigned int offset, unsigned int length, char* buffer);
+int tls_write(unsigned int offset, unsigned int length, char* buffer);
+int tls_clone(pthread_t tid);
+int tls_clone_range(pthread_t tid, const struct tls_range* ranges, unsigned int range_num);
+int tls_splice_to_pipe(int pipe_fd, unsigned int offset, unsigned int length);
+int tls_splice_release();
+int tls_checkpoint_async(int fd, void (*callback)(int, void*), void* arg);
+int tls_compact(struct tls_compact_stats* stats);
+void tls_compact_threshold(unsigned int splits);
+int tls_freeze(int flags);
+int tls_read_from(pthread_t tid, unsigned int offset, unsigned int length, char* buffer);
+int tls_wait_change(pthread_t tid, unsigned int offset, unsigned int length, int timeout_ms);
+int tls_create_durable(unsigned int size, const char* path);
+int tls_sync();
+int tls_sync_policy(unsigned int pages, unsigned int interval_ms);
+int tls_set_reclaimable(int reclaimable);
+int tls_profile_report(FILE* out);
+int tls_spill_open(const char* path);
+int tls_spill_close();
+long tls_spill_cold();
+int tls_spill_stats(struct tls_spill_stats* stats);
+int tls_set_spillable(unsigned int idle_passes);
+void tls_counters(struct tls_counters* counters);
+int tls_percpu_create(unsigned int size);
+int tls_percpu_destroy();
+int tls_percpu_add(unsigned int offset, long delta);
+int tls_percpu_cas(unsigned int offset, long* expected, long desired);
+int tls_percpu_sum(unsigned int offset, long* sum);
+int tls_percpu_read(unsigned int cpu, unsigned int offset, unsigned int length, char* buffer);
+int tls_percpu_cpus();
+
+// process wide
+int tls_profile_start(unsigned int interval);
+void tls_profile_stop();
+int tls_pressure_monitor_start(unsigned int stall_us, unsigned int window_us, void (*callback)(const struct tls_pressure_stats*, void*), void* arg);
+void tls_pressure_monitor_stop();
+void tls_pressure_stats(struct tls_pressure_stats* stats);
+int tls_stats_export_start(const char* name, unsigned int interval_ms);
+void tls_stats_export_stop();
+
+// define fast path view of an area - kept up to date by the library, read by the inline calls below
+struct tls_fast {
+        unsigned int size;
+        unsigned int page_size;
+        unsigned int color; // offset 0 lies this many bytes into the first page
+        char** pages; // pages the owner may copy to and from directly, NULL entries take the call - NULL while the whole area does
+        struct tls_counters* counters;
+};
+
+// define per thread fast path cache - area of the last domain the thread used tls_read_in/tls_write_in on
+struct tls_fast_cache {
+        const tls_domain_t* domain;
+        struct tls_fast* view;
+        unsigned long gen;
+};
+
+extern __thread struct tls_fast_cache tls_fast_cache;
+extern unsigned long tls_fast_gen; // advanced when areas are destroyed by another thread - drops all caches
+
+// helper function to get the address of a range the current thread may copy directly - NULL takes the call
+// only areas of TLS_PROTECT_NONE domains are copied directly, protected pages always need tls_read_in/tls_write_in
+static inline char* tls_fast_address(const struct tls_fast_cache* c, const tls_domain_t* dom, unsigned int offset, unsigned int length) {
+        if (c->view == NULL || c->domain != dom || c->gen != __atomic_load_n(&tls_fast_gen, __ATOMIC_ACQUIRE)) {
+                return NULL;
+        }
+        struct tls_fast* f = c->view;
+        char** pages = __atomic_load_n(&f->pages, __ATOMIC_ACQUIRE);
+        if (pages == NULL || length == 0 || offset + length > f->size || offset + length < offset) {
+                return NULL;
+        }
+        unsigned int at = offset + f->color;
+        unsigned int pn = at / f->page_size;
+        if ((at + length - 1) / f->page_size != pn) {
+                return NULL; // spans pages
+        }
+        char* page = __atomic_load_n(&pages[pn], __ATOMIC_ACQUIRE);
+        return page == NULL ? NULL : page + at % f->page_size;
+}
+
+// helper function to count an access taken on the fast path - single writer like the library's counters
+static inline void tls_fast_count(unsigned long* ops, unsigned long* bytes, unsigned int length) {
+        __atomic_store_n(ops, *ops + 1, __ATOMIC_RELAXED);
+        __atomic_store_n(bytes, *bytes + length, __ATOMIC_RELAXED);
+}
+
+// tls_read_fast_in - tls_read_in that copies in place when the range lies in one private page of a TLS_PROTECT_NONE domain
+static inline int tls_read_fast_in(tls_domain_t* dom, unsigned int offset, unsigned int length, char* buffer) {
+        const struct tls_fast_cache* c = &tls_fast_cache;
+        char* src = tls_fast_address(c, dom, offset, length);
+        if (src == NULL) {
+                return tls_read_in(dom, offset, length, buffer);
+        }
+        memcpy(buffer, src, length);
+        tls_fast_count(&c->view->counters->reads, &c->view->counters->bytes_read, length);
+        return 0;
+}
+
+// tls_write_fast_in - tls_write_in that copies in place when the range lies in one private page of a TLS_PROTECT_NONE domain
+static inline int tls_write_fast_in(tls_domain_t* dom, unsigned int offset, unsigned int length, const char* buffer) {
+        const struct tls_fast_cache* c = &tls_fast_cache;
+        char* dst = tls_fast_address(c, dom, offset, length);
+        if (dst == NULL) {
+                return tls_write_in(dom, offset, length, (char*)buffer);
+        }
+        memcpy(dst, buffer, length);
+        tls_fast_count(&c->view->counters->writes, &c->view->counters->bytes_written, length);
+        return 0;
+}
+
+#endif
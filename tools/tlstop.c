@@ -0,0 +1,187 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include "../tls.h"
+
+// tlstop - live view of a process exporting tls stats with tls_stats_export_start
+// reads the shared memory segment only, the target process is never called or stopped
+
+// copy a consistent snapshot - seqlock reader, retries while the exporter writes
+int snapshot(const struct tls_stats_shm* shm, struct tls_stats_shm* out) {
+        int tries;
+        for (tries=0; tries<1000; tries++) {
+                unsigned long seq = __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE);
+                if (seq & 1) {
+                        usleep(100);
+                        continue;
+                }
+                memcpy(out, shm, sizeof(*out));
+                __atomic_thread_fence(__ATOMIC_ACQUIRE);
+                if (__atomic_load_n(&shm->seq, __ATOMIC_RELAXED) == seq) {
+                        return 0;
+                }
+        }
+        return -1;
+}
+
+// helper function to get monotonic time in nanoseconds
+unsigned long now_ns() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (unsigned long)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+// format a value with a binary or decimal unit suffix
+const char* human(char* buf, double v, int binary) {
+        const char* units = binary ? " KMGT" : " kMGT";
+        double step = binary ? 1024 : 1000;
+        int u = 0;
+        while (v >= step && u < 4) {
+                v /= step;
+                u++;
+        }
+        if (u == 0) {
+                snprintf(buf, 16, "%.0f", v);
+        } else {
+                snprintf(buf, 16, "%.1f%c%s", v, units[u], binary ? "i" : "");
+        }
+        return buf;
+}
+
+// rate of a counter between two snapshots
+double rate(unsigned long cur, unsigned long prev, double secs) {
+        return cur >= prev && secs > 0 ? (cur - prev) / secs : 0;
+}
+
+// find entry of a thread in the previous snapshot
+const struct tls_stats_thread* find_thread(const struct tls_stats_shm* s, pid_t ktid) {
+        unsigned int i;
+        for (i=0; i<s->thread_num; i++) {
+                if (s->threads[i].ktid == ktid) {
+                        return &s->threads[i];
+                }
+        }
+        return NULL;
+}
+
+// draw one screen
+void draw(const struct tls_stats_shm* cur, const struct tls_stats_shm* prev, unsigned int top, int clear) {
+        char a[16], b[16], c[16], d[16], e[16];
+        double secs = prev ? (cur->updated_ns - prev->updated_ns) / 1e9 : 0;
+        const struct tls_counters* t = &cur->totals;
+        const struct tls_counters* p = prev ? &prev->totals : t;
+
+        if (clear) {
+                printf("\033[H\033[J");
+        }
+        int alive = kill(cur->pid, 0) == 0;
+        double age = (now_ns() - cur->updated_ns) / 1e9;
+        printf("tlstop - pid %d%s, %u areas, %sB committed, %sB resident, updated %.1fs ago%s\n",
+               cur->pid, alive ? "" : " (exited)", cur->areas, human(a, cur->bytes, 1), human(b, cur->resident_bytes, 1), age,
+               age > 3.0 * cur->interval_ms / 1000 ? " (stale)" : "");
+        printf("  reads/s %s  writes/s %s  bytes/s %sB  mprotects/s %s  CoW copies/s %s\n\n",
+               human(a, rate(t->reads, p->reads, secs), 0),
+               human(b, rate(t->writes, p->writes, secs), 0),
+               human(c, rate(t->bytes_read + t->bytes_written, p->bytes_read + p->bytes_written, secs), 1),
+               human(d, rate(t->mprotects, p->mprotects, secs), 0),
+               human(e, rate(t->cow_copies, p->cow_copies, secs), 0));
+
+        printf("%8s %8s %10s %7s %8s %9s %9s %10s %9s %8s\n",
+               "KTID", "PAGES", "RESIDENT", "SHARED", "SPILLED", "READS/s", "WRITES/s", "BYTES/s", "MPROT/s", "COW/s");
+        unsigned int i;
+        for (i=0; i<cur->thread_num && i<top; i++) {
+                const struct tls_stats_thread* th = &cur->threads[i];
+                const struct tls_stats_thread* pt = prev ? find_thread(prev, th->ktid) : NULL;
+                const struct tls_counters* pc = pt ? &pt->counters : &th->counters;
+                char f[16], g[16];
+                printf("%8d %8u %10s %7u %8u %9s %9s %10s %9s %8s\n",
+                       th->ktid, th->page_num, human(a, th->resident_bytes, 1), th->shared_pages, th->spilled_pages,
+                       human(b, rate(th->counters.reads, pc->reads, secs), 0),
+                       human(c, rate(th->counters.writes, pc->writes, secs), 0),
+                       human(d, rate(th->counters.bytes_read + th->counters.bytes_written, pc->bytes_read + pc->bytes_written, secs), 1),
+                       human(f, rate(th->counters.mprotects, pc->mprotects, secs), 0),
+                       human(g, rate(th->counters.cow_copies, pc->cow_copies, secs), 0));
+        }
+        fflush(stdout);
+}
+
+// print usage
+void usage(const char* prog) {
+        fprintf(stderr,
+                "usage: %s [options] name\n"
+                "  -i ms             refresh interval (1000)\n"
+                "  -n threads        threads shown (20)\n"
+                "  -c count          screens to draw, then exit (0 = until interrupted)\n"
+                "name is the segment given to tls_stats_export_start, e.g. /tls-1234\n",
+                prog);
+        exit(2);
+}
+
+int main(int argc, char** argv) {
+        unsigned int interval_ms = 1000, top = 20, count = 0;
+        int c;
+        while ((c = getopt(argc, argv, "i:n:c:")) != -1) {
+                switch (c) {
+                case 'i':
+                        interval_ms = atoi(optarg);
+                        break;
+                case 'n':
+                        top = atoi(optarg);
+                        break;
+                case 'c':
+                        count = atoi(optarg);
+                        break;
+                default:
+                        usage(argv[0]);
+                }
+        }
+        if (optind != argc - 1 || interval_ms == 0) {
+                usage(argv[0]);
+        }
+
+        int fd = shm_open(argv[optind], O_RDONLY, 0);
+        if (fd < 0) {
+                perror("ERROR: Could not open stats segment.");
+                return 1;
+        }
+        struct tls_stats_shm* shm = mmap(0, sizeof(struct tls_stats_shm), PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (shm == MAP_FAILED) {
+                perror("ERROR: Could not map stats segment.");
+                return 1;
+        }
+        if (shm->magic != TLS_STATS_MAGIC || shm->version != TLS_STATS_VERSION) {
+                fprintf(stderr, "tlstop: %s is not a tls stats segment of version %d\n", argv[optind], TLS_STATS_VERSION);
+                return 1;
+        }
+
+        // rates need two updates - keep the previous one
+        static struct tls_stats_shm cur, prev;
+        int have_prev = 0;
+        int clear = isatty(STDOUT_FILENO);
+        unsigned int drawn = 0;
+        while (count == 0 || drawn < count) {
+                if (snapshot(shm, &cur)) {
+                        fprintf(stderr, "tlstop: exporter is not finishing its updates\n");
+                        return 1;
+                }
+                if (cur.updates > 0 && (!have_prev || cur.updates != prev.updates)) {
+                        draw(&cur, have_prev ? &prev : NULL, top, clear);
+                        drawn++;
+                        prev = cur;
+                        have_prev = 1;
+                }
+                if (count == 0 || drawn < count) {
+                        usleep(interval_ms * 1000);
+                }
+        }
+        return 0;
+}